@@ -0,0 +1,92 @@
+// -*- mode:objc -*-
+/*
+ **  AsciiScan.h
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Finds the end of a run of printable ASCII bytes in the
+ **    input stream. The common case of a big burst of plain text is checked
+ **    16 bytes at a time with SSE2 or NEON where available, falling back to a
+ **    byte-at-a-time loop (e.g., on PPC). This header is plain C so it can be
+ **    shared with the benchmarks in tests/.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ASCII_SCAN_H
+#define ASCII_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// True for bytes that decode_ascii_string accepts: 0x20 through 0x7f.
+#define IS_ASCII_RUN_BYTE(c) ((c) >= 0x20 && (c) <= 0x7f)
+
+// Reference implementation. Also used for the tail of the SIMD versions.
+static inline size_t AsciiRunLengthScalar(const unsigned char *datap,
+                                          size_t datalen)
+{
+    size_t i = 0;
+    while (i < datalen && IS_ASCII_RUN_BYTE(datap[i])) {
+        ++i;
+    }
+    return i;
+}
+
+// Returns the number of leading bytes of datap that are in [0x20, 0x7f].
+//
+// Both vector versions rely on the same trick: viewed as signed chars, the
+// bytes we accept are exactly those greater than 0x1f, since anything with
+// the high bit set is negative. So one compare classifies 16 bytes.
+static inline size_t AsciiRunLength(const unsigned char *datap, size_t datalen)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i kLowest = _mm_set1_epi8(0x1f);
+    while (i + 16 <= datalen) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(datap + i));
+        int mask = _mm_movemask_epi8(_mm_cmpgt_epi8(bytes, kLowest));
+        if (mask != 0xffff) {
+            // The lowest clear bit is the first byte that ends the run.
+            return i + __builtin_ctz(~mask);
+        }
+        i += 16;
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    const int8x16_t kLowest = vdupq_n_s8(0x1f);
+    while (i + 16 <= datalen) {
+        int8x16_t bytes = vreinterpretq_s8_u8(vld1q_u8(datap + i));
+        uint64x2_t ok = vreinterpretq_u64_u8(vcgtq_s8(bytes, kLowest));
+        if ((vgetq_lane_u64(ok, 0) & vgetq_lane_u64(ok, 1)) != UINT64_MAX) {
+            // Some byte in this block ends the run; find it below.
+            break;
+        }
+        i += 16;
+    }
+#endif
+    return i + AsciiRunLengthScalar(datap + i, datalen - i);
+}
+
+#endif  // ASCII_SCAN_H
@@ -0,0 +1,107 @@
+// -*- mode:objc -*-
+/*
+ **  DWCScan.h
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Finds cells with a given code (in practice DWC_RIGHT, the
+ **    right half of a double-width character) in an array of screen_char_t.
+ **    Most lines have none, so the cells are checked 8 at a time with SSE2
+ **    or NEON where available, falling back to a cell-at-a-time loop (e.g.,
+ **    on PPC). This header is plain C so it can be shared with the benchmarks
+ **    in tests/.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DWC_SCAN_H
+#define DWC_SCAN_H
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Cells are 8 bytes with a 16-bit code in the first two, like screen_char_t.
+// This is the distance between codes in uint16_ts.
+#define DWC_SCAN_CELL_STRIDE 4
+
+// Reference implementation. Also used for the tail of the SIMD versions.
+static inline int FirstCellWithCodeScalar(const uint16_t *codes,
+                                          int n,
+                                          uint16_t value)
+{
+    int i = 0;
+    while (i < n && codes[i * DWC_SCAN_CELL_STRIDE] != value) {
+        ++i;
+    }
+    return i;
+}
+
+// Returns the index of the first of the n cells whose code (codes points at
+// the first one's) is value, or n if there is none.
+//
+// A 16-byte vector holds two cells, so the code is in 16-bit lanes 0 and 4
+// and the other lanes (attributes) are masked off. Four vectors are compared
+// per step; once one of them matches, the scalar loop finds the exact cell.
+static inline int FirstCellWithCode(const uint16_t *codes, int n, uint16_t value)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i kValue = _mm_set1_epi16(value);
+    const int kCodeBytes = 0x0303;  // movemask bits of lanes 0 and 4
+    while (i + 8 <= n) {
+        const __m128i *p = (const __m128i *)(codes + i * DWC_SCAN_CELL_STRIDE);
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi16(_mm_loadu_si128(p), kValue),
+                         _mm_cmpeq_epi16(_mm_loadu_si128(p + 1), kValue)),
+            _mm_or_si128(_mm_cmpeq_epi16(_mm_loadu_si128(p + 2), kValue),
+                         _mm_cmpeq_epi16(_mm_loadu_si128(p + 3), kValue)));
+        if (_mm_movemask_epi8(hits) & kCodeBytes) {
+            break;
+        }
+        i += 8;
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    static const uint16_t kLanes[8] = { 0xffff, 0, 0, 0, 0xffff, 0, 0, 0 };
+    const uint16x8_t kCodeLanes = vld1q_u16(kLanes);
+    const uint16x8_t kValue = vdupq_n_u16(value);
+    while (i + 8 <= n) {
+        const uint16_t *p = codes + i * DWC_SCAN_CELL_STRIDE;
+        uint16x8_t hits = vorrq_u16(
+            vorrq_u16(vceqq_u16(vld1q_u16(p), kValue),
+                      vceqq_u16(vld1q_u16(p + 8), kValue)),
+            vorrq_u16(vceqq_u16(vld1q_u16(p + 16), kValue),
+                      vceqq_u16(vld1q_u16(p + 24), kValue)));
+        uint64x2_t any = vreinterpretq_u64_u16(vandq_u16(hits, kCodeLanes));
+        if (vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) {
+            break;
+        }
+        i += 8;
+    }
+#endif
+    return i + FirstCellWithCodeScalar(codes + i * DWC_SCAN_CELL_STRIDE,
+                                       n - i,
+                                       value);
+}
+
+#endif  // DWC_SCAN_H
@@ -0,0 +1,106 @@
+// -*- mode:objc -*-
+/*
+ **  DoubleByteTable.h
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Lookup tables for decoding the legacy CJK multibyte
+ **    encodings (GB, Big5, EUC-JP, Shift-JIS, EUC-KR, and their Mac and DOS
+ **    variants) straight to UTF-16, so runs of them don't go through
+ **    -[NSString initWithBytes:length:encoding:]. A table is built once per
+ **    encoding from the system's own converter, so it agrees with NSString.
+ **    Characters the table doesn't have (three- and four-byte sequences,
+ **    ones that map to more than one code unit, or ones that Unicode
+ **    normalization might change) end a run and take the NSString path.
+ **    The inline decoders are plain C so the benchmarks in tests/ can use
+ **    them.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DOUBLE_BYTE_TABLE_H
+#define DOUBLE_BYTE_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __OBJC__
+#import <Foundation/Foundation.h>
+#endif
+
+// A table has 65536 entries. A byte b >= 0x80 that is a character by itself
+// is at index b; a two-byte character is at (lead << 8) | trail. 0 means
+// "not in the table".
+#define DOUBLE_BYTE_TABLE_SIZE 65536
+
+#ifdef __OBJC__
+// Returns the table for |encoding|, building it the first time (which takes
+// a few milliseconds), or NULL if the encoding isn't a stateless multibyte
+// encoding. Tables are never freed. Call only on the main thread.
+const uint16_t *DoubleByteTableForEncoding(NSStringEncoding encoding);
+#endif
+
+// Returns the number of leading bytes of datap that are characters in
+// |table|. A lead byte at the very end isn't counted, so the caller can
+// wait for its trail byte.
+static inline size_t DoubleByteRunLength(const uint16_t *table,
+                                         const unsigned char *datap,
+                                         size_t datalen)
+{
+    size_t i = 0;
+
+    while (i < datalen) {
+        unsigned char c = datap[i];
+        if (c < 0x80) {
+            break;
+        }
+        if (table[c]) {
+            i++;
+        } else if (i + 1 < datalen && table[(c << 8) | datap[i + 1]]) {
+            i += 2;
+        } else {
+            break;
+        }
+    }
+    return i;
+}
+
+// Decodes a run that DoubleByteRunLength accepted into UTF-16, which must
+// have room for datalen elements. Returns the number written.
+static inline size_t DoubleByteDecodeRun(const uint16_t *table,
+                                         const unsigned char *datap,
+                                         size_t datalen,
+                                         uint16_t *out)
+{
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < datalen) {
+        unsigned char c = datap[i];
+        if (table[c]) {
+            out[o++] = table[c];
+            i++;
+        } else {
+            out[o++] = table[(c << 8) | datap[i + 1]];
+            i += 2;
+        }
+    }
+    return o;
+}
+
+#endif  // DOUBLE_BYTE_TABLE_H
@@ -0,0 +1,141 @@
+// -*- mode:objc -*-
+/*
+ **  DoubleByteTable.m
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Builds the tables described in DoubleByteTable.h.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#import "DoubleByteTable.h"
+#import "Utf8Scan.h"
+
+// Enough for every encoding a session can be set to.
+#define MAX_DOUBLE_BYTE_TABLES 32
+
+typedef struct {
+    NSStringEncoding encoding;
+    uint16_t *table;
+} DoubleByteTableEntry;
+
+static DoubleByteTableEntry gTables[MAX_DOUBLE_BYTE_TABLES];
+static int gNumTables;
+
+// Encodings that shift between character sets with escape sequences. The
+// meaning of a byte depends on what came before it, so a table can't work.
+static BOOL IsStatefulEncoding(CFStringEncoding cfEncoding)
+{
+    switch (cfEncoding) {
+        case kCFStringEncodingISO_2022_JP:
+        case kCFStringEncodingISO_2022_JP_1:
+        case kCFStringEncodingISO_2022_JP_2:
+        case kCFStringEncodingISO_2022_JP_3:
+        case kCFStringEncodingISO_2022_CN:
+        case kCFStringEncodingISO_2022_CN_EXT:
+        case kCFStringEncodingISO_2022_KR:
+        case kCFStringEncodingHZ_GB_2312:
+            return YES;
+        default:
+            return NO;
+    }
+}
+
+// Converts |length| bytes to a single UTF-16 code unit. Returns 0 if they
+// aren't exactly one character, or if it isn't one that can skip
+// normalization.
+static uint16_t ConvertCharacter(const unsigned char *bytes,
+                                 int length,
+                                 CFStringEncoding cfEncoding)
+{
+    CFStringRef string = CFStringCreateWithBytes(kCFAllocatorDefault,
+                                                 bytes,
+                                                 length,
+                                                 cfEncoding,
+                                                 false);
+    uint16_t result = 0;
+
+    if (!string) {
+        return 0;
+    }
+    if (CFStringGetLength(string) == 1) {
+        UniChar c = CFStringGetCharacterAtIndex(string, 0);
+        if (c != 0xfffd && Utf8IsSimpleCodePoint(c)) {
+            result = c;
+        }
+    }
+    CFRelease(string);
+    return result;
+}
+
+static uint16_t *BuildTable(CFStringEncoding cfEncoding)
+{
+    uint16_t *table = (uint16_t *)calloc(DOUBLE_BYTE_TABLE_SIZE, sizeof(uint16_t));
+    unsigned char bytes[2];
+    int lead;
+    int trail;
+
+    if (!table) {
+        return NULL;
+    }
+    for (lead = 0x80; lead <= 0xff; lead++) {
+        bytes[0] = lead;
+        table[lead] = ConvertCharacter(bytes, 1, cfEncoding);
+    }
+    for (lead = 0x80; lead <= 0xff; lead++) {
+        if (table[lead]) {
+            // A character by itself, so it can't begin a pair.
+            continue;
+        }
+        bytes[0] = lead;
+        for (trail = 0x21; trail <= 0xfe; trail++) {
+            bytes[1] = trail;
+            table[(lead << 8) | trail] = ConvertCharacter(bytes, 2, cfEncoding);
+        }
+    }
+    return table;
+}
+
+const uint16_t *DoubleByteTableForEncoding(NSStringEncoding encoding)
+{
+    CFStringEncoding cfEncoding = CFStringConvertNSStringEncodingToEncoding(encoding);
+    uint16_t *table;
+    int i;
+
+    if (cfEncoding == kCFStringEncodingInvalidId ||
+        IsStatefulEncoding(cfEncoding)) {
+        return NULL;
+    }
+    for (i = 0; i < gNumTables; i++) {
+        if (gTables[i].encoding == encoding) {
+            return gTables[i].table;
+        }
+    }
+    if (gNumTables == MAX_DOUBLE_BYTE_TABLES) {
+        return NULL;
+    }
+    table = BuildTable(cfEncoding);
+    if (table) {
+        gTables[gNumTables].encoding = encoding;
+        gTables[gNumTables].table = table;
+        gNumTables++;
+    }
+    return table;
+}
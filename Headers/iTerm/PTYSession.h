@@ -31,7 +31,9 @@
 #import "WindowControllerInterface.h"
 #import "TextViewWrapper.h"
 #import "FindViewController.h"
+#import "VT100TokenQueue.h"
 
+#include <mach/mach_time.h>
 #include <sys/time.h>
 
 #define NSLeftAlternateKeyMask  (0x000020 | NSAlternateKeyMask)
@@ -58,9 +60,47 @@ static const float kFastTimerIntervalSec = 1.0 / 30.0;
 // so it must run often enough for that to be useful.
 // TODO(georgen): There's room for improvement here.
 static const float kBackgroundSessionIntervalSec = 1;
+// Timer period while output floods in (see firehose_). Frames in between
+// would be out of date before anyone could read them.
+static const float kFirehoseTimerIntervalSec = 1.0 / 4.0;
 
 @class PTYTab;
 @class SessionView;
+
+// Kinds of tokens counted in PTYSessionStatistics.
+typedef enum {
+    kSessionTokenText,     // Runs of printable characters
+    kSessionTokenControl,  // C0 control characters
+    kSessionTokenCSI,      // VT100 and ANSI escape and control sequences
+    kSessionTokenXterm,    // OSC sequences: titles, colors, and so on
+    kSessionTokenOther,    // Everything else, including invalid input
+    kSessionTokenTypes
+} PTYSessionTokenType;
+
+// Counters that are always kept for each session so you can tell which one
+// is using the CPU. Times are in seconds.
+typedef struct {
+    long long bytesRead;
+    long long tokens[kSessionTokenTypes];
+    double parseTime;       // In VT100Terminal, on either thread
+    double putTokensTime;   // Applying tokens to the screen
+    double refreshTime;     // In -[PTYTextView refresh]
+    double drawTime;        // In -[PTYTextView drawRect:]
+    long long framesDrawn;
+    long long framesSkipped;  // Display updates that found nothing to draw
+} PTYSessionStatistics;
+
+// A cheap monotonic clock for timing statistics, in seconds.
+static inline double PTYSessionStatisticsClock(void)
+{
+    static double secondsPerTick;
+    if (!secondsPerTick) {
+        mach_timebase_info_data_t info;
+        mach_timebase_info(&info);
+        secondsPerTick = 1e-9 * info.numer / info.denom;
+    }
+    return mach_absolute_time() * secondsPerTick;
+}
 @interface PTYSession : NSResponder <FindViewControllerDelegate>
 {
     // Owning tab.
@@ -206,6 +246,35 @@ static const float kBackgroundSessionIntervalSec = 1;
     // After receiving new output, we keep running the updateDisplay timer for a few seconds to catch
     // changes in job name.
     NSDate* updateDisplayUntil_;
+
+    // Output is parsed on the TaskNotifier thread and the resulting
+    // VT100TokenBatches are applied on the main thread. streamLock_ guards
+    // TERMINAL's stream, its encoding, and parseStalled_.
+    NSLock* streamLock_;
+    // Parsed batches, from the TaskNotifier thread to the main thread.
+    VT100TokenQueue tokenQueue_;
+    // Applied batches going back for reuse.
+    VT100TokenQueue freeBatches_;
+    // A batch the TaskNotifier thread got but didn't need.
+    void* spareBatch_;
+    // Set when tokenQueue_ fills up. Reading stops and the main thread
+    // parses what's left once it has caught up.
+    BOOL parseStalled_;
+    // Nonzero while a call to apply batches is pending on the main thread.
+    volatile int32_t batchesPosted_;
+
+    // bytesRead and parseTime are guarded by streamLock_. The other fields
+    // are only changed on the main thread.
+    PTYSessionStatistics statistics_;
+
+    // Firehose mode is on while output arrives faster than a threshold. The
+    // display is then updated at kFirehoseTimerIntervalSec and the screen
+    // trims the scrollback once per batch instead of once per line.
+    // Throughput is measured over windows that begin at
+    // firehoseWindowStart_.
+    BOOL firehose_;
+    double firehoseWindowStart_;
+    long long firehoseWindowBytes_;
 }
 
 // Return the current pasteboard value as a string.
@@ -267,6 +336,9 @@ static const float kBackgroundSessionIntervalSec = 1;
 // PTYTask
 - (void)writeTask:(NSData*)data;
 - (void)readTask:(NSData*)data;
+- (unsigned char*)taskReadBufferWithSpace:(int)length;
+- (void)taskDidReadLength:(int)length;
+- (BOOL)taskWantsRead;
 - (void)brokenPipe;
 
 // PTYTextView
@@ -359,6 +431,14 @@ static const float kBackgroundSessionIntervalSec = 1;
 - (void)setAddressBookEntry:(NSDictionary*)entry;
 - (NSString *)tty;
 - (NSString *)contents;
+
+// Returns a copy of the session's counters.
+- (PTYSessionStatistics)statistics;
+// The counters formatted as "name: value" lines, for AppleScript.
+- (NSString *)statisticsReport;
+
+// Called by the text view after it draws.
+- (void)textViewDidDrawInSeconds:(double)seconds;
 - (iTermGrowlDelegate*)growlDelegate;
 
 
@@ -476,5 +556,11 @@ static const float kBackgroundSessionIntervalSec = 1;
 - (NSString*)_lang;
 - (NSString*)encodingName;
 - (void)setDvrFrame;
+- (int)_applyQueuedTokenBatches;
+- (void)_applyStream;
+- (void)_applyTokenBatches;
+- (void)_didProcessLength:(int)length;
+- (BOOL)_refreshTextView;
+- (void)_measureThroughput:(int)length;
 
 @end
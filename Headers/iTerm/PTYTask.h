@@ -30,6 +30,8 @@
 /*
     Delegate
         readTask:
+        taskReadBufferWithSpace: (optional, with taskDidReadLength:)
+        taskWantsRead (optional)
         brokenPipe
         closeSession:
 */
@@ -43,12 +45,30 @@
 - (void) closeTab:(PTYTab*)aSession;
 @end
 
+// A delegate that implements these gets its input read() straight into its
+// own buffer instead of receiving readTask:. All three are called on the
+// TaskNotifier thread. taskReadBufferWithSpace: returns a place to read up
+// to |length| bytes, or NULL to fall back to readTask:. When it returns a
+// buffer, taskDidReadLength: always follows with the number of bytes put
+// there, which may be 0. taskWantsRead may return NO to stop reading until
+// resumeReading is called, so that a slow consumer pushes back on the job.
+// The delegate must call setDelegate:nil before it's freed; that waits for
+// any of these calls in progress to finish.
+@interface NSObject (PTYTaskStreamDelegate)
+- (unsigned char*)taskReadBufferWithSpace:(int)length;
+- (void)taskDidReadLength:(int)length;
+- (BOOL)taskWantsRead;
+@end
+
 @interface PTYTask : NSObject
 {
     pid_t pid;
     int fd;
     int status;
     id delegate;
+    // Held by the TaskNotifier thread while it calls the delegate, so that
+    // once setDelegate: returns the old delegate won't be called again.
+    NSLock* delegateLock;
     NSString* tty;
     NSString* path;
     BOOL hasOutput;
@@ -77,6 +97,9 @@
 - (id)delegate;
 - (void)readTask:(NSData*)data;
 - (void)writeTask:(NSData*)data;
+// Makes the TaskNotifier ask wantsRead again, for after the delegate's
+// taskWantsRead has returned NO.
+- (void)resumeReading;
 
 - (void)sendSignal:(int)signo;
 - (void)setWidth:(int)width height:(int)height;
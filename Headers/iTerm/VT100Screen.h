@@ -51,6 +51,43 @@
 // For debugging: log the buffer.
 void DumpBuf(screen_char_t* p, int n);
 
+// Which part of one screen line needs to be redrawn.
+typedef struct {
+    // OR of the dirty values set on cells in the line; 0 if the line is clean.
+    // Bit 1 means the contents changed and bit 2 means only the cursor blinked.
+    int flags;
+    // Only cells in [start, end) can be dirty; dirtyCells says which are.
+    // Undefined if flags is 0.
+    short start;
+    short end;
+} screen_line_dirty_t;
+
+// A reference counted copy of one screen line. Snapshots share them.
+typedef struct screen_snapshot_line screen_snapshot_line_t;
+
+// An immutable copy of the visible screen, returned by -[VT100Screen snapshot].
+// Unlike the screen, it may be read on any thread while the screen keeps
+// changing. Complex characters still refer to the global string table.
+@interface VT100ScreenSnapshot : NSObject
+{
+    int width_;
+    int height_;
+    int cursorX_;
+    int cursorY_;
+    screen_snapshot_line_t **lines_;
+}
+
+// The screen's size and cursor position when the snapshot was taken.
+- (int)width;
+- (int)height;
+- (int)cursorX;
+- (int)cursorY;
+
+// Returns width+1 cells; the last one holds the line's EOL code.
+- (const screen_char_t *)lineAtIndex:(int)y;
+
+@end
+
 // Convert a string into screen_char_t. This deals with padding out double-
 // width characters, joining combining marks, and skipping zero-width spaces.
 //
@@ -83,7 +120,10 @@ void StringToScreenChars(NSString *s,
     int ALT_SAVE_CURSOR_Y;
     int SCROLL_TOP;
     int SCROLL_BOTTOM;
-    NSMutableSet* tabStops;
+    // One bit per column, set where there is a tab stop. Columns past the end
+    // have no tab stop.
+    uint64_t *tabStops;
+    int tabStopWords;
 
     VT100Terminal *TERMINAL;
     PTYTask *SHELL;
@@ -99,25 +139,45 @@ void StringToScreenChars(NSString *s,
     BOOL blinkingCursor;
     PTYTextView *display;
 
-    // A circular buffer exactly (WIDTH+1) * HEIGHT elements in size. This contains
-    // only the contents of the screen. The scrollback buffer is stored in linebuffer.
+    // A buffer exactly (WIDTH+1) * HEIGHT elements in size. This contains
+    // only the contents of the screen, one line per row but not necessarily in
+    // screen order. The scrollback buffer is stored in linebuffer.
     screen_char_t *buffer_lines;
 
-    // The position in buffer_lines of the first line in the screen. The logical lines
-    // wrap around the circular buffer.
-    screen_char_t *screen_top;
+    // HEIGHT row numbers in buffer_lines. Screen line y is in row
+    // lineRows[(topRow + y) % HEIGHT]. Scrolling the whole screen advances
+    // topRow and scrolling a region rotates part of lineRows, so neither moves
+    // any screen_char_t.
+    int *lineRows;
+    int topRow;
+
+    // HEIGHT entries saying which part of each line needs to be redrawn. Entry
+    // i describes row i of buffer_lines, so they move along with the lines when
+    // the screen scrolls.
+    screen_line_dirty_t *dirtyLines;
+
+    // The dirty value of each cell, WIDTH per row and indexed by row like
+    // dirtyLines. Only cells inside their line's span can be nonzero.
+    char *dirtyCells;
 
-    // buffer holding flags for each char on whether it needs to be redrawn
-    char *dirty;
-    // Number of bytes in the dirty array.
-    int dirtySize;
+    // HEIGHT entries giving the lines of the last snapshot, indexed by row of
+    // buffer_lines like dirtyLines. An entry is released when anything marks
+    // its row dirty, so the next snapshot copies only rows that changed.
+    screen_snapshot_line_t **snapshotRows;
 
     // a single default line
     screen_char_t *default_line;
     screen_char_t *result_line;
 
-    // temporary buffer to store main buffer in SAVE_BUFFER/RESET_BUFFER mode
-    screen_char_t *temp_buffer;
+    // The screen that isn't showing: the main screen while the alternate
+    // screen is up, otherwise the alternate screen (NULL until first used).
+    // saveBuffer and restoreBuffer swap these with buffer_lines, lineRows and
+    // topRow instead of copying any lines; saveBuffer blanks the alternate
+    // screen first.
+    screen_char_t *other_buffer_lines;
+    int *other_lineRows;
+    int other_topRow;
+    BOOL showingAltScreen;
 
     // default line stuff
     screen_char_t default_bg_code;
@@ -133,6 +193,12 @@ void StringToScreenChars(NSString *s,
     int scrollback_overflow;
     long long cumulative_scrollback_overflow;
 
+    // Set by the session while output floods in. Lines that scroll off
+    // during putTokens: then go to the scrollback without trimming it to
+    // max_scrollback_lines one at a time; the excess is dropped at the end.
+    BOOL firehose_;
+    BOOL deferScrollbackTrim_;
+
     // print to ansi...
     BOOL printToAnsi;        // YES=ON, NO=OFF, default=NO;
     NSMutableString *printToAnsiString;
@@ -162,6 +228,8 @@ void StringToScreenChars(NSString *s,
 - (int)height;
 - (void)setScrollback:(unsigned int)lines;
 - (void)setUnlimitedScrollback:(BOOL)enable;
+// See firehose_.
+- (void)setFirehose:(BOOL)firehose;
 - (void)setTerminal:(VT100Terminal *)terminal;
 - (VT100Terminal *)terminal;
 - (void)setShellTask:(PTYTask *)shell;
@@ -193,6 +261,10 @@ void StringToScreenChars(NSString *s,
 
 // edit screen buffer
 - (void)putToken:(VT100TCC)token;
+// Applies a batch of tokens from -[VT100Terminal getTokens:max:] in order.
+// Runs of tokens whose effect is overwritten by the last one (e.g., cursor
+// positioning) are applied once.
+- (void)putTokens:(VT100TCC *)tokens count:(int)count;
 - (void)clearBuffer;
 - (long long)absoluteLineNumberOfCursor;
 - (void)clearScrollbackBuffer;
@@ -201,6 +273,16 @@ void StringToScreenChars(NSString *s,
 
 // internal
 - (void)setString:(NSString *)s ascii:(BOOL)ascii;
+// Write the text of a VT100_ASCIISTRING token, which is only ASCII.
+- (void)setASCIIBytes:(const unsigned char *)bytes length:(int)length;
+// Write a run of UTF-8 that VT100Terminal validated and found to need no
+// normalization (a VT100_UTF8STRING token) without making an NSString.
+- (void)setUTF8String:(const unsigned char *)bytes length:(int)length;
+// Write a VT100_DOUBLEBYTESTRING token's run of a legacy CJK encoding,
+// decoding it with |table| (see DoubleByteTable.h).
+- (void)setDoubleByteString:(const unsigned char *)bytes
+                     length:(int)length
+                      table:(const uint16_t *)table;
 - (void)setStringToX:(int)x
                    Y:(int)y
               string:(NSString *)string
@@ -243,12 +325,19 @@ void StringToScreenChars(NSString *s,
 - (int)numberOfLines;
 - (int)numberOfScrollbackLines;
 
+// After a width change only the end of the scrollback is rewrapped right away.
+// Each call rewraps a bounded amount of the rest; returns YES until it's done.
+// numberOfLines may change as a result.
+- (BOOL)continueReflow;
+
 - (int)scrollbackOverflow;
 - (long long)totalScrollbackOverflow;
 - (void)resetScrollbackOverflow;
+// Size of the compressed part of the scrollback before and after compression.
+- (void)getScrollbackCompressionRawBytes:(long long *)rawBytes compressedBytes:(long long *)compressedBytes;
 - (void)scrollScreenIntoScrollbackBuffer:(int)leaving;
 
-// Set a range of bytes to dirty=1
+// Set a range of cells, counted from the top left of the screen, to dirty=1
 - (void)setRangeDirty:(NSRange)range;
 
 // OR in a value into the dirty array at an x,y coordinate
@@ -260,6 +349,10 @@ void StringToScreenChars(NSString *s,
 // Check if any flag is set at an x,y coordinate in the dirty array
 - (BOOL)isDirtyAtX:(int)x Y:(int)y;
 
+// Returns the dirty span of a line on the screen. Lines with flags == 0 can be
+// skipped without looking at their contents.
+- (const screen_line_dirty_t *)dirtyLineAtScreenIndex:(int)y;
+
 - (void)resetDirty;
 - (void)setDirty;
 
@@ -316,5 +409,10 @@ void StringToScreenChars(NSString *s,
 // Load a frame from a dvr decoder.
 - (void)setFromFrame:(screen_char_t*)s len:(int)len info:(DVRFrameInfo)info;
 
+// Returns an immutable copy of the visible screen for work on other threads,
+// such as encoding, searching, or drawing thumbnails. Lines that haven't
+// changed since the previous snapshot are shared with it rather than copied.
+- (VT100ScreenSnapshot *)snapshot;
+
 @end
 
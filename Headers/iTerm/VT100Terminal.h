@@ -29,37 +29,22 @@
 
 #import <Cocoa/Cocoa.h>
 #import "ScreenChar.h"
+#import "VT100Parser.h"
 
 @class VT100Screen;
 
-// VT100TCC types
-#define VT100CC_NULL        0
-#define VT100CC_ENQ         5    // Transmit ANSWERBACK message
-#define VT100CC_BEL         7    // Sound bell
-#define VT100CC_BS          8    // Move cursor to the left
-#define VT100CC_HT          9    // Move cursor to the next tab stop
-#define VT100CC_LF         10    // line feed or new line operation
-#define VT100CC_VT         11    // Same as <LF>.
-#define VT100CC_FF         12    // Same as <LF>.
-#define VT100CC_CR         13    // Move the cursor to the left margin
-#define VT100CC_SO         14    // Invoke the G1 character set
-#define VT100CC_SI         15    // Invoke the G0 character set
-#define VT100CC_DC1        17    // Causes terminal to resume transmission (XON).
-#define VT100CC_DC3        19    // Causes terminal to stop transmitting all codes except XOFF and XON (XOFF).
-#define VT100CC_CAN        24    // Cancel a control sequence
-#define VT100CC_SUB        26    // Same as <CAN>.
-#define VT100CC_ESC        27    // Introduces a control sequence.
-#define VT100CC_DEL       255    // Ignored on input; not stored in buffer.
-
+// VT100TCC types. The C0 controls (VT100CC_*) are in VT100Parser.h.
 #define VT100_WAIT          1000
 #define VT100_NOTSUPPORT    1001
 #define VT100_SKIP          1002
 #define VT100_STRING        1003       // string
-#define VT100_ASCIISTRING   1004       // only for ASCIIs
+#define VT100_ASCIISTRING   1004       // ASCII at position; no u.string
 #define VT100_UNKNOWNCHAR   1005
 #define VT100CSI_DECSET     1006
 #define VT100CSI_DECRST     1007
 #define VT100_INVALID_SEQUENCE  1008
+#define VT100_UTF8STRING    1009       // valid UTF-8 at position; no u.string
+#define VT100_DOUBLEBYTESTRING 1010    // legacy CJK at position; see u.table
 
 #define VT100CSI_CPR         2000       // Cursor Position Report
 #define VT100CSI_CUB         2001       // Cursor Backward
@@ -146,8 +131,14 @@
 // iTerm extension
 #define ITERM_GROWL     5000
 
-#define VT100CSIPARAM_MAX    16
 
+// A token read from the stream. position and length give the bytes it was
+// parsed from. VT100_ASCIISTRING, VT100_UTF8STRING, and
+// VT100_DOUBLEBYTESTRING are spans: their text is those bytes (in ASCII,
+// UTF-8, and a legacy CJK encoding decoded with the DoubleByteTable in
+// u.table) and no NSString is made for them. They are only valid until more
+// data is added to the stream. u.string is used for other strings that
+// needed decoding, titles, and other OSC payloads.
 typedef struct {
     int type;
     unsigned char *position;
@@ -155,6 +146,7 @@ typedef struct {
     union {
     NSString *string;
     unsigned char code;
+    const uint16_t *table;
     struct {
         int p[VT100CSIPARAM_MAX];
         int count;
@@ -164,6 +156,24 @@ typedef struct {
     } u;
 } VT100TCC;
 
+// Tokens parsed on one thread to be applied on another. Unlike tokens from
+// getTokens:max:, these don't depend on the stream: bytes holds a copy of
+// what they were parsed from (their positions point into it) and their
+// strings are retained. Zero it before first use; VT100TokenBatchClear
+// releases the strings so it can be filled again and VT100TokenBatchFree
+// frees it.
+#define VT100_TOKEN_BATCH_SIZE 64
+typedef struct {
+    VT100TCC tokens[VT100_TOKEN_BATCH_SIZE];
+    int count;
+    int length;                 // Stream bytes the tokens were parsed from
+    unsigned char *bytes;
+    int capacity;
+} VT100TokenBatch;
+
+void VT100TokenBatchClear(VT100TokenBatch *batch);
+void VT100TokenBatchFree(VT100TokenBatch *batch);
+
 // character attributes
 #define VT100CHARATTR_ALLOFF   0
 #define VT100CHARATTR_BOLD     1
@@ -275,11 +285,13 @@ typedef enum {
 {
     NSString          *termType;
     NSStringEncoding  ENCODING;
+    const uint16_t    *doubleByteTable;   // For ENCODING, or NULL
     VT100Screen       *SCREEN;
 
     unsigned char     *STREAM;
     int               current_stream_length;
     int               total_stream_length;
+    VT100Parser       parser;
 
     BOOL LINE_MODE;         // YES=Newline, NO=Line feed
     BOOL CURSOR_MODE;       // YES=Application, NO=Cursor
@@ -350,7 +362,30 @@ typedef enum {
 
 - (void)cleanStream;
 - (void)putStreamData:(NSData*)data;
+// Returns a place to write at least |length| bytes of new input, such as with
+// read(). The bytes become part of the stream when appendStreamLength: is
+// called. The stream buffer is reused rather than reallocated, so the pointer
+// is only valid until the next call to either method.
+- (unsigned char *)streamBufferWithSpace:(int)length;
+- (void)appendStreamLength:(int)length;
 - (VT100TCC)getNextToken;
+// Fills |tokens| with up to |maxTokens| tokens, stopping early at VT100_WAIT
+// or the end of the stream. Returns the number of tokens filled in. The tokens
+// may point into the stream, so apply them before adding more data. No token
+// changes how the bytes after it are parsed (see getTokenBatch:), so a batch
+// doesn't need to end at modes, resets or resizes.
+- (int)getTokens:(VT100TCC *)tokens max:(int)maxTokens;
+// Update modes and character attributes for a token. VT100Screen calls this
+// as it applies each token so that a batch of tokens sees the attributes in
+// effect at its own position in the stream.
+- (void)updateStateForToken:(VT100TCC)token;
+// Like getTokens:max:, filling an empty |batch| so that it stays valid after
+// more data is added to the stream. Parsing depends only on the stream, the
+// parser's state and the encoding, and applying a token changes none of
+// them, so this may run on another thread, ahead of the tokens being applied,
+// as long as the caller keeps setEncoding: and the other stream methods from
+// running at the same time.
+- (int)getTokenBatch:(VT100TokenBatch *)batch;
 
 - (void)saveCursorAttributes;
 - (void)restoreCursorAttributes;
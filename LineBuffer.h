@@ -54,6 +54,9 @@ typedef struct FindContext {
     BOOL hasWrapped;   // for client use. Not read or written by LineBuffer.
 } FindContext;
 
+// The number of widths a LineBlock remembers its wrapped line count for.
+#define NUM_LINES_CACHE_SIZE 4
+
 // LineBlock represents an ordered collection of lines of text. It stores them contiguously
 // in a buffer.
 @interface LineBlock : NSObject {
@@ -81,12 +84,51 @@ typedef struct FindContext {
     // If true, then the last raw line does not include a logical newline at its terminus.
     BOOL is_partial;
 
-    // The number of wrapped lines if width==cached_numlines_width.
-    int cached_numlines;
-
-    // This is -1 if the cache is invalid; otherwise it specifies the width for which
-    // cached_numlines is correct.
-    int cached_numlines_width;
+    // The number of wrapped lines at the last few widths the block was
+    // wrapped to. cached_numlines[i] is correct for width cached_numlines_width[i]
+    // unless that is -1. cached_numlines_last is the slot filled most recently
+    // (-1 if none) and cached_numlines_next is the one the next width replaces.
+    int cached_numlines[NUM_LINES_CACHE_SIZE];
+    int cached_numlines_width[NUM_LINES_CACHE_SIZE];
+    int cached_numlines_last;
+    int cached_numlines_next;
+
+    // Raw offsets of the cells whose code is DWC_RIGHT, in increasing order.
+    // They are found as lines are appended. Where lines wrap depends only on
+    // these, so wrapping at a new width doesn't have to read the cells.
+    int* dwc_offsets;
+    int dwc_count;
+    int dwc_capacity;
+
+    // Bit i is set if raw line i may have a DWC_RIGHT cell. Lines without one
+    // wrap every width cells, which can be computed without looking anything
+    // up. Allocated for cll_capacity lines.
+    uint32_t* dwc_line_bits;
+
+    // A block that is no longer appended to may be compacted. Then raw_buffer
+    // and buffer_start are NULL and each cell is stored as its code plus a
+    // one-byte index into a palette of up to 256 distinct attribute
+    // combinations (palette entries have a code of 0). All three arrays are
+    // indexed like raw_buffer. Lines are expanded one at a time by
+    // copyWrappedLineWithWrapWidth; anything that needs a pointer into the
+    // block expands all of it again.
+    unichar* compact_codes;
+    unsigned char* compact_attrs;
+    screen_char_t* compact_palette;
+    int compact_palette_size;
+
+    // A compact block far enough behind the tail is also compressed (see
+    // CompressCells in LineBuffer.m). While compressed_cells is set,
+    // compact_codes and compact_attrs are just a cache of its decompressed
+    // contents: they're rebuilt on demand and freed again by
+    // releaseDecompressedCells.
+    unsigned char* compressed_cells;
+    int compressed_length;
+
+    // If the compressed cells were spilled to disk, compressed_cells points
+    // into this read-only mapping of the spill file.
+    void* spill_mapping;
+    size_t spill_mapping_length;
 }
 
 - (LineBlock*) initWithRawBufferSize: (int) size;
@@ -102,12 +144,21 @@ typedef struct FindContext {
 // If the line is not present, decrement *lineNum by the number of lines in this block and return NULL.
 - (screen_char_t*) getWrappedLineWithWrapWidth: (int) width lineNum: (int*) lineNum lineLength: (int*) lineLength includesEndOfLine: (int*) includesEndOfLine;
 
+// Like getWrappedLineWithWrapWidth but copies the line into buffer, which
+// doesn't require expanding a compact block. Returns the number of cells
+// copied, or -1 (after decrementing *lineNum) if the line isn't in this block.
+- (int) copyWrappedLineWithWrapWidth: (int) width lineNum: (int*) lineNum toBuffer: (screen_char_t*) buffer includesEndOfLine: (int*) includesEndOfLine;
+
 // Get the number of lines in this block at a given screen width.
 - (int) getNumLinesWithWrapWidth: (int) width;
 
 // Returns whether getNumLinesWithWrapWidth will be fast.
 - (BOOL) hasCachedNumLinesForWidth: (int) width;
 
+// Like getNumLinesWithWrapWidth but if the block was last wrapped to a
+// different width, estimates the count from that instead of rewrapping.
+- (int) getEstimatedNumLinesWithWrapWidth: (int) width;
+
 // Returns true if the last line is incomplete.
 - (BOOL) hasPartial;
 
@@ -139,6 +190,40 @@ typedef struct FindContext {
 // Remove extra space from the end of the buffer. Future appends will fail.
 - (void) shrinkToFit;
 
+// Switch to the compact representation to save memory. Does nothing and
+// returns NO if the block has more than 256 distinct sets of attributes.
+- (BOOL) compact;
+
+// Returns true if the block is in the compact representation.
+- (BOOL) isCompact;
+
+// Compress the compact representation. Does nothing and returns NO if the
+// block isn't compact or compression doesn't make it smaller.
+- (BOOL) compress;
+
+// Returns true if the block is compressed.
+- (BOOL) isCompressed;
+
+// Free the decompressed copy of a compressed block's cells. They will be
+// decompressed again the next time they're needed.
+- (void) releaseDecompressedCells;
+
+// Returns the number of bytes used by a compressed block's cells and palette,
+// or 0 if the block isn't compressed.
+- (int) compressedSize;
+
+// Write the compressed cells of a compressed block to fd at *offset and map
+// them back in place of the in-memory copy. *offset is page aligned and is
+// advanced past what was written. Returns NO and leaves the block in memory
+// if it isn't compressed, was already spilled, or the write fails.
+- (BOOL) spillToFile: (int) fd atOffset: (off_t*) offset;
+
+// Returns true if the compressed cells are in a spill file.
+- (BOOL) isSpilled;
+
+// Return the number of cells used, including those before startOffset.
+- (int) rawSpaceUsed;
+
 // Append a value to cumulativeLineLengths.
 - (void) _appendCumulativeLineLength: (int) cumulativeLength;
 
@@ -181,6 +266,27 @@ typedef struct FindContext {
     // Cache of the number of wrapped lines
     int num_wrapped_lines_cache;
     int num_wrapped_lines_width;
+
+    // A Fenwick tree over the number of wrapped lines in each block (the same
+    // estimated or exact counts that add up to num_wrapped_lines_cache). It is
+    // valid whenever the cache is. Element 1 is the block whose absolute
+    // number is line_index_base; blocks dropped since then count 0 lines.
+    int* line_index;
+    int line_index_capacity;
+    int line_index_size;
+    int line_index_base;
+
+    // Compressed blocks whose cells were recently needed and may still be
+    // decompressed, most recent first. Only the first few keep their cells.
+    NSMutableArray* warm_blocks;
+
+    // Once the compressed blocks take more than spill_budget bytes, the
+    // oldest are moved to a spill file so that only the kernel's page cache
+    // holds them. -1 disables spilling. The file is created on first use and
+    // unlinked right away; spill_end is where the next block is written.
+    long long spill_budget;
+    int spill_fd;
+    off_t spill_end;
 }
 
 - (LineBuffer*) initWithBlockSize: (int) bs;
@@ -191,6 +297,12 @@ typedef struct FindContext {
 // run out of memory).
 - (void) setMaxLines: (int) maxLines;
 
+// Keep at most about this many bytes of compressed blocks in memory and
+// spill the rest to disk. Pass -1 (the default) to keep everything in memory.
+// Space in the spill file isn't reused, so this is meant for unlimited
+// scrollback, where blocks are never dropped.
+- (void) setSpillBudget: (long long) bytes;
+
 // Add a line to the buffer. Set partial to true if there's more coming for this line:
 // that is to say, this buffer contains only a prefix or infix of the entire line.
 //
@@ -209,7 +321,9 @@ typedef struct FindContext {
 // Copy a line into the buffer. If the line is shorter than 'width' then only the first 'width'
 // characters will be modified.
 // 0 <= lineNum < numLinesWithWidth:width
-// Returns EOL code.
+// Returns EOL code. Finding the line can replace estimated line counts (see
+// numLinesWithWidth:); if that leaves lineNum past the end, the last line is
+// copied instead.
 - (int) copyLineToBuffer: (screen_char_t*) buffer width: (int) width lineNum: (int) lineNum;
 
 // Copy up to width chars from the last line into *ptr. The last line will be removed or
@@ -217,9 +331,21 @@ typedef struct FindContext {
 // continuation marker.
 - (BOOL) popAndCopyLastLineInto: (screen_char_t*) ptr width: (int) width includesEndOfLine: (int*) includesEndOfLine;
 
-// Get the number of buffer lines at a given width.
+// Get the number of buffer lines at a given width. After the width changes,
+// blocks that haven't been looked at since contribute an estimate until they
+// are rewrapped, so the count can change without any lines being added.
 - (int) numLinesWithWidth: (int) width;
 
+// Rewraps blocks at the end of the buffer until at least n lines at the given
+// width are exact. Use this for the part of the buffer that is about to be
+// shown.
+- (void) reflowLastLines: (int) n withWidth: (int) width;
+
+// Rewraps up to maxBlocks blocks that still have estimated line counts,
+// newest first. Returns YES if any remain. Call this repeatedly after a
+// width change to converge on the exact count a little at a time.
+- (BOOL) reflowBlocks: (int) maxBlocks withWidth: (int) width;
+
 // Save the cursor position. Call this just before appending the line the cursor is in. 
 // x gives the offset from the start of the next line appended. The cursor position is
 // invalidated if dropExcessLinesWithWidth is called.
@@ -258,4 +384,8 @@ typedef struct FindContext {
 // Returns the position at the end of the buffer
 - (int) lastPos;
 
+// Sets *rawBytes to the number of bytes the compressed blocks would use
+// uncompressed and *compressedBytes to the number they use now.
+- (void) getCompressionRawBytes: (long long*) rawBytes compressedBytes: (long long*) compressedBytes;
+
 @end
@@ -29,12 +29,193 @@
 
 #import <LineBuffer.h>
 #import "RegexKitLite/RegexKitLite.h"
+#import "DWCScan.h"
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 @implementation ResultRange
 @end
 
+// Distance between the codes of consecutive cells of a screen_char_t array,
+// in unichars. Wrapping looks only at codes, so the wrapping functions take a
+// pointer to the first code and a stride.
+static const int kCellStride = sizeof(screen_char_t) / sizeof(unichar);
+
+// DWCScan.h expects cells laid out like this.
+typedef char ScreenCharMatchesDWCScan[sizeof(screen_char_t) == DWC_SCAN_CELL_STRIDE * sizeof(unichar) &&
+                                      offsetof(screen_char_t, code) == 0 ? 1 : -1];
+
+static BOOL LineHasDWC(const uint32_t* bits, int line)
+{
+    return (bits[line / 32] >> (line % 32)) & 1;
+}
+
+// Number of slots in the hash table used to build a compact block's palette.
+static const int kPaletteSlots = 512;
+
+static int PaletteSlot(const screen_char_t* attrs)
+{
+    uint64_t key = 0;
+    memcpy(&key, attrs, MIN(sizeof(key), sizeof(*attrs)));
+    return (int)((key * 0x9E3779B97F4A7C15ULL) >> 55) & (kPaletteSlots - 1);
+}
+
+// Rebuilds n cells from their codes and palette indices.
+static void ExpandCells(screen_char_t* dest,
+                        const unichar* codes,
+                        const unsigned char* attrs,
+                        const screen_char_t* palette,
+                        int n)
+{
+    for (int i = 0; i < n; ++i) {
+        dest[i] = palette[attrs[i]];
+        dest[i].code = codes[i];
+    }
+}
+
+// Compressed cells are the palette indices as (varint run length, index)
+// pairs, one per run of equal indices, followed by the codes. A code byte
+// below 0x80 is an ASCII code; 0x80-0xbf repeats the previous code 2-65 times;
+// 0xc0-0xfe plus the next byte give a code below 0x3f00; and 0xff is followed
+// by the code in two bytes, low byte first. Scrollback is mostly ASCII with
+// long runs of blanks and of identical attributes, so this usually takes a
+// little over a byte per cell.
+static const int kMaxCompressedBytesPerCell = 5;
+
+static unsigned char* PutVarint(unsigned char* p, unsigned int n)
+{
+    while (n >= 0x80) {
+        *p++ = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    *p++ = n;
+    return p;
+}
+
+static const unsigned char* GetVarint(const unsigned char* p, unsigned int* n)
+{
+    int shift = 0;
+    *n = 0;
+    while (*p & 0x80) {
+        *n |= (*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *n |= *p++ << shift;
+    return p;
+}
+
+// Writes n cells to out, which must have room for
+// n * kMaxCompressedBytesPerCell bytes, and returns the number of bytes used.
+static int CompressCells(const unichar* codes,
+                         const unsigned char* attrs,
+                         int n,
+                         unsigned char* out)
+{
+    unsigned char* p = out;
+    int i = 0;
+    while (i < n) {
+        int j = i + 1;
+        while (j < n && attrs[j] == attrs[i]) {
+            ++j;
+        }
+        p = PutVarint(p, j - i);
+        *p++ = attrs[i];
+        i = j;
+    }
+
+    unichar prev = 0;
+    i = 0;
+    while (i < n) {
+        int run = 0;
+        while (run < 65 && i + run < n && codes[i + run] == prev) {
+            ++run;
+        }
+        if (run >= 2) {
+            *p++ = 0x80 + run - 2;
+            i += run;
+            continue;
+        }
+        unichar c = codes[i++];
+        if (c < 0x80) {
+            *p++ = c;
+        } else if (c < 0x3f00) {
+            *p++ = 0xc0 + (c >> 8);
+            *p++ = c & 0xff;
+        } else {
+            *p++ = 0xff;
+            *p++ = c & 0xff;
+            *p++ = c >> 8;
+        }
+        prev = c;
+    }
+    return p - out;
+}
+
+// Each block in a spill file starts on a page boundary with this header,
+// followed by its compressed cells and padding to the next page.
+static const uint32_t kSpillMagic = 0x4c425370;  // 'LBSp'
+typedef struct {
+    uint32_t magic;
+    int32_t cells;
+    int32_t length;
+    int32_t reserved;
+} LineBlockSpillHeader;
+
+static void DecompressCells(const unsigned char* in,
+                            int n,
+                            unichar* codes,
+                            unsigned char* attrs)
+{
+    const unsigned char* p = in;
+    int i = 0;
+    while (i < n) {
+        unsigned int run;
+        p = GetVarint(p, &run);
+        memset(attrs + i, *p++, run);
+        i += run;
+    }
+
+    unichar prev = 0;
+    i = 0;
+    while (i < n) {
+        unsigned char b = *p++;
+        if (b < 0x80) {
+            prev = b;
+        } else if (b < 0xc0) {
+            for (int k = b - 0x80 + 2; k > 0; --k) {
+                codes[i++] = prev;
+            }
+            continue;
+        } else if (b < 0xff) {
+            prev = ((b - 0xc0) << 8) | *p++;
+        } else {
+            prev = p[0] | (p[1] << 8);
+            p += 2;
+        }
+        codes[i++] = prev;
+    }
+}
+
 @implementation LineBlock
 
+- (void) _invalidateNumLinesCache
+{
+    for (int i = 0; i < NUM_LINES_CACHE_SIZE; ++i) {
+        cached_numlines_width[i] = -1;
+    }
+    cached_numlines_last = -1;
+    cached_numlines_next = 0;
+}
+
+- (void) _cacheNumLines: (int) count forWidth: (int) width
+{
+    cached_numlines_width[cached_numlines_next] = width;
+    cached_numlines[cached_numlines_next] = count;
+    cached_numlines_last = cached_numlines_next;
+    cached_numlines_next = (cached_numlines_next + 1) % NUM_LINES_CACHE_SIZE;
+}
+
 - (LineBlock*) initWithRawBufferSize: (int) size
 {
     raw_buffer = (screen_char_t*) malloc(sizeof(screen_char_t) * size);
@@ -46,20 +227,48 @@
     cll_capacity = 1 + size/80;
     cll_entries = 0;
     cumulative_line_lengths = (int*) malloc(sizeof(int) * cll_capacity);
+    dwc_line_bits = (uint32_t*) calloc((cll_capacity + 31) / 32, sizeof(uint32_t));
     is_partial = NO;
-    cached_numlines_width = -1;
+    [self _invalidateNumLinesCache];
 
     return self;
 }
 
+- (void) _freeCompressedCells
+{
+    if (spill_mapping) {
+        munmap(spill_mapping, spill_mapping_length);
+        spill_mapping = NULL;
+        spill_mapping_length = 0;
+    } else if (compressed_cells) {
+        free(compressed_cells);
+    }
+    compressed_cells = NULL;
+    compressed_length = 0;
+}
+
 - (void) dealloc
 {
     if (raw_buffer) {
         free(raw_buffer);
     }
+    if (compact_codes) {
+        free(compact_codes);
+        free(compact_attrs);
+    }
+    if (compact_palette) {
+        free(compact_palette);
+    }
+    [self _freeCompressedCells];
     if (cumulative_line_lengths) {
         free(cumulative_line_lengths);
     }
+    if (dwc_offsets) {
+        free(dwc_offsets);
+    }
+    if (dwc_line_bits) {
+        free(dwc_line_bits);
+    }
     [super dealloc];
 }
 
@@ -72,13 +281,190 @@
     }
 }
 
+// Rebuilds compact_codes and compact_attrs if the block is compressed and they
+// were released.
+- (void) _decompress
+{
+    if (!compressed_cells || compact_codes) {
+        return;
+    }
+    const int used = [self rawSpaceUsed];
+    compact_codes = (unichar*) malloc(MAX(1, used) * sizeof(unichar));
+    compact_attrs = (unsigned char*) malloc(MAX(1, used));
+    DecompressCells(compressed_cells, used, compact_codes, compact_attrs);
+}
+
+// Goes back from the compact representation to raw_buffer.
+- (void) _expand
+{
+    [self _decompress];
+    if (!compact_codes) {
+        return;
+    }
+    raw_buffer = (screen_char_t*) malloc(sizeof(screen_char_t) * buffer_size);
+    ExpandCells(raw_buffer, compact_codes, compact_attrs, compact_palette, [self rawSpaceUsed]);
+    buffer_start = raw_buffer + start_offset;
+
+    free(compact_codes);
+    free(compact_attrs);
+    free(compact_palette);
+    compact_codes = NULL;
+    compact_attrs = NULL;
+    compact_palette = NULL;
+    compact_palette_size = 0;
+    [self _freeCompressedCells];
+}
+
+- (BOOL) compact
+{
+    const int used = [self rawSpaceUsed];
+    if (compact_codes || compressed_cells) {
+        return YES;
+    }
+    if (used == 0) {
+        return NO;
+    }
+
+    screen_char_t* palette = (screen_char_t*) malloc(256 * sizeof(screen_char_t));
+    unsigned char* attrs = (unsigned char*) malloc(used);
+    unichar* codes = (unichar*) malloc(used * sizeof(unichar));
+    short slots[kPaletteSlots];
+    int palette_size = 0;
+    int last = -1;
+    for (int i = 0; i < kPaletteSlots; ++i) {
+        slots[i] = -1;
+    }
+    for (int i = 0; i < used; ++i) {
+        screen_char_t c = raw_buffer[i];
+        codes[i] = c.code;
+        c.code = 0;
+        // Attributes usually come in long runs, so try the previous cell's first.
+        if (last < 0 || memcmp(&c, &palette[last], sizeof(c))) {
+            int slot = PaletteSlot(&c);
+            while (slots[slot] >= 0 && memcmp(&c, &palette[slots[slot]], sizeof(c))) {
+                slot = (slot + 1) & (kPaletteSlots - 1);
+            }
+            if (slots[slot] < 0) {
+                if (palette_size == 256) {
+                    free(palette);
+                    free(attrs);
+                    free(codes);
+                    return NO;
+                }
+                palette[palette_size] = c;
+                slots[slot] = palette_size++;
+            }
+            last = slots[slot];
+        }
+        attrs[i] = last;
+    }
+
+    free(raw_buffer);
+    raw_buffer = NULL;
+    buffer_start = NULL;
+    compact_codes = codes;
+    compact_attrs = attrs;
+    compact_palette = (screen_char_t*) realloc(palette, palette_size * sizeof(screen_char_t));
+    compact_palette_size = palette_size;
+    return YES;
+}
+
+- (BOOL) isCompact
+{
+    return compact_codes != NULL || compressed_cells != NULL;
+}
+
+- (BOOL) compress
+{
+    const int used = [self rawSpaceUsed];
+    if (compressed_cells) {
+        return YES;
+    }
+    if (!compact_codes) {
+        return NO;
+    }
+
+    unsigned char* out = (unsigned char*) malloc(used * kMaxCompressedBytesPerCell);
+    int length = CompressCells(compact_codes, compact_attrs, used, out);
+    if (length >= used * (int)(sizeof(unichar) + 1)) {
+        free(out);
+        return NO;
+    }
+    compressed_cells = (unsigned char*) realloc(out, length);
+    compressed_length = length;
+    [self releaseDecompressedCells];
+    return YES;
+}
+
+- (BOOL) isCompressed
+{
+    return compressed_cells != NULL;
+}
+
+- (void) releaseDecompressedCells
+{
+    if (!compressed_cells || !compact_codes) {
+        return;
+    }
+    free(compact_codes);
+    free(compact_attrs);
+    compact_codes = NULL;
+    compact_attrs = NULL;
+}
+
+- (int) compressedSize
+{
+    if (!compressed_cells) {
+        return 0;
+    }
+    return compressed_length + compact_palette_size * sizeof(screen_char_t);
+}
+
+- (BOOL) spillToFile: (int) fd atOffset: (off_t*) offset
+{
+    if (!compressed_cells || spill_mapping) {
+        return NO;
+    }
+    LineBlockSpillHeader header;
+    header.magic = kSpillMagic;
+    header.cells = [self rawSpaceUsed];
+    header.length = compressed_length;
+    header.reserved = 0;
+    const size_t page = getpagesize();
+    const size_t length = (sizeof(header) + compressed_length + page - 1) / page * page;
+    if (pwrite(fd, &header, sizeof(header), *offset) != (ssize_t)sizeof(header) ||
+        pwrite(fd, compressed_cells, compressed_length, *offset + sizeof(header)) != compressed_length) {
+        return NO;
+    }
+    void* mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, *offset);
+    if (mapping == MAP_FAILED) {
+        return NO;
+    }
+    free(compressed_cells);
+    compressed_cells = (unsigned char*) mapping + sizeof(header);
+    spill_mapping = mapping;
+    spill_mapping_length = length;
+    *offset += length;
+    return YES;
+}
+
+- (BOOL) isSpilled
+{
+    return spill_mapping != NULL;
+}
+
 - (void) _appendCumulativeLineLength: (int) cumulativeLength
 {
     if (cll_entries == cll_capacity) {
+        const int old_words = (cll_capacity + 31) / 32;
         cll_capacity *= 2;
         cumulative_line_lengths = (int*) realloc((void*) cumulative_line_lengths, cll_capacity * sizeof(int));
+        const int words = (cll_capacity + 31) / 32;
+        dwc_line_bits = (uint32_t*) realloc(dwc_line_bits, words * sizeof(uint32_t));
+        memset(dwc_line_bits + old_words, 0, (words - old_words) * sizeof(uint32_t));
     }
     cumulative_line_lengths[cll_entries] = cumulativeLength;
+    dwc_line_bits[cll_entries / 32] &= ~(1u << (cll_entries % 32));
     ++cll_entries;
 }
 
@@ -98,6 +484,7 @@ static char* formatsct(screen_char_t* src, int len, char* dest) {
     char temp[1000];
     int i;
     int prev;
+    [self _expand];
     if (first_entry > 0) {
         prev = cumulative_line_lengths[first_entry - 1];
     } else {
@@ -113,6 +500,7 @@ static char* formatsct(screen_char_t* src, int len, char* dest) {
 
 - (BOOL) appendLine: (screen_char_t*) buffer length: (int) length partial:(BOOL) partial
 {
+    [self _expand];
     const int space_used = [self rawSpaceUsed];
     const int free_space = buffer_size - space_used - start_offset;
     if (length > free_space) {
@@ -134,23 +522,22 @@ static char* formatsct(screen_char_t* src, int len, char* dest) {
     }
     is_partial = partial;
     memcpy(raw_buffer + space_used, buffer, sizeof(screen_char_t) * length);
-    cached_numlines_width = -1;
-    return YES;
-}
-
-- (int) getPositionOfLine: (int*)lineNum atX: (int) x withWidth: (int)width
-{
-    int length;
-    int eol;
-    screen_char_t* p = [self getWrappedLineWithWrapWidth: width
-                                                 lineNum: lineNum
-                                              lineLength: &length
-                                       includesEndOfLine: &eol];
-    if (!p) {
-        return -1;
-    } else {
-        return p - raw_buffer + x;
+    const uint16_t* codes = &buffer->code;
+    int i = FirstCellWithCode(codes, length, DWC_RIGHT);
+    if (i < length) {
+        dwc_line_bits[(cll_entries - 1) / 32] |= 1u << ((cll_entries - 1) % 32);
+    }
+    while (i < length) {
+        if (dwc_count == dwc_capacity) {
+            dwc_capacity = MAX(16, dwc_capacity * 2);
+            dwc_offsets = (int*) realloc(dwc_offsets, dwc_capacity * sizeof(int));
+        }
+        dwc_offsets[dwc_count++] = space_used + i;
+        ++i;
+        i += FirstCellWithCode(codes + i * kCellStride, length - i, DWC_RIGHT);
     }
+    [self _invalidateNumLinesCache];
+    return YES;
 }
 
 // Count the number of "full lines" in buffer up to position 'length'. A full
@@ -162,12 +549,12 @@ static char* formatsct(screen_char_t* src, int len, char* dest) {
 // |xxxxx|          |x     |        |xxxxxx|         |xxxxxx|
 // |xxxxx|                                           |x     |
 // |x    |
-static int NumberOfFullLines(screen_char_t* buffer, int length, int width)
+static int NumberOfFullLines(const unichar* codes, int stride, int length, int width)
 {
     // In the all-single-width case, it should return (length - 1) / width.
     int fullLines = 0;
     for (int i = width; i < length; i += width) {
-        if (buffer[i].code == DWC_RIGHT) {
+        if (codes[i * stride] == DWC_RIGHT) {
             --i;
         }
         ++fullLines;
@@ -188,7 +575,7 @@ static int NumberOfFullLines(screen_char_t* buffer, int length, int width)
 // Returns a pointer to a if n==0, pointer XX if n==1, asserts if n > 1:
 // |abcde|   <- line is short after wrapping
 // |XXzzzz|
-static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
+static int OffsetOfWrappedLine(const unichar* codes, int stride, int n, int length, int width) {
     int lines = 0;
     int i = 0;
     while (lines < n) {
@@ -196,7 +583,7 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
         i += width;
         ++lines;
         assert(i < length);
-        if (p[i].code == DWC_RIGHT) {
+        if (codes[i * stride] == DWC_RIGHT) {
             // Oops, the line starts with the second half of a double-width
             // character. Wrap the last character of the previous line on to
             // this line.
@@ -206,18 +593,104 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
     return i;
 }
 
-- (screen_char_t*) getWrappedLineWithWrapWidth: (int) width
-                                       lineNum: (int*) lineNum
-                                    lineLength: (int*) lineLength
-                             includesEndOfLine: (int*) includesEndOfLine
+// Returns the index of the first of the n increasing values in a that is at
+// least value, or n if there is none.
+static int FirstAtOrAfter(const int* a, int n, int value)
+{
+    int lo = 0;
+    int hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (a[mid] < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Returns whether a cell is the right half of a double-width character, given
+// the offsets of those in increasing order.
+static BOOL IsDWCRight(const int* dwcs, int count, int offset)
+{
+    int i = FirstAtOrAfter(dwcs, count, offset);
+    return i < count && dwcs[i] == offset;
+}
+
+// The same as NumberOfFullLines for the raw line at raw offset start, but
+// reading the positions of double-width characters from dwcs: the block's
+// dwc_offsets from the first at or after start on. A line without any takes
+// the arithmetic path.
+static int NumberOfFullLinesWithDWCs(const int* dwcs, int count, int start, int length, int width)
 {
-    int prev = 0;
+    if (count == 0 || dwcs[0] >= start + length) {
+        return length > 0 ? (length - 1) / width : 0;
+    }
+    int fullLines = 0;
+    int k = 0;
+    for (int i = width; i < length; i += width) {
+        while (k < count && dwcs[k] < start + i) {
+            ++k;
+        }
+        if (k < count && dwcs[k] == start + i) {
+            --i;
+        }
+        ++fullLines;
+    }
+    return fullLines;
+}
+
+// The same as OffsetOfWrappedLine for the raw line at raw offset start, with
+// dwcs as for NumberOfFullLinesWithDWCs.
+static int OffsetOfWrappedLineWithDWCs(const int* dwcs, int count, int start, int n, int length, int width)
+{
+    if (count == 0 || dwcs[0] >= start + length) {
+        return n * width;
+    }
+    int i = 0;
+    int k = 0;
+    for (int lines = 0; lines < n; ++lines) {
+        i += width;
+        assert(i < length);
+        while (k < count && dwcs[k] < start + i) {
+            ++k;
+        }
+        if (k < count && dwcs[k] == start + i) {
+            --i;
+        }
+    }
+    return i;
+}
+
+// Returns the raw offset of the start of wrapped line *lineNum, or -1 after
+// decrementing *lineNum by the number of lines in the block.
+- (int) _offsetOfWrappedLineWithWrapWidth: (int) width
+                                  lineNum: (int*) lineNum
+                               lineLength: (int*) lineLength
+                        includesEndOfLine: (int*) includesEndOfLine
+{
+    int prev = start_offset;
+    int k = FirstAtOrAfter(dwc_offsets, dwc_count, start_offset);
     int length;
     int i;
     for (i = first_entry; i < cll_entries; ++i) {
-        int cll = cumulative_line_lengths[i] - start_offset;
+        int cll = cumulative_line_lengths[i];
         length = cll - prev;
-        int spans = NumberOfFullLines(buffer_start + prev, length, width);
+        if (!LineHasDWC(dwc_line_bits, i)) {
+            int spans = length > 0 ? (length - 1) / width : 0;
+            if (*lineNum > spans) {
+                *lineNum -= spans + 1;
+                prev = cll;
+                continue;
+            }
+        }
+        while (k < dwc_count && dwc_offsets[k] < prev) {
+            ++k;
+        }
+        const int* dwcs = dwc_offsets + k;
+        const int count = dwc_count - k;
+        int spans = NumberOfFullLinesWithDWCs(dwcs, count, prev, length, width);
         if (*lineNum > spans) {
             // Consume the entire raw line and keep looking for more.
             int consume = spans + 1;
@@ -225,16 +698,18 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
         } else {  // *lineNum <= spans
             // We found the raw line that inclues the wrapped line we're searching for.
             // eat up *lineNum many width-sized wrapped lines from this start of the current full line
-            int offset = OffsetOfWrappedLine(buffer_start + prev,
-                                             *lineNum,
-                                             length,
-                                             width);
+            int offset = OffsetOfWrappedLineWithDWCs(dwcs,
+                                                     count,
+                                                     prev,
+                                                     *lineNum,
+                                                     length,
+                                                     width);
             *lineNum = 0;
             // offset: the relevant part of the raw line begins at this offset into it
             *lineLength = length - offset;  // the length of the suffix of the raw line, beginning at the wrapped line we want
             if (*lineLength > width) {
                 // return an infix of the full line
-                if (buffer_start[prev + offset + width].code == DWC_RIGHT) {
+                if (IsDWCRight(dwcs, count, prev + offset + width)) {
                     // Result would end with the first half of a double-width character
                     *lineLength = width - 1;
                     *includesEndOfLine = EOL_DWC;
@@ -251,42 +726,129 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
                     *includesEndOfLine = EOL_HARD;
                 }
             }
-            return buffer_start + prev + offset;
+            return prev + offset;
         }
         prev = cll;
     }
-    return NULL;
+    return -1;
+}
+
+- (screen_char_t*) getWrappedLineWithWrapWidth: (int) width
+                                       lineNum: (int*) lineNum
+                                    lineLength: (int*) lineLength
+                             includesEndOfLine: (int*) includesEndOfLine
+{
+    int offset = [self _offsetOfWrappedLineWithWrapWidth: width
+                                                 lineNum: lineNum
+                                              lineLength: lineLength
+                                       includesEndOfLine: includesEndOfLine];
+    if (offset < 0) {
+        return NULL;
+    }
+    [self _expand];
+    return raw_buffer + offset;
+}
+
+- (int) copyWrappedLineWithWrapWidth: (int) width
+                             lineNum: (int*) lineNum
+                            toBuffer: (screen_char_t*) buffer
+                   includesEndOfLine: (int*) includesEndOfLine
+{
+    int length;
+    int offset = [self _offsetOfWrappedLineWithWrapWidth: width
+                                                 lineNum: lineNum
+                                              lineLength: &length
+                                       includesEndOfLine: includesEndOfLine];
+    if (offset < 0) {
+        return -1;
+    }
+    [self _decompress];
+    if (compact_codes) {
+        ExpandCells(buffer,
+                    compact_codes + offset,
+                    compact_attrs + offset,
+                    compact_palette,
+                    length);
+    } else {
+        memcpy(buffer, raw_buffer + offset, length * sizeof(screen_char_t));
+    }
+    return length;
+}
+
+- (int) getPositionOfLine: (int*)lineNum atX: (int) x withWidth: (int)width
+{
+    int length;
+    int eol;
+    int offset = [self _offsetOfWrappedLineWithWrapWidth: width
+                                                 lineNum: lineNum
+                                              lineLength: &length
+                                       includesEndOfLine: &eol];
+    if (offset < 0) {
+        return -1;
+    } else {
+        return offset + x;
+    }
 }
 
 - (int) getNumLinesWithWrapWidth: (int) width
 {
-    if (width == cached_numlines_width) {
-        return cached_numlines;
+    for (int j = 0; j < NUM_LINES_CACHE_SIZE; ++j) {
+        if (cached_numlines_width[j] == width) {
+            return cached_numlines[j];
+        }
     }
 
     int count = 0;
-    int prev = 0;
+    int prev = start_offset;
+    int k = FirstAtOrAfter(dwc_offsets, dwc_count, start_offset);
     int i;
     // Count the number of wrapped lines in the block by computing the sum of the number
     // of wrapped lines each raw line would use.
     for (i = first_entry; i < cll_entries; ++i) {
-        int cll = cumulative_line_lengths[i] - start_offset;
+        int cll = cumulative_line_lengths[i];
         int length = cll - prev;
-        count += NumberOfFullLines(buffer_start + prev, length, width) + 1;
+        if (!LineHasDWC(dwc_line_bits, i)) {
+            count += (length > 0 ? (length - 1) / width : 0) + 1;
+            prev = cll;
+            continue;
+        }
+        while (k < dwc_count && dwc_offsets[k] < prev) {
+            ++k;
+        }
+        count += NumberOfFullLinesWithDWCs(dwc_offsets + k, dwc_count - k, prev, length, width) + 1;
         prev = cll;
     }
 
     // Save the result so it doesn't have to be recalculated until some relatively rare operation
     // occurs that invalidates the cache.
-    cached_numlines_width = width;
-    cached_numlines = count;
+    [self _cacheNumLines: count forWidth: width];
 
     return count;
 }
 
 - (BOOL) hasCachedNumLinesForWidth: (int) width
 {
-    return cached_numlines_width == width;
+    for (int j = 0; j < NUM_LINES_CACHE_SIZE; ++j) {
+        if (cached_numlines_width[j] == width) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+- (int) getEstimatedNumLinesWithWrapWidth: (int) width
+{
+    if (cached_numlines_last < 0 || [self hasCachedNumLinesForWidth: width]) {
+        return [self getNumLinesWithWrapWidth: width];
+    }
+    // The block hasn't changed since it was wrapped to a different width.
+    // Assume the lines that wrapped then will wrap in proportion to the change
+    // in width now. Use the width it was wrapped to most recently so the
+    // estimate only changes when the block is wrapped to another width.
+    const int cached_width = cached_numlines_width[cached_numlines_last];
+    int raw_lines = cll_entries - first_entry;
+    long long extra = cached_numlines[cached_numlines_last] - raw_lines;
+    return raw_lines + (int)((extra * cached_width + width - 1) / width);
 }
 
 - (BOOL) popLastLineInto: (screen_char_t**) ptr withLength: (int*) length upToWidth: (int) width
@@ -295,6 +857,7 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
         // There is no last line to pop.
         return NO;
     }
+    [self _expand];
     int start;
     if (cll_entries == first_entry + 1) {
         start = 0;
@@ -310,12 +873,20 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
         // not split across lines when computing the wrapping.
         // If there were only single width characters, the formula would be:
         //     width * ((available_len - 1) / width);
-        int offset_from_start = OffsetOfWrappedLine(buffer_start + start,
-                                                    NumberOfFullLines(buffer_start + start,
+        int offset_from_start;
+        if (LineHasDWC(dwc_line_bits, cll_entries - 1)) {
+            const unichar* codes = &buffer_start[start].code;
+            offset_from_start = OffsetOfWrappedLine(codes,
+                                                    kCellStride,
+                                                    NumberOfFullLines(codes,
+                                                                      kCellStride,
                                                                       available_len,
                                                                       width),
                                                     available_len,
                                                     width);
+        } else {
+            offset_from_start = width * ((available_len - 1) / width);
+        }
         *length = available_len - offset_from_start;
         *ptr = buffer_start + start + offset_from_start;
         cumulative_line_lengths[cll_entries - 1] -= *length;
@@ -335,9 +906,10 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
         first_entry = 0;
         cll_entries = 0;
     }
+    dwc_count = FirstAtOrAfter(dwc_offsets, dwc_count, [self rawSpaceUsed]);
 
     // Mark the cache dirty.
-    cached_numlines_width = -1;
+    [self _invalidateNumLinesCache];
     return YES;
 }
 
@@ -381,16 +953,18 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
     } else {
         start = cumulative_line_lengths[linenum - 1];
     }
+    [self _expand];
     return raw_buffer + start;
 }
 
 - (void) changeBufferSize: (int) capacity
 {
     NSAssert(capacity >= [self rawSpaceUsed], @"Truncating used space");
+    [self _expand];
     raw_buffer = (screen_char_t*) realloc((void*) raw_buffer, sizeof(screen_char_t) * capacity);
     buffer_start = raw_buffer + start_offset;
     buffer_size = capacity;
-    cached_numlines_width = -1;
+    [self _invalidateNumLinesCache];
 }
 
 - (int) rawBufferSize
@@ -410,18 +984,30 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
 
 - (int) dropLines: (int) n withWidth: (int) width;
 {
-    cached_numlines_width = -1;
+    // The remaining lines still wrap the same way at this width, but not
+    // necessarily at others.
+    int cached_lines = -1;
+    for (int j = 0; j < NUM_LINES_CACHE_SIZE; ++j) {
+        if (cached_numlines_width[j] == width) {
+            cached_lines = cached_numlines[j];
+        }
+    }
+    [self _invalidateNumLinesCache];
     int orig_n = n;
-    int prev = 0;
+    int prev = start_offset;
+    int k = FirstAtOrAfter(dwc_offsets, dwc_count, start_offset);
     int length;
     int i;
     for (i = first_entry; i < cll_entries; ++i) {
-        int cll = cumulative_line_lengths[i] - start_offset;
+        int cll = cumulative_line_lengths[i];
         length = cll - prev;
+        while (k < dwc_count && dwc_offsets[k] < prev) {
+            ++k;
+        }
         // Get the number of full-length wrapped lines in this raw line. If there
         // were only single-width characters the formula would be:
         //     (length - 1) / width;
-        int spans = NumberOfFullLines(buffer_start + prev, length, width);
+        int spans = NumberOfFullLinesWithDWCs(dwc_offsets + k, dwc_count - k, prev, length, width);
         if (n > spans) {
             // Consume the entire raw line and keep looking for more.
             int consume = spans + 1;
@@ -432,10 +1018,15 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
             // line begins. If there were only single-width characters the formula
             // would be:
             //   offset = n * width;
-            int offset = OffsetOfWrappedLine(buffer_start + prev, n, length, width);
-            buffer_start += prev + offset;
-            start_offset = buffer_start - raw_buffer;
+            int offset = OffsetOfWrappedLineWithDWCs(dwc_offsets + k, dwc_count - k, prev, n, length, width);
+            start_offset = prev + offset;
+            if (raw_buffer) {
+                buffer_start = raw_buffer + start_offset;
+            }
             first_entry = i;
+            if (cached_lines >= 0) {
+                [self _cacheNumLines: cached_lines - orig_n forWidth: width];
+            }
             return orig_n;
         }
         prev = cll;
@@ -445,6 +1036,7 @@ static int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
     buffer_start = raw_buffer;
     start_offset = 0;
     first_entry = 0;
+    dwc_count = 0;
 
     return orig_n - n;
 }
@@ -664,7 +1256,21 @@ static int Search(NSString* needle,
         multipleResults:(BOOL)multipleResults
                 results:(NSMutableArray*)results
 {
-    screen_char_t* rawline = raw_buffer + [self _lineRawOffset:entry];
+    screen_char_t* expanded = NULL;
+    screen_char_t* rawline;
+    if (compact_codes) {
+        // Search a temporary copy rather than expanding the whole block.
+        int offset = [self _lineRawOffset:entry];
+        expanded = (screen_char_t*) malloc(MAX(1, raw_line_length) * sizeof(screen_char_t));
+        ExpandCells(expanded,
+                    compact_codes + offset,
+                    compact_attrs + offset,
+                    compact_palette,
+                    raw_line_length);
+        rawline = expanded;
+    } else {
+        rawline = raw_buffer + [self _lineRawOffset:entry];
+    }
     if (skip > raw_line_length) {
         skip = raw_line_length;
     }
@@ -748,6 +1354,9 @@ static int Search(NSString* needle,
             }
         }
     }
+    if (expanded) {
+        free(expanded);
+    }
 }
 
 - (int) _lineLength: (int) anIndex
@@ -779,6 +1388,7 @@ static int Search(NSString* needle,
                results: (NSMutableArray*) results
        multipleResults:(BOOL)multipleResults
 {
+    [self _decompress];
     if (offset == -1) {
         offset = [self rawSpaceUsed] - 1;
     }
@@ -829,14 +1439,20 @@ static int Search(NSString* needle,
     *x = 0;
     *y = 0;
     int prev = start_offset;
+    int k = FirstAtOrAfter(dwc_offsets, dwc_count, start_offset);
     for (i = first_entry; i < cll_entries; ++i) {
         int eol = cumulative_line_lengths[i];
         int line_length = eol - prev;
+        while (k < dwc_count && dwc_offsets[k] < prev) {
+            ++k;
+        }
+        const int* dwcs = dwc_offsets + k;
+        const int count = dwc_count - k;
         if (position >= eol) {
             // Get the number of full-width lines in the raw line. If there were
             // only single-width characters the formula would be:
             //     spans = (line_length - 1) / width;
-            int spans = NumberOfFullLines(raw_buffer + prev, line_length, width);
+            int spans = NumberOfFullLinesWithDWCs(dwcs, count, prev, line_length, width);
             *y += spans + 1;
         } else {
             // The position we're searching for is in this (unwrapped) line.
@@ -849,20 +1465,24 @@ static int Search(NSString* needle,
             if (bytes_to_consume_in_this_line < line_length &&
                 prev + bytes_to_consume_in_this_line + 1 < eol) {
                 assert(prev + bytes_to_consume_in_this_line + 1 < buffer_size);
-                if (raw_buffer[prev + bytes_to_consume_in_this_line + 1].code == DWC_RIGHT) {    
+                if (IsDWCRight(dwcs, count, prev + bytes_to_consume_in_this_line + 1)) {
                     ++dwc_peek;
                 }
             }
-            int consume = NumberOfFullLines(raw_buffer + prev,
-                                            MIN(line_length, bytes_to_consume_in_this_line + 1 + dwc_peek),
-                                            width);
+            int consume = NumberOfFullLinesWithDWCs(dwcs,
+                                                    count,
+                                                    prev,
+                                                    MIN(line_length, bytes_to_consume_in_this_line + 1 + dwc_peek),
+                                                    width);
             *y += consume;
             if (consume > 0) {
                 // Offset from prev where the consume'th line begin.
-                int offset = OffsetOfWrappedLine(raw_buffer + prev,
-                                                 consume,
-                                                 line_length,
-                                                 width);
+                int offset = OffsetOfWrappedLineWithDWCs(dwcs,
+                                                         count,
+                                                         prev,
+                                                         consume,
+                                                         line_length,
+                                                         width);
                 // We know that position falls in this line. Set x to the number
                 // of chars after the beginning on the line. If there were only
                 // single-width chars the formula would be:
@@ -883,6 +1503,13 @@ static int Search(NSString* needle,
 
 @implementation LineBuffer
 
+// Blocks this close to the end of the buffer are never compressed. They are
+// the ones most likely to be shown, popped, or searched.
+static const int kUncompressedBlocks = 8;
+
+// The number of compressed blocks that keep their cells decompressed.
+static const int kWarmBlocks = 4;
+
 // Append a block
 - (LineBlock*) _addBlockOfSize: (int) size
 {
@@ -902,26 +1529,193 @@ static int Search(NSString* needle,
     max_lines = -1;
     num_wrapped_lines_width = -1;
     num_dropped_blocks = 0;
+    warm_blocks = [[NSMutableArray alloc] initWithCapacity: kWarmBlocks + 1];
+    spill_budget = -1;
+    spill_fd = -1;
+    spill_end = 0;
     return self;
 }
 
 - (void)dealloc
 {
     [blocks release];
+    [warm_blocks release];
+    if (line_index) {
+        free(line_index);
+    }
+    if (spill_fd >= 0) {
+        close(spill_fd);
+    }
     [super dealloc];
 }
 
-// This is called a lot so it's a C function to avoid obj_msgSend
+// Notes that a compressed block's cells are about to be used. Its cells stay
+// decompressed until kWarmBlocks other compressed blocks have been used since.
+static void TouchBlock(LineBuffer* buffer, LineBlock* block) {
+    if (![block isCompressed]) {
+        return;
+    }
+    NSMutableArray* warm = buffer->warm_blocks;
+    NSUInteger i = [warm indexOfObjectIdenticalTo: block];
+    if (i == 0) {
+        return;
+    }
+    if (i != NSNotFound) {
+        [warm removeObjectAtIndex: i];
+    }
+    [warm insertObject: block atIndex: 0];
+    while ([warm count] > kWarmBlocks) {
+        [[warm lastObject] releaseDecompressedCells];
+        [warm removeLastObject];
+    }
+}
+
+// Adds delta to the line count of the block at index i in the line index.
+static void LineIndexAdd(LineBuffer* buffer, int i, int delta) {
+    int k;
+    for (k = i + buffer->num_dropped_blocks - buffer->line_index_base + 1;
+         k <= buffer->line_index_size;
+         k += k & -k) {
+        buffer->line_index[k] += delta;
+    }
+}
+
+// Gives the block just added to the end of blocks a slot in the line index
+// holding lines, without rebuilding the rest of the tree.
+static void LineIndexAppend(LineBuffer* buffer, int lines) {
+    const int k = buffer->line_index_size + 1;
+    if (k + 1 > buffer->line_index_capacity) {
+        buffer->line_index_capacity = MAX(64, 2 * (k + 1));
+        buffer->line_index = (int*) realloc(buffer->line_index,
+                                            buffer->line_index_capacity * sizeof(int));
+    }
+    // Node k sums the k & -k slots ending at k; all but the new one are
+    // already summed by the nodes walking down from k - 1.
+    int sum = lines;
+    int j;
+    for (j = k - 1; j > k - (k & -k); j -= j & -j) {
+        sum += buffer->line_index[j];
+    }
+    buffer->line_index[k] = sum;
+    buffer->line_index_size = k;
+}
+
+// Drops the slots of blocks removed from the front of the line index, keeping
+// the counts of the rest, so the index stays the size of blocks.
+static void LineIndexCompact(LineBuffer* buffer) {
+    const int dropped = buffer->num_dropped_blocks - buffer->line_index_base;
+    const int n = buffer->line_index_size;
+    int i;
+    // Undo the Fenwick sums to get back each slot's own count.
+    for (i = n; i >= 1; --i) {
+        int parent = i + (i & -i);
+        if (parent <= n) {
+            buffer->line_index[parent] -= buffer->line_index[i];
+        }
+    }
+    memmove(buffer->line_index + 1, buffer->line_index + 1 + dropped,
+            (n - dropped) * sizeof(int));
+    const int m = n - dropped;
+    for (i = 1; i <= m; ++i) {
+        int parent = i + (i & -i);
+        if (parent <= m) {
+            buffer->line_index[parent] += buffer->line_index[i];
+        }
+    }
+    buffer->line_index_size = m;
+    buffer->line_index_base = buffer->num_dropped_blocks;
+}
+
+// Returns the number of wrapped lines in the blocks before index i.
+static int LineIndexPrefix(LineBuffer* buffer, int i) {
+    int sum = 0;
+    int k;
+    for (k = MIN(i + buffer->num_dropped_blocks - buffer->line_index_base, buffer->line_index_size);
+         k > 0;
+         k -= k & -k) {
+        sum += buffer->line_index[k];
+    }
+    return sum;
+}
+
+// Returns the line count stored for the block at index i in the line index.
+static int LineIndexValue(LineBuffer* buffer, int i) {
+    return LineIndexPrefix(buffer, i + 1) - LineIndexPrefix(buffer, i);
+}
+
+// Returns the index of the block holding wrapped line lineNum and sets
+// *lineInBlock to the line's number within it. Returns [blocks count] if
+// lineNum is past the end.
+static int LineIndexFind(LineBuffer* buffer, int lineNum, int* lineInBlock) {
+    int pos = 0;
+    int mask = 1;
+    while (mask * 2 <= buffer->line_index_size) {
+        mask *= 2;
+    }
+    for (; mask; mask >>= 1) {
+        int next = pos + mask;
+        if (next <= buffer->line_index_size && buffer->line_index[next] <= lineNum) {
+            pos = next;
+            lineNum -= buffer->line_index[next];
+        }
+    }
+    *lineInBlock = lineNum;
+    return pos + buffer->line_index_base - buffer->num_dropped_blocks;
+}
+
+// Returns the number of wrapped lines in the block at index i. After a change
+// of width, blocks aren't rewrapped until something needs to look inside them
+// (or -reflowBlocks:withWidth: gets to them); until then, if exact is NO, this
+// returns an estimate. When the exact count differs from what the cached total
+// and the line index have for the block, they are corrected by the difference.
+// (That's usually an estimate being replaced, but a block also forgets its
+// count for a width after it's wrapped to several others.)
+static int NumLinesInBlock(LineBuffer* buffer, int i, int width, BOOL exact) {
+    LineBlock* block = [buffer->blocks objectAtIndex: i];
+    if (!exact) {
+        return [block getEstimatedNumLinesWithWrapWidth: width];
+    }
+    // Callers want the exact count when they're about to look inside.
+    TouchBlock(buffer, block);
+    int count = [block getNumLinesWithWrapWidth: width];
+    if (buffer->num_wrapped_lines_width == width) {
+        int delta = count - LineIndexValue(buffer, i);
+        if (delta) {
+            buffer->num_wrapped_lines_cache += delta;
+            LineIndexAdd(buffer, i, delta);
+        }
+    }
+    return count;
+}
+
+// This is called a lot so it's a C function to avoid obj_msgSend. Recounting
+// also rebuilds the line index.
 static int RawNumLines(LineBuffer* buffer, int width) {
     if (buffer->num_wrapped_lines_width == width) {
         return buffer->num_wrapped_lines_cache;
     }
+    const int n = [buffer->blocks count];
+    if (n + 1 > buffer->line_index_capacity) {
+        buffer->line_index_capacity = MAX(64, 2 * (n + 1));
+        buffer->line_index = (int*) realloc(buffer->line_index,
+                                            buffer->line_index_capacity * sizeof(int));
+    }
     int count = 0;
     int i;
-    for (i = 0; i < [buffer->blocks count]; ++i) {
-        LineBlock* block = [buffer->blocks objectAtIndex: i];
-        count += [block getNumLinesWithWrapWidth: width];
+    for (i = 0; i < n; ++i) {
+        int lines = NumLinesInBlock(buffer, i, width, NO);
+        buffer->line_index[i + 1] = lines;
+        count += lines;
+    }
+    // Turn the counts into a Fenwick tree in place.
+    for (i = 1; i <= n; ++i) {
+        int parent = i + (i & -i);
+        if (parent <= n) {
+            buffer->line_index[parent] += buffer->line_index[i];
+        }
     }
+    buffer->line_index_size = n;
+    buffer->line_index_base = buffer->num_dropped_blocks;
     buffer->num_wrapped_lines_width = width;
     buffer->num_wrapped_lines_cache = count;
     return count;
@@ -937,27 +1731,96 @@ static int RawNumLines(LineBuffer* buffer, int width) {
 
     int total_lines = RawNumLines(self, width);
     while (total_lines > max_lines) {
-        int extra_lines = total_lines - max_lines;
-
         NSAssert([blocks count] > 0, @"No blocks");
         LineBlock* block = [blocks objectAtIndex: 0];
-        int block_lines = [block getNumLinesWithWrapWidth: width];
+        int block_lines = NumLinesInBlock(self, 0, width, YES);
         NSAssert(block_lines > 0, @"Empty leading block");
+
+        // Getting the exact number of lines in the block may have changed the
+        // total.
+        total_lines = RawNumLines(self, width);
+        if (total_lines <= max_lines) {
+            break;
+        }
+        int extra_lines = total_lines - max_lines;
         int toDrop = block_lines;
         if (toDrop > extra_lines) {
             toDrop = extra_lines;
         }
         int dropped = [block dropLines: toDrop withWidth: width];
+        LineIndexAdd(self, 0, -dropped);
+        // RawNumLines answers from the cache on the next pass, so it must
+        // not still count these.
+        num_wrapped_lines_cache -= dropped;
 
         if ([block isEmpty]) {
+            [warm_blocks removeObjectIdenticalTo:block];
             [blocks removeObjectAtIndex:0];
             ++num_dropped_blocks;
+            // Dropped blocks keep their slots until the index is rebuilt;
+            // once they outnumber the live ones, squeeze them out.
+            if (num_wrapped_lines_width == width &&
+                num_dropped_blocks - line_index_base > [blocks count]) {
+                LineIndexCompact(self);
+            }
         }
         total_lines -= dropped;
     }
     num_wrapped_lines_cache = total_lines;
 }
 
+// Writes a block to the spill file, creating the file if needed. If the file
+// can't be created spilling is turned off.
+- (BOOL) _spillBlock: (LineBlock*) block
+{
+    if (spill_fd < 0) {
+        NSString* template = [NSTemporaryDirectory() stringByAppendingPathComponent: @"iTerm-scrollback.XXXXXX"];
+        char* path = strdup([template fileSystemRepresentation]);
+        spill_fd = mkstemp(path);
+        if (spill_fd >= 0) {
+            // The file goes away when it's closed.
+            unlink(path);
+        }
+        free(path);
+        if (spill_fd < 0) {
+            NSLog(@"Can't create scrollback spill file: %s", strerror(errno));
+            spill_budget = -1;
+            return NO;
+        }
+    }
+    return [block spillToFile: spill_fd atOffset: &spill_end];
+}
+
+// Spills the oldest compressed blocks until those left in memory fit in
+// spill_budget. Blocks are spilled oldest first, so the walk back from the
+// newest compressed block stops at the first one already spilled.
+- (void) _spillColdBlocks
+{
+    if (spill_budget < 0) {
+        return;
+    }
+    long long resident = 0;
+    for (int i = (int)[blocks count] - 1 - kUncompressedBlocks; i >= 0; --i) {
+        LineBlock* block = [blocks objectAtIndex: i];
+        if ([block isSpilled]) {
+            break;
+        }
+        if (![block isCompressed]) {
+            continue;
+        }
+        resident += [block compressedSize];
+        if (resident > spill_budget && ![self _spillBlock: block]) {
+            return;
+        }
+    }
+}
+
+- (void) setSpillBudget: (long long) bytes
+{
+    spill_budget = bytes;
+    [self _spillColdBlocks];
+}
+
 - (void) setMaxLines: (int) maxLines
 {
     max_lines = maxLines;
@@ -1013,15 +1876,18 @@ static int RawNumLines(LineBuffer* buffer, int width) {
 #endif
     if ([blocks count] == 0) {
         [self _addBlockOfSize: block_size];
+        // The line index has no slot for the new block.
+        num_wrapped_lines_width = -1;
     }
 
-    LineBlock* block = [blocks objectAtIndex: ([blocks count] - 1)];
+    const int last = [blocks count] - 1;
+    LineBlock* block = [blocks objectAtIndex: last];
 
-    int beforeLines = [block getNumLinesWithWrapWidth:width];
+    int beforeLines = NumLinesInBlock(self, last, width, YES);
     if (![block appendLine: buffer length: length partial: partial]) {
-        // It's going to be complicated. Invalidate the number of wrapped lines
-        // cache.
-        num_wrapped_lines_width = -1;
+        // It's going to be complicated: the last block may lose a partial
+        // line and a new block may follow it.
+        LineBlock* lastBlock = block;
         int prefix_len = 0;
         screen_char_t* prefix = NULL;
         if ([block hasPartial]) {
@@ -1051,12 +1917,19 @@ static int RawNumLines(LineBuffer* buffer, int width) {
         } else {
             // The existing buffer can't hold this line, but it has preceding line(s). Shrink it and
             // allocate a new buffer that is large enough to hold this line.
+            // Nothing more will be appended to it, so store it compactly.
             [block shrinkToFit];
+            [block compact];
             if (length + prefix_len > block_size) {
                 block = [self _addBlockOfSize: length + prefix_len];
             } else {
                 block = [self _addBlockOfSize: block_size];
             }
+            // One more block is now far enough back to be compressed.
+            int cold = [blocks count] - 1 - kUncompressedBlocks;
+            if (cold >= 0 && [[blocks objectAtIndex: cold] compress]) {
+                [self _spillColdBlocks];
+            }
         }
 
         // Append the prefix if there is one (the prefix was a partial line that we're
@@ -1070,46 +1943,78 @@ static int RawNumLines(LineBuffer* buffer, int width) {
         // enough room for it.
         BOOL ok = [block appendLine: buffer length: length partial: partial];
         NSAssert(ok, @"append can't fail here");
+
+        if (num_wrapped_lines_width == width) {
+            // Correct the count of the block that was last and extend the
+            // line index by the new block, if there is one.
+            int afterLines = [lastBlock getNumLinesWithWrapWidth: width];
+            num_wrapped_lines_cache += (afterLines - beforeLines);
+            LineIndexAdd(self, last, afterLines - beforeLines);
+            if (block != lastBlock) {
+                int newLines = [block getNumLinesWithWrapWidth: width];
+                num_wrapped_lines_cache += newLines;
+                LineIndexAppend(self, newLines);
+            }
+        } else {
+            num_wrapped_lines_width = -1;
+        }
     } else if (num_wrapped_lines_width == width) {
         // Straightforward addition of a line to an existing block. Update the
         // wrapped lines cache.
         int afterLines = [block getNumLinesWithWrapWidth:width];
         num_wrapped_lines_cache += (afterLines - beforeLines);
+        LineIndexAdd(self, [blocks count] - 1, afterLines - beforeLines);
     } else {
         // Width change. Invalidate the wrapped lines cache.
         num_wrapped_lines_width = -1;
     }
 }
 
+// Returns the index of the block holding wrapped line lineNum at the given
+// width, with its exact line count computed, and sets *lineInBlock to the
+// line's number within the block. Returns [blocks count] if there is no such
+// line. The index may only have an estimate for the block it finds, and
+// replacing that with the exact count can move the line into another block,
+// so look again until the count was already right.
+- (int) _blockForLine: (int) lineNum width: (int) width lineInBlock: (int*) lineInBlock
+{
+    RawNumLines(self, width);
+    for (;;) {
+        int i = LineIndexFind(self, lineNum, lineInBlock);
+        if (i >= [blocks count]) {
+            return i;
+        }
+        int stored = LineIndexValue(self, i);
+        if (NumLinesInBlock(self, i, width, YES) == stored) {
+            return i;
+        }
+    }
+}
+
 // Copy a line into the buffer. If the line is shorter than 'width' then only
 // the first 'width' characters will be modified.
 // 0 <= lineNum < numLinesWithWidth:width
 - (int) copyLineToBuffer: (screen_char_t*) buffer width: (int) width lineNum: (int) lineNum
 {
-    int line = lineNum;
-    int i;
-    for (i = 0; i < [blocks count]; ++i) {
+    const int total = RawNumLines(self, width);
+    int line;
+    int i = [self _blockForLine: lineNum width: width lineInBlock: &line];
+    // The line was there by the estimated count the caller had, but replacing
+    // estimates on the way to it left fewer lines. Copy the last line rather
+    // than leave the buffer blank; the caller sees the new count the next
+    // time it asks.
+    while (i >= [blocks count] && lineNum < total && RawNumLines(self, width) > 0) {
+        i = [self _blockForLine: RawNumLines(self, width) - 1 width: width lineInBlock: &line];
+    }
+    if (i < [blocks count]) {
         LineBlock* block = [blocks objectAtIndex: i];
-        NSAssert(block, @"Null block");
-
-        // getNumLinesWithWrapWidth caches its result for the last-used width so
-        // this is usually faster than calling getWrappedLineWithWrapWidth since
-        // most calls to the latter will just decrement line and return NULL.
-        int block_lines = [block getNumLinesWithWrapWidth:width];
-        if (block_lines < line) {
-            line -= block_lines;
-            continue;
-        }
-
-        int length;
         int eol;
-        screen_char_t* p = [block getWrappedLineWithWrapWidth: width
-                                                      lineNum: &line
-                                                   lineLength: &length
-                                            includesEndOfLine: &eol];
-        if (p) {
+        int length = [block copyWrappedLineWithWrapWidth: width
+                                                 lineNum: &line
+                                                toBuffer: buffer
+                                       includesEndOfLine: &eol];
+        if (length >= 0) {
             NSAssert(length <= width, @"Length too long");
-            memcpy((char*) buffer, (char*) p, length * sizeof(screen_char_t));
             return eol;
         }
     }
@@ -1150,6 +2055,7 @@ static int RawNumLines(LineBuffer* buffer, int width) {
     // Clean up the block if the whole thing is empty, otherwise another call
     // to this function would not work correctly.
     if ([block isEmpty]) {
+        [warm_blocks removeObjectIdenticalTo:block];
         [blocks removeLastObject];
     }
 
@@ -1197,10 +2103,12 @@ static int RawNumLines(LineBuffer* buffer, int width) {
         LineBlock* block = [blocks lastObject];
         int last_line_length = [block getRawLineLength: ([block numEntries]-1)];
         screen_char_t* lastRawLine = [block rawLine: ([block numEntries]-1)];
-        int num_overflow_lines = NumberOfFullLines(lastRawLine,
+        int num_overflow_lines = NumberOfFullLines(&lastRawLine->code,
+                                                   kCellStride,
                                                    last_line_length,
                                                    width);
-        int min_x = OffsetOfWrappedLine(lastRawLine,
+        int min_x = OffsetOfWrappedLine(&lastRawLine->code,
+                                        kCellStride,
                                         num_overflow_lines,
                                         last_line_length,
                                         width);
@@ -1318,6 +2226,7 @@ static int RawNumLines(LineBuffer* buffer, int width) {
 
     // NSLog(@"search block %d starting at offset %d", context->absBlockNum - num_dropped_blocks, context->offset);
 
+    TouchBlock(self, block);
     [block findSubstring:context->substring
                  options:context->options
                 atOffset:context->offset
@@ -1355,16 +2264,16 @@ static int RawNumLines(LineBuffer* buffer, int width) {
 - (BOOL) convertPosition: (int) position withWidth: (int) width toX: (int*) x toY: (int*) y
 {
     int i;
-    int yoffset = 0;
     for (i = 0; position >= 0 && i < [blocks count]; ++i) {
         LineBlock* block = [blocks objectAtIndex:i];
         int used = [block rawSpaceUsed];
         if (position >= used) {
             position -= used;
-            yoffset += [block getNumLinesWithWrapWidth:width];
         } else {
+            NumLinesInBlock(self, i, width, YES);
             BOOL result = [block convertPosition: position withWidth: width toX: x toY: y];
-            *y += yoffset;
+            RawNumLines(self, width);
+            *y += LineIndexPrefix(self, i);
             return result;
         }
     }
@@ -1373,22 +2282,11 @@ static int RawNumLines(LineBuffer* buffer, int width) {
 
 - (BOOL) convertCoordinatesAtX: (int) x atY: (int) y withWidth: (int) width toPosition: (int*) position offset:(int)offset
 {
-    int line = y;
-    int i;
-    *position = 0;
-    for (i = 0; i < [blocks count]; ++i) {
+    int line;
+    int i = [self _blockForLine: y width: width lineInBlock: &line];
+    *position = [self _blockPosition: i];
+    if (i < [blocks count]) {
         LineBlock* block = [blocks objectAtIndex: i];
-        NSAssert(block, @"Null block");
-
-        // getNumLinesWithWrapWidth caches its result for the last-used width so
-        // this is usually faster than calling getWrappedLineWithWrapWidth since
-        // most calls to the latter will just decrement line and return NULL.
-        int block_lines = [block getNumLinesWithWrapWidth:width];
-        if (block_lines <= line) {
-            line -= block_lines;
-            *position += [block rawSpaceUsed];
-            continue;
-        }
 
         int pos;
         pos = [block getPositionOfLine: &line atX: x withWidth: width];
@@ -1411,6 +2309,31 @@ static int RawNumLines(LineBuffer* buffer, int width) {
     return NO;
 }
 
+- (void) reflowLastLines: (int) n withWidth: (int) width
+{
+    int i;
+    for (i = [blocks count] - 1; i >= 0 && n > 0; --i) {
+        n -= NumLinesInBlock(self, i, width, YES);
+    }
+}
+
+- (BOOL) reflowBlocks: (int) maxBlocks withWidth: (int) width
+{
+    int i;
+    for (i = [blocks count] - 1; i >= 0; --i) {
+        LineBlock* block = [blocks objectAtIndex: i];
+        if ([block hasCachedNumLinesForWidth: width]) {
+            continue;
+        }
+        if (maxBlocks == 0) {
+            return YES;
+        }
+        NumLinesInBlock(self, i, width, YES);
+        --maxBlocks;
+    }
+    return NO;
+}
+
 - (int) firstPos
 {
     int i;
@@ -1442,5 +2365,17 @@ static int RawNumLines(LineBuffer* buffer, int width) {
     return position;
 }
 
+- (void) getCompressionRawBytes: (long long*) rawBytes compressedBytes: (long long*) compressedBytes
+{
+    *rawBytes = 0;
+    *compressedBytes = 0;
+    for (LineBlock* block in blocks) {
+        if ([block isCompressed]) {
+            *rawBytes += (long long)[block rawSpaceUsed] * sizeof(screen_char_t);
+            *compressedBytes += [block compressedSize];
+        }
+    }
+}
+
 
 @end
@@ -8,6 +8,7 @@
 
 #import "LineBuffer.h"
 #import "LineBufferTest.h"
+#include <unistd.h>
 
 
 @implementation LineBufferTest
@@ -17,7 +18,7 @@
 
 - (screen_char_t*) toSct: (char*) str length: (int*) length partial: (BOOL*) partial
 {
-	screen_char_t* sct = (screen_char_t*) malloc(sizeof(screen_char_t)*strlen(str));
+	screen_char_t* sct = (screen_char_t*) calloc(strlen(str) + 1, sizeof(screen_char_t));
 	*partial = NO;
 	*length = 0;
 	int i;
@@ -27,7 +28,7 @@
 			break;
 		}
 		++(*length);
-		sct[i].ch = str[i];
+		sct[i].code = str[i];
 	}
 	return sct;
 }
@@ -41,14 +42,14 @@
 	for (i = 0; i < [block getNumLinesWithWrapWidth: width]; ++i) {
 		int lineNum = i;
 		int length;
-		BOOL eol;
+		int eol;
 		screen_char_t* sct = [block getWrappedLineWithWrapWidth: width lineNum: &lineNum lineLength: &length includesEndOfLine: &eol];
 		NSAssert(sct, @"Unexpected null result from getWrappedLineWithWrapWidth");
 		int j;
 		for (j = 0; j < length; ++j) {
-			buffer[o++] = sct[j].ch;
+			buffer[o++] = sct[j].code;
 		}
-		if (eol) {
+		if (eol == EOL_HARD) {
 			buffer[o++] = '.';
 		} else {
 			buffer[o++] = '-';
@@ -72,13 +73,13 @@
 	for (i = 0; i < [linebuf numLinesWithWidth: width]; ++i) {
 		screen_char_t sctbuf[100];
 		memset((char*) sctbuf, 0, sizeof(sctbuf));
-		BOOL continuation = [linebuf copyLineToBuffer: sctbuf width: width lineNum: i];
+		int eol = [linebuf copyLineToBuffer: sctbuf width: width lineNum: i];
 		
 		int j;
-		for (j = 0; sctbuf[j].ch; ++j) {
-			buffer[o++] = sctbuf[j].ch;
+		for (j = 0; sctbuf[j].code; ++j) {
+			buffer[o++] = sctbuf[j].code;
 		}
-		if (!continuation) {
+		if (eol == EOL_HARD) {
 			buffer[o++] = '.';
 		} else {
 			buffer[o++] = '-';
@@ -121,7 +122,7 @@ NULL
 		int length;
 		BOOL partial;
 		screen_char_t* sct = [self toSct: testlines[i] length: &length partial: &partial];
-		[buffer appendLine: sct length: length partial: partial];
+		[buffer appendLine: sct length: length partial: partial width: 80];
 		free((void*) sct);
 	}	
 }
@@ -181,7 +182,7 @@ char* wraplines9 =
 {
 	int i;
 	for (i = 0; i < length; i++) {
-		buffer[i] = ptr[i].ch;
+		buffer[i] = ptr[i].code;
 	}
 	buffer[i] = '\0';
 }
@@ -223,11 +224,11 @@ char* wraplines9 =
 	for (i = 0; expect[i+1]; ++i)
 		;
 	screen_char_t scbuf[100];
-	BOOL eol;
+	int eol;
 	memset((char*) scbuf, 0, sizeof(scbuf));
 	while ([linebuf popAndCopyLastLineInto: scbuf width: width includesEndOfLine: &eol]) {
 		int length;
-		for (length = 0; length < 100 && scbuf[length].ch; ++length)
+		for (length = 0; length < 100 && scbuf[length].code; ++length)
 			;
 		[self fromScr: scbuf length: length into: buffer];
 		NSAssert(i >= 0, @"Too many lines popped");
@@ -364,9 +365,12 @@ char* poplines9[] = {
 					// and and sct version in buf. Also append it to wrapped.
 					// Then add ascii to lines.
 					screen_char_t buf[200];
+					memset(buf, 0, sizeof(buf));
 					int len = rand() % 200;
 					char* prefix = "";
-					if (y > 0 && numlines > 0 && continued[y-1]) {
+					// An empty line doesn't continue a partial one; it's
+					// added after it as a blank line.
+					if (y > 0 && numlines > 0 && continued[y-1] && len > 0) {
 						prefix = lines[numlines - 1];
 						numlines--;
 					}
@@ -375,7 +379,7 @@ char* poplines9[] = {
 					int j;
 					for (j = 0; j < len; ++j) {
 						char ch = 'A' + (rand() % 26);
-						buf[j].ch = ch;
+						buf[j].code = ch;
 						ascii[j] = ch;
 					}			
 					ascii[j] = 0;					
@@ -415,11 +419,11 @@ char* poplines9[] = {
 					// Add it in random sized parts to linebuf.
 					int offset = 0;
 					if (len == 0) {
-						[linebuf appendLine: buf length: 0 partial: NO];
+						[linebuf appendLine: buf length: 0 partial: NO width: width];
 					}
 					while (offset < len) {
 						int n = rand() % ((len-offset) + 1);
-						[linebuf appendLine: buf+offset length: n partial: ((offset+n)<len)];
+						[linebuf appendLine: buf+offset length: n partial: ((offset+n)<len) width: width];
 						offset += n;
 					}
 				}
@@ -430,16 +434,16 @@ char* poplines9[] = {
 				if (numlines - reps < 0) break;
 				for (i = 0; i < reps; ++i) {
 					screen_char_t popped[1000];
-					BOOL eol;
+					int eol;
 					memset((char*) popped, 0, sizeof(popped));
 					BOOL ok = [linebuf popAndCopyLastLineInto: popped width: width includesEndOfLine: &eol];
 					NSAssert(ok, @"Pop failed");
-					NSAssert(eol != continued[y-1], @"EOL mismatch");
+					NSAssert((eol == EOL_SOFT) == continued[y-1], @"EOL mismatch");
 					int j;
 					char ascii[1000];
 					for (j = 0; j < width; ++j) {
-						ascii[j] = popped[j].ch;
-						NSAssert(wrapped[width*(y-1) + j] == popped[j].ch,
+						ascii[j] = popped[j].code;
+						NSAssert(wrapped[width*(y-1) + j] == popped[j].code,
 								 @"Popped something unexpected.");
 					}
 					ascii[j] = 0;
@@ -466,11 +470,11 @@ char* poplines9[] = {
 		for (i = 0; i < y && i < nl; ++i) {
 			screen_char_t sct[1000];
 			memset((char*)sct, 0, sizeof(sct));
-			BOOL cont = [linebuf copyLineToBuffer: sct	width:width lineNum:i];
+			int cont = [linebuf copyLineToBuffer: sct	width:width lineNum:i];
 			int j;
 			char temp2[1000];
 			for (j = 0; j < width; ++j) {
-				temp2[j] = sct[j].ch;
+				temp2[j] = sct[j].code;
 			}
 			temp2[j] = 0;
 			char temp[1000];
@@ -481,13 +485,34 @@ char* poplines9[] = {
 			// Uncomment the next line to see side-by-side logs of expected vs actual wrapped buffers.
 			//			NSLog(@"%d %-50s %c    %-50s %c\n", i, temp, continued[i] ? '-' : '.', temp2, cont ? '-' : '.');
 			for (j = 0; j < width; ++j) {
-				NSAssert(wrapped[width*i + j] == sct[j].ch, @"Verify failed");
+				NSAssert(wrapped[width*i + j] == sct[j].code, @"Verify failed");
 			}
-			NSAssert(cont == continued[i], @"Continuation mismatch");
+			NSAssert((cont == EOL_SOFT) == continued[i], @"Continuation mismatch");
 		}
 	}
 }
 
+// Returns the position of the first case-insensitive match of substring at
+// or after start, or -1 if there is none. Sets *length to the number of
+// cells the match covers.
+- (int) find: (NSString*) substring inBuffer: (LineBuffer*) buffer startingAt: (int) start length: (int*) length
+{
+	FindContext context;
+	int position = -1;
+	memset(&context, 0, sizeof(context));
+	[buffer initFind: substring startingAt: start options: FindOptCaseInsensitive withContext: &context];
+	while (context.status == Searching) {
+		[buffer findSubstring: &context stopAt: [buffer lastPos]];
+	}
+	if (context.status == Matched) {
+		ResultRange* range = [context.results objectAtIndex: 0];
+		position = range->position;
+		*length = range->length;
+	}
+	[buffer releaseFind: &context];
+	return position;
+}
+
 - (void) findTest
 {
 	LineBuffer* buffer = [[LineBuffer alloc] initWithBlockSize:20];
@@ -497,25 +522,25 @@ char* poplines9[] = {
 	int length;
 	BOOL partial;
 	sct = [self toSct: "deadxx" length: &length partial: &partial];
-	[buffer appendLine:sct length:6 partial:NO];
+	[buffer appendLine:sct length:6 partial:NO width:10];
 	free((void*)sct);
 
 	sct = [self toSct: "firstx" length: &length partial: &partial];
-	[buffer appendLine:sct length:6 partial:NO];
+	[buffer appendLine:sct length:6 partial:NO width:10];
 	free((void*)sct);
 	
 	sct = [self toSct: "lastxx" length: &length partial: &partial];
-	[buffer appendLine:sct length:6 partial:NO];
+	[buffer appendLine:sct length:6 partial:NO width:10];
 	free((void*)sct);
 	
 	sct = [self toSct: "xzzyzza" length: &length partial: &partial];
-	[buffer appendLine:sct length:7 partial:NO];
+	[buffer appendLine:sct length:7 partial:NO width:10];
 	free((void*)sct);
 	[buffer dropExcessLinesWithWidth:10];
 
 	[buffer dump];
 	int len;
-	int pos = [buffer findSubstring:@"zz" startingAt:0 resultLength:&len options:FindOptCaseInsensitive stopAt:[buffer lastPos]];
+	int pos = [self find:@"zz" inBuffer:buffer startingAt:0 length:&len];
 	NSAssert(pos == 19, @"First match in wrong place");
 	int x=0, y=0;
 	BOOL ok = [buffer convertPosition:pos withWidth:8 toX:&x toY:&y];
@@ -527,7 +552,7 @@ char* poplines9[] = {
 	NSAssert(ok, @"convertCoords failed");
 	NSAssert(pos == 20, @"Pos advanced wrong");
 	
-	pos = [buffer findSubstring:@"zz" startingAt:pos resultLength:&len options:FindOptCaseInsensitive stopAt:[buffer lastPos]];
+	pos = [self find:@"zz" inBuffer:buffer startingAt:pos length:&len];
 	NSAssert(pos == 22, @"Seond match in wrong place");
 	
 	ok = [buffer convertPosition:pos withWidth:8 toX:&x toY:&y];
@@ -549,8 +574,635 @@ char* poplines9[] = {
 	[buffer release];
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////
+// Expected contents
+
+// The widest line the tests below wrap to.
+static const int kMaxTestWidth = 200;
+
+// Everything appended to a LineBuffer, less what was dropped or popped, kept
+// as raw lines so the wrapping at any width can be worked out the slow way.
+typedef struct {
+	screen_char_t* cells;
+	int cellsCapacity;
+	int* ends;  // ends[i] is the offset just past raw line i
+	int linesCapacity;
+	int numLines;
+	int first;  // offset of the first cell of raw line 0
+	BOOL partial;  // the last raw line is continued by the next append
+} ExpectedLines;
+
+static void ExpectedFree(ExpectedLines* e)
+{
+	free(e->cells);
+	free(e->ends);
+}
+
+static int ExpectedLineStart(ExpectedLines* e, int i)
+{
+	return i ? e->ends[i - 1] : e->first;
+}
+
+static void ExpectedAppend(ExpectedLines* e, screen_char_t* cells, int length, BOOL partial)
+{
+	int end = e->numLines ? e->ends[e->numLines - 1] : e->first;
+	if (end + length > e->cellsCapacity) {
+		e->cellsCapacity = 2 * (end + length);
+		e->cells = (screen_char_t*) realloc(e->cells, e->cellsCapacity * sizeof(screen_char_t));
+	}
+	memcpy(e->cells + end, cells, length * sizeof(screen_char_t));
+	// An empty line that isn't partial doesn't finish a partial line. It
+	// follows it as a blank line, like LineBlock's appendLine does.
+	if (!e->numLines || !e->partial || (length == 0 && !partial)) {
+		if (e->numLines == e->linesCapacity) {
+			e->linesCapacity = 2 * e->linesCapacity + 16;
+			e->ends = (int*) realloc(e->ends, e->linesCapacity * sizeof(int));
+		}
+		e->numLines++;
+	}
+	e->ends[e->numLines - 1] = end + length;
+	e->partial = partial;
+}
+
+// Sets *length and *eol for the wrapped line of raw line i that starts at
+// cell offset. A double-width character that would be split moves to the
+// next line.
+static void ExpectedPiece(ExpectedLines* e, int i, int offset, int width, int* length, int* eol)
+{
+	int remaining = e->ends[i] - offset;
+	if (remaining > width) {
+		if (e->cells[offset + width].code == DWC_RIGHT) {
+			*length = width - 1;
+			*eol = EOL_DWC;
+		} else {
+			*length = width;
+			*eol = EOL_SOFT;
+		}
+	} else {
+		*length = remaining;
+		*eol = (i == e->numLines - 1 && e->partial) ? EOL_SOFT : EOL_HARD;
+	}
+}
+
+// Finds wrapped line n. Sets *offset to the offset of its first cell.
+// Returns NO if there are not that many lines.
+static BOOL ExpectedFind(ExpectedLines* e, int n, int width, int* offset, int* length, int* eol)
+{
+	int i;
+	for (i = 0; i < e->numLines; ++i) {
+		int o = ExpectedLineStart(e, i);
+		for (;;) {
+			ExpectedPiece(e, i, o, width, length, eol);
+			if (n-- == 0) {
+				*offset = o;
+				return YES;
+			}
+			if (o + *length == e->ends[i]) {
+				break;
+			}
+			o += *length;
+		}
+	}
+	return NO;
+}
+
+// Returns the number of wrapped lines at width.
+static int ExpectedCount(ExpectedLines* e, int width)
+{
+	int n = 0;
+	int i;
+	for (i = 0; i < e->numLines; ++i) {
+		int o = ExpectedLineStart(e, i);
+		int length, eol;
+		do {
+			ExpectedPiece(e, i, o, width, &length, &eol);
+			o += length;
+			++n;
+		} while (o < e->ends[i]);
+	}
+	return n;
+}
+
+// Drops the first n wrapped lines at width. What's left of a raw line that
+// loses only some of them starts where the dropped part ended, so it may
+// wrap differently at other widths.
+static void ExpectedDrop(ExpectedLines* e, int n, int width)
+{
+	while (n-- > 0 && e->numLines) {
+		int length, eol;
+		ExpectedPiece(e, 0, e->first, width, &length, &eol);
+		e->first += length;
+		if (e->first == e->ends[0]) {
+			memmove(e->ends, e->ends + 1, (e->numLines - 1) * sizeof(int));
+			e->numLines--;
+		}
+	}
+}
+
+// Removes the last wrapped line at width and copies it to cells, as
+// popAndCopyLastLineInto does. *eol gets what the buffer reports: EOL_SOFT
+// if the line went on past the piece popped, even where a double-width
+// character was wrapped.
+static void ExpectedPop(ExpectedLines* e, int width, screen_char_t* cells, int* length, int* eol)
+{
+	const int i = e->numLines - 1;
+	const int start = ExpectedLineStart(e, i);
+	int o = start;
+	int pieceEol;
+	for (;;) {
+		ExpectedPiece(e, i, o, width, length, &pieceEol);
+		if (o + *length == e->ends[i]) {
+			break;
+		}
+		o += *length;
+	}
+	*eol = e->partial ? EOL_SOFT : EOL_HARD;
+	memcpy(cells, e->cells + o, *length * sizeof(screen_char_t));
+	if (o > start) {
+		e->ends[i] = o;
+		e->partial = YES;
+	} else {
+		e->numLines--;
+		e->partial = NO;
+	}
+}
+
+static void AppendBoth(LineBuffer* linebuf, ExpectedLines* e, screen_char_t* cells, int length, BOOL partial, int width)
+{
+	[linebuf appendLine: cells length: length partial: partial width: width];
+	ExpectedAppend(e, cells, length, partial);
+}
+
+// Fills cells with a random line of up to maxLength cells and returns its
+// length. If there are any attrs, runs of up to 16 cells get their attributes
+// from a random one of them, the way real output has them. If dwcs is set,
+// about a quarter of the characters are double-width.
+static int RandomLine(screen_char_t* cells, int maxLength, BOOL dwcs, const screen_char_t* attrs, int numAttrs)
+{
+	int length = rand() % (maxLength + 1);
+	int i;
+	int run = 0;
+	screen_char_t attr = { 0 };
+	memset(cells, 0, length * sizeof(screen_char_t));
+	for (i = 0; i < length; ++i) {
+		if (numAttrs) {
+			if (run-- <= 0) {
+				attr = attrs[rand() % numAttrs];
+				run = rand() % 16;
+			}
+			cells[i] = attr;
+		}
+		if (dwcs && i + 1 < length && rand() % 4 == 0) {
+			cells[i].code = 0x4e00 + rand() % 0x5000;
+			cells[i + 1] = cells[i];
+			cells[i + 1].code = DWC_RIGHT;
+			++i;
+		} else {
+			cells[i].code = 'A' + rand() % 26;
+		}
+	}
+	return length;
+}
+
+// Fills attrs with attributes that set each bit outside of code on its own,
+// plus one with none set and one with all of them set. Returns how many.
+static int AttributeBits(screen_char_t* attrs)
+{
+	const int bits = 8 * (sizeof(screen_char_t) - sizeof(unichar));
+	int n = 0;
+	int i;
+	memset(attrs, 0, (bits + 2) * sizeof(screen_char_t));
+	for (i = 0; i < bits; ++i) {
+		((unsigned char*) &attrs[n++])[sizeof(unichar) + i / 8] = 1 << (i % 8);
+	}
+	n++;
+	memset(((unsigned char*) &attrs[n++]) + sizeof(unichar), 0xff, sizeof(screen_char_t) - sizeof(unichar));
+	return n;
+}
+
+// Copies wrapped line n of linebuf at width and checks it against e. Returns
+// NO if e has no line n.
+- (BOOL) checkLine: (int) n ofBuffer: (LineBuffer*) linebuf expected: (ExpectedLines*) e width: (int) width
+{
+	int offset, length, eol;
+	if (!ExpectedFind(e, n, width, &offset, &length, &eol)) {
+		return NO;
+	}
+	screen_char_t actual[kMaxTestWidth];
+	memset((char*) actual, 0, sizeof(actual));
+	int cont = [linebuf copyLineToBuffer: actual width: width lineNum: n];
+	if (cont != eol || memcmp(actual, e->cells + offset, length * sizeof(screen_char_t))) {
+		NSLog(@"Line %d at width %d: expected %d cells with EOL %d, got EOL %d", n, width, length, eol, cont);
+		NSAssert(NO, @"Wrong line in checkLine");
+	}
+	return YES;
+}
+
+// Checks every wrapped line of linebuf at width against e, cell for cell, in
+// order from the first. Lines are looked up before the count is, so blocks
+// that only have an estimate for this width are rewrapped as they're reached.
+- (void) checkBuffer: (LineBuffer*) linebuf expected: (ExpectedLines*) e width: (int) width
+{
+	int n = 0;
+	while ([self checkLine: n ofBuffer: linebuf expected: e width: width]) {
+		++n;
+	}
+	NSAssert([linebuf numLinesWithWidth: width] == n, @"Wrong number of lines");
+	NSLog(@"checkBuffer ok for %d lines at width %d", n, width);
+}
+
+// Like checkBuffer, for a single block.
+- (void) checkBlock: (LineBlock*) block expected: (ExpectedLines*) e width: (int) width
+{
+	int n = 0;
+	int offset, length, eol;
+	while (ExpectedFind(e, n, width, &offset, &length, &eol)) {
+		screen_char_t actual[kMaxTestWidth];
+		memset((char*) actual, 0, sizeof(actual));
+		int line = n;
+		int cont;
+		int copied = [block copyWrappedLineWithWrapWidth: width lineNum: &line toBuffer: actual includesEndOfLine: &cont];
+		if (copied != length || cont != eol || memcmp(actual, e->cells + offset, length * sizeof(screen_char_t))) {
+			NSLog(@"Block line %d at width %d: expected %d cells with EOL %d, got %d cells with EOL %d", n, width, length, eol, copied, cont);
+			NSAssert(NO, @"Wrong line in checkBlock");
+		}
+		++n;
+	}
+	NSAssert([block getNumLinesWithWrapWidth: width] == n, @"Wrong number of lines in block");
+}
+
+// Checks every wrapped line of linebuf at width, jumping far enough between
+// them that each lookup lands in a different block from the one before.
+- (void) checkBufferRoundRobin: (LineBuffer*) linebuf expected: (ExpectedLines*) e width: (int) width
+{
+	int total = [linebuf numLinesWithWidth: width];
+	int stride = total / 5 + 1;
+	int a, b;
+	// Visit all of the lines by making the stride coprime to the total.
+	for (;;) {
+		for (a = total, b = stride; b; ) {
+			int t = a % b;
+			a = b;
+			b = t;
+		}
+		if (a == 1) {
+			break;
+		}
+		++stride;
+	}
+	int i;
+	for (i = 0; i < total; ++i) {
+		int n = (int) (((long long) i * stride) % total);
+		NSAssert([self checkLine: n ofBuffer: linebuf expected: e width: width], @"Too many lines");
+	}
+	NSLog(@"checkBufferRoundRobin ok for %d lines at width %d", total, width);
+}
+
+// Fills cells with a line that has a double-width character whose left half
+// is in the last column of a wrapped line at width, and returns its length.
+static int StraddlingLine(screen_char_t* cells, int width)
+{
+	int length = width - 1 + width * (rand() % 3);
+	int tail = rand() % 30;
+	int i;
+	memset(cells, 0, (length + 2 + tail) * sizeof(screen_char_t));
+	for (i = 0; i < length; ++i) {
+		cells[i].code = 'a' + rand() % 26;
+	}
+	cells[length++].code = 0x4e00 + rand() % 0x5000;
+	cells[length++].code = DWC_RIGHT;
+	for (i = 0; i < tail; ++i) {
+		cells[length++].code = 'a' + rand() % 26;
+	}
+	return length;
+}
+
+// Appends random lines to block until it's full.
+static void FillBlock(LineBlock* block, ExpectedLines* e, BOOL dwcs, const screen_char_t* attrs, int numAttrs)
+{
+	screen_char_t cells[300];
+	for (;;) {
+		int length = RandomLine(cells, 100, dwcs, attrs, numAttrs);
+		BOOL partial = rand() % 8 == 0;
+		if (![block appendLine: cells length: length partial: partial]) {
+			return;
+		}
+		ExpectedAppend(e, cells, length, partial);
+	}
+}
+
+// Appends n random lines to linebuf at width, an eighth of them partial.
+static void FillBuffer(LineBuffer* linebuf, ExpectedLines* e, int n, BOOL dwcs, const screen_char_t* attrs, int numAttrs, int width)
+{
+	screen_char_t cells[300];
+	int i;
+	for (i = 0; i < n; ++i) {
+		int length = RandomLine(cells, 100, dwcs, attrs, numAttrs);
+		AppendBoth(linebuf, e, cells, length, rand() % 8 == 0, width);
+	}
+}
+
+// After a resize, blocks count their lines by scaling the count at the old
+// width until something looks inside them. Going from 80 to 40 columns
+// underestimates lines that wrap only at 40, and going on to 120
+// overestimates those that wrapped at 40 but don't anymore. Every line must
+// still be found, and the count must end up exact.
+- (void) testRewrapAfterWidthChange
+{
+	LineBuffer* linebuf = [[LineBuffer alloc] initWithBlockSize: 200];
+	ExpectedLines expected = { 0 };
+
+	srand(1);
+	FillBuffer(linebuf, &expected, 2000, NO, NULL, 0, 80);
+	[self checkBuffer: linebuf expected: &expected width: 80];
+	[self checkBuffer: linebuf expected: &expected width: 40];
+	[self checkBuffer: linebuf expected: &expected width: 120];
+	[self checkBuffer: linebuf expected: &expected width: 80];
+
+	ExpectedFree(&expected);
+	[linebuf release];
+}
+
+// A caller that counted lines before a lookup made the count exact may ask
+// for a line that's no longer there. Going from 40 columns to 120
+// overestimates, so the last line by the estimate is past the end once the
+// blocks are rewrapped; the buffer must give back its real last line.
+- (void) testLastLineByEstimate
+{
+	LineBuffer* linebuf = [[LineBuffer alloc] initWithBlockSize: 200];
+	ExpectedLines expected = { 0 };
+	screen_char_t actual[kMaxTestWidth];
+	int offset, length, eol;
+
+	srand(8);
+	FillBuffer(linebuf, &expected, 2000, NO, NULL, 0, 80);
+	[self checkBuffer: linebuf expected: &expected width: 40];
+	const int estimate = [linebuf numLinesWithWidth: 120];
+	const int exact = ExpectedCount(&expected, 120);
+	NSAssert(estimate > exact, @"Not an overestimate");
+	ExpectedFind(&expected, exact - 1, 120, &offset, &length, &eol);
+	memset((char*) actual, 0, sizeof(actual));
+	int cont = [linebuf copyLineToBuffer: actual width: 120 lineNum: estimate - 1];
+	NSAssert(cont == eol && !memcmp(actual, expected.cells + offset, length * sizeof(screen_char_t)),
+			 @"Didn't copy the last line");
+	[self checkBuffer: linebuf expected: &expected width: 120];
+
+	ExpectedFree(&expected);
+	[linebuf release];
+}
+
+// A full block is stored as codes plus indexes into a palette of attributes.
+// Every attribute bit must survive that, and a block with more distinct
+// attributes than the palette holds must stay as it was.
+- (void) testCompactRoundTrip
+{
+	screen_char_t attrs[300];
+	int numAttrs = AttributeBits(attrs);
+	ExpectedLines expected = { 0 };
+	LineBlock* block = [[LineBlock alloc] initWithRawBufferSize: 4000];
+
+	srand(2);
+	FillBlock(block, &expected, YES, attrs, numAttrs);
+	NSAssert([block compact], @"compact failed");
+	NSAssert([block isCompact], @"Not compact after compact");
+	[self checkBlock: block expected: &expected width: 80];
+	[self checkBlock: block expected: &expected width: 33];
+	[block release];
+	ExpectedFree(&expected);
+
+	int i;
+	memset(attrs, 0, sizeof(attrs));
+	for (i = 0; i < 300; ++i) {
+		attrs[i].foregroundColor = i & 0xff;
+		attrs[i].backgroundColor = i >> 8;
+	}
+	memset(&expected, 0, sizeof(expected));
+	block = [[LineBlock alloc] initWithRawBufferSize: 4000];
+	screen_char_t cells[300];
+	for (i = 0; i < 300; ++i) {
+		cells[i] = attrs[i];
+		cells[i].code = 'a' + i % 26;
+	}
+	NSAssert([block appendLine: cells length: 300 partial: NO], @"append failed");
+	ExpectedAppend(&expected, cells, 300, NO);
+	FillBlock(block, &expected, NO, attrs, 300);
+	NSAssert(![block compact], @"compact with too many attributes succeeded");
+	NSAssert(![block isCompact], @"Compact with too many attributes");
+	[self checkBlock: block expected: &expected width: 80];
+	[block release];
+	ExpectedFree(&expected);
+}
+
+// Blocks well behind the end are compressed, and only a few of them keep
+// their cells decompressed. Reading them in an order that keeps evicting
+// those must still give back every cell.
+- (void) testCompressRoundTrip
+{
+	screen_char_t attrs[64];
+	int numAttrs = AttributeBits(attrs);
+	ExpectedLines expected = { 0 };
+	LineBlock* block = [[LineBlock alloc] initWithRawBufferSize: 4000];
+
+	srand(3);
+	FillBlock(block, &expected, YES, attrs, numAttrs);
+	NSAssert([block compact], @"compact failed");
+	NSAssert([block compress], @"compress failed");
+	NSAssert([block isCompressed], @"Not compressed after compress");
+	NSAssert([block compressedSize] > 0, @"No compressed size");
+	[self checkBlock: block expected: &expected width: 80];
+	[block releaseDecompressedCells];
+	[self checkBlock: block expected: &expected width: 47];
+	[block release];
+	ExpectedFree(&expected);
+
+	LineBuffer* linebuf = [[LineBuffer alloc] initWithBlockSize: 200];
+	memset(&expected, 0, sizeof(expected));
+	FillBuffer(linebuf, &expected, 2000, YES, attrs, numAttrs, 80);
+	long long rawBytes, compressedBytes;
+	[linebuf getCompressionRawBytes: &rawBytes compressedBytes: &compressedBytes];
+	NSAssert(rawBytes > 0, @"Nothing was compressed");
+	NSAssert(compressedBytes > 0 && compressedBytes < rawBytes, @"Compression didn't save anything");
+	[self checkBufferRoundRobin: linebuf expected: &expected width: 80];
+	// Rewrapping decompresses every block in turn.
+	[self checkBuffer: linebuf expected: &expected width: 61];
+
+	ExpectedFree(&expected);
+	[linebuf release];
+}
+
+// Compressed blocks past the spill budget are written to a file and mapped
+// back. A budget of 0 spills every one of them.
+- (void) testSpillRoundTrip
+{
+	screen_char_t attrs[64];
+	int numAttrs = AttributeBits(attrs);
+	ExpectedLines expected = { 0 };
+	LineBlock* block = [[LineBlock alloc] initWithRawBufferSize: 4000];
+
+	srand(4);
+	FillBlock(block, &expected, YES, attrs, numAttrs);
+	NSAssert([block compact] && [block compress], @"compress failed");
+	char path[] = "/tmp/LineBufferTest.XXXXXX";
+	int fd = mkstemp(path);
+	NSAssert(fd >= 0, @"mkstemp failed");
+	unlink(path);
+	off_t offset = 0;
+	NSAssert([block spillToFile: fd atOffset: &offset], @"spill failed");
+	NSAssert([block isSpilled], @"Not spilled after spill");
+	NSAssert(offset > 0 && offset % getpagesize() == 0, @"Bad spill offset");
+	[block releaseDecompressedCells];
+	[self checkBlock: block expected: &expected width: 80];
+	[block release];
+	close(fd);
+	ExpectedFree(&expected);
+
+	LineBuffer* linebuf = [[LineBuffer alloc] initWithBlockSize: 200];
+	[linebuf setSpillBudget: 0];
+	memset(&expected, 0, sizeof(expected));
+	FillBuffer(linebuf, &expected, 2000, YES, attrs, numAttrs, 80);
+	[self checkBufferRoundRobin: linebuf expected: &expected width: 80];
+
+	ExpectedFree(&expected);
+	[linebuf release];
+}
+
+// A buffer limited to some number of lines drops whole wrapped lines from
+// the front as lines are added. Blocks are appended and dropped throughout,
+// at several widths, and everything left must wrap correctly at any width.
+// Each width drops far more blocks than the buffer holds, so the line index
+// is compacted along the way and checked at that width before it's rebuilt.
+- (void) testDropWithWidthChanges
+{
+	const int maxLines = 500;
+	const int widths[] = { 80, 40, 120, 33, 80 };
+	LineBuffer* linebuf = [[LineBuffer alloc] initWithBlockSize: 200];
+	ExpectedLines expected = { 0 };
+	int i, j;
+
+	[linebuf setMaxLines: maxLines];
+	srand(5);
+	for (i = 0; i < (int) (sizeof(widths) / sizeof(*widths)); ++i) {
+		const int width = widths[i];
+		// Rewrap everything so that the count the buffer drops by is exact.
+		while ([linebuf reflowBlocks: 100 withWidth: width]) {
+		}
+		for (j = 0; j < 600; ++j) {
+			FillBuffer(linebuf, &expected, 1, YES, NULL, 0, width);
+			[linebuf dropExcessLinesWithWidth: width];
+			int count = ExpectedCount(&expected, width);
+			if (count > maxLines) {
+				ExpectedDrop(&expected, count - maxLines, width);
+			}
+		}
+		NSAssert([linebuf numLinesWithWidth: width] == maxLines, @"Wrong number of lines after drop");
+		[self checkBuffer: linebuf expected: &expected width: width];
+		[self checkBuffer: linebuf expected: &expected width: 57];
+		[self checkBufferRoundRobin: linebuf expected: &expected width: 57];
+	}
+
+	ExpectedFree(&expected);
+	[linebuf release];
+}
+
+// Blocks remember their line counts for NUM_LINES_CACHE_SIZE widths. Going
+// around more widths than that keeps evicting them, and appending in between
+// changes the counts that are still remembered.
+- (void) testMoreWidthsThanCached
+{
+	const int widths[] = { 80, 40, 120, 33, 97, 64 };
+	const int numWidths = sizeof(widths) / sizeof(*widths);
+	NSAssert(numWidths > NUM_LINES_CACHE_SIZE, @"Not enough widths");
+	LineBuffer* linebuf = [[LineBuffer alloc] initWithBlockSize: 200];
+	LineBlock* block = [[LineBlock alloc] initWithRawBufferSize: 4000];
+	ExpectedLines expected = { 0 };
+	ExpectedLines expectedBlock = { 0 };
+	int i;
+
+	srand(6);
+	FillBlock(block, &expectedBlock, YES, NULL, 0);
+	FillBuffer(linebuf, &expected, 1000, YES, NULL, 0, 80);
+	for (i = 0; i < 3 * numWidths; ++i) {
+		const int width = widths[i % numWidths];
+		[self checkBlock: block expected: &expectedBlock width: width];
+		[self checkBuffer: linebuf expected: &expected width: width];
+		FillBuffer(linebuf, &expected, 50, YES, NULL, 0, width);
+		NSAssert([linebuf numLinesWithWidth: width] == ExpectedCount(&expected, width),
+				 @"Wrong number of lines after appending");
+	}
+
+	ExpectedFree(&expectedBlock);
+	ExpectedFree(&expected);
+	[block release];
+	[linebuf release];
+}
+
+// Double-width characters that would be split by the right margin move to
+// the next line, which must come out the same whether lines are found,
+// counted, or popped off the end. Lines without any go through the faster
+// path that doesn't look for them.
+- (void) testDoubleWidthAtMargin
+{
+	const int width = 20;
+	LineBuffer* linebuf = [[LineBuffer alloc] initWithBlockSize: 200];
+	ExpectedLines expected = { 0 };
+	screen_char_t cells[300];
+	int i;
+
+	srand(7);
+	for (i = 0; i < 600; ++i) {
+		int length;
+		switch (i % 3) {
+			case 0:
+				length = StraddlingLine(cells, width);
+				break;
+			case 1:
+				length = RandomLine(cells, 100, YES, NULL, 0);
+				break;
+			default:
+				length = RandomLine(cells, 100, NO, NULL, 0);
+				break;
+		}
+		AppendBoth(linebuf, &expected, cells, length, rand() % 8 == 0, width);
+	}
+	[self checkBuffer: linebuf expected: &expected width: width];
+	[self checkBuffer: linebuf expected: &expected width: width + 1];
+	[self checkBuffer: linebuf expected: &expected width: width - 1];
+	[self checkBuffer: linebuf expected: &expected width: width];
+
+	int n = 0;
+	while (expected.numLines) {
+		screen_char_t actual[kMaxTestWidth];
+		screen_char_t want[kMaxTestWidth];
+		int length, eol, cont;
+		memset((char*) actual, 0, sizeof(actual));
+		ExpectedPop(&expected, width, want, &length, &eol);
+		NSAssert([linebuf popAndCopyLastLineInto: actual width: width includesEndOfLine: &cont], @"pop failed");
+		if (cont != eol || memcmp(actual, want, length * sizeof(screen_char_t))) {
+			NSLog(@"Pop %d: expected %d cells with EOL %d, got EOL %d", n, length, eol, cont);
+			NSAssert(NO, @"Wrong line popped");
+		}
+		if (++n % 100 == 0) {
+			[self checkBuffer: linebuf expected: &expected width: width];
+		}
+	}
+	screen_char_t actual[kMaxTestWidth];
+	int cont;
+	NSAssert(![linebuf popAndCopyLastLineInto: actual width: width includesEndOfLine: &cont], @"Popped from an empty buffer");
+
+	ExpectedFree(&expected);
+	[linebuf release];
+}
+
 - (void) runTests
 {
+	[self testRewrapAfterWidthChange];
+	[self testLastLineByEstimate];
+	[self testCompactRoundTrip];
+	[self testCompressRoundTrip];
+	[self testSpillRoundTrip];
+	[self testDropWithWidthChanges];
+	[self testMoreWidthsThanCached];
+	[self testDoubleWidthAtMargin];
 	[self findTest];
 	[self testAppend];
 	[self testPop];
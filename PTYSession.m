@@ -48,6 +48,7 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <libkern/OSAtomic.h>
 
 #define DEBUG_ALLOC           0
 #define DEBUG_METHOD_TRACE    0
@@ -67,6 +68,40 @@ static NSString* SESSION_ARRANGEMENT_ROWS = @"Rows";
 static NSString* SESSION_ARRANGEMENT_BOOKMARK = @"Bookmark";
 static NSString* SESSION_ARRANGEMENT_WORKING_DIRECTORY = @"Working Directory";
 
+// Number of tokens passed from the terminal to the screen at a time.
+static const int kMaxTokensPerBatch = VT100_TOKEN_BATCH_SIZE;
+// Number of parsed batches that may wait for the main thread before the
+// TaskNotifier thread stops reading from the job.
+static const int kMaxQueuedTokenBatches = 32;
+// Firehose mode starts when this many bytes per second are processed over a
+// window of kFirehoseWindowSec, and ends below half the rate.
+static const double kFirehoseBytesPerSecond = 4 * 1024 * 1024;
+static const double kFirehoseWindowSec = 0.25;
+
+static PTYSessionTokenType TokenTypeForStatistics(int type)
+{
+    switch (type) {
+        case VT100_STRING:
+        case VT100_ASCIISTRING:
+        case VT100_UTF8STRING:
+        case VT100_DOUBLEBYTESTRING:
+            return kSessionTokenText;
+        case VT100CSI_DECSET:
+        case VT100CSI_DECRST:
+            return kSessionTokenCSI;
+    }
+    if (type >= 0 && type < 32) {
+        return kSessionTokenControl;
+    }
+    if (type >= XTERMCC_WIN_TITLE && type <= XTERMCC_SET_KVP) {
+        return kSessionTokenXterm;
+    }
+    if (type >= VT100CSI_CPR && type < STRICT_ANSI_MODE) {
+        return kSessionTokenCSI;
+    }
+    return kSessionTokenOther;
+}
+
 // init/dealloc
 - (id)init
 {
@@ -101,6 +136,10 @@ static NSString* SESSION_ARRANGEMENT_WORKING_DIRECTORY = @"Working Directory";
     slowPasteBuffer = [[NSMutableString alloc] init];
     creationDate_ = [[NSDate date] retain];
 
+    streamLock_ = [[NSLock alloc] init];
+    VT100TokenQueueInit(&tokenQueue_, kMaxQueuedTokenBatches);
+    VT100TokenQueueInit(&freeBatches_, kMaxQueuedTokenBatches);
+
     [[NSNotificationCenter defaultCenter] addObserver:self
                                              selector:@selector(windowResized)
                                                  name:@"iTermWindowDidResize"
@@ -110,6 +149,8 @@ static NSString* SESSION_ARRANGEMENT_WORKING_DIRECTORY = @"Working Directory";
 
 - (void)dealloc
 {
+    // Waits for the TaskNotifier thread to finish any read into our stream.
+    [SHELL setDelegate:nil];
     [slowPasteBuffer release];
     if (slowPasteTimer) {
         [slowPasteTimer invalidate];
@@ -138,6 +179,18 @@ static NSString* SESSION_ARRANGEMENT_WORKING_DIRECTORY = @"Working Directory";
     [TERMINAL release];
     TERMINAL = nil;
 
+    VT100TokenBatch* batch;
+    while ((batch = VT100TokenQueuePop(&tokenQueue_))) {
+        VT100TokenBatchFree(batch);
+    }
+    while ((batch = VT100TokenQueuePop(&freeBatches_))) {
+        VT100TokenBatchFree(batch);
+    }
+    VT100TokenBatchFree(spareBatch_);
+    VT100TokenQueueFree(&tokenQueue_);
+    VT100TokenQueueFree(&freeBatches_);
+    [streamLock_ release];
+
     [[NSNotificationCenter defaultCenter] removeObserver:self];
 
     if (dvrDecoder_) {
@@ -536,7 +589,10 @@ static NSString* SESSION_ARRANGEMENT_WORKING_DIRECTORY = @"Working Directory";
         [liveSession_ terminate];
     }
 
+    // Hold the lock so the TaskNotifier thread isn't left parsing.
+    [streamLock_ lock];
     EXIT = YES;
+    [streamLock_ unlock];
     [SHELL stop];
 
     // final update of display
@@ -599,34 +655,209 @@ static NSString* SESSION_ARRANGEMENT_WORKING_DIRECTORY = @"Working Directory";
         [[NSString alloc] initWithBytes:[data bytes] length:[data length] encoding:nil]);
 #endif
 
+    // Anything already parsed on the TaskNotifier thread comes first.
+    [self _applyTokenBatches];
+    [streamLock_ lock];
+    statistics_.bytesRead += [data length];
     [TERMINAL putStreamData:data];
-
-    VT100TCC token;
-
-    // while loop to process all the tokens we can get
-    while (!EXIT &&
-           TERMINAL &&
-           ((token = [TERMINAL getNextToken]),
-            token.type != VT100_WAIT &&
-            token.type != VT100CC_NULL)) {
-        // process token
-        if (token.type != VT100_SKIP) {
-            if (token.type == VT100_NOTSUPPORT) {
-                //NSLog(@"%s(%d):not support token", __FILE__ , __LINE__);
-            } else {
-                [SCREEN putToken:token];
+    [self _applyStream];
+    [streamLock_ unlock];
+    [self _didProcessLength:[data length]];
+}
+
+- (unsigned char*)taskReadBufferWithSpace:(int)length
+{
+    // Called on the TaskNotifier thread. The lock is held until
+    // taskDidReadLength: so the stream can't move while read() fills it.
+    // PTYTask holds its delegate lock across both calls, so -terminate and
+    // -dealloc, which clear SHELL's delegate, wait for them to finish.
+    [streamLock_ lock];
+    if (EXIT || !TERMINAL) {
+        [streamLock_ unlock];
+        return NULL;
+    }
+    return [TERMINAL streamBufferWithSpace:length];
+}
+
+- (void)taskDidReadLength:(int)length
+{
+    // Called on the TaskNotifier thread with streamLock_ held. Parse into
+    // batches and let the main thread apply them while this thread goes
+    // back to reading.
+    BOOL queued = NO;
+    [TERMINAL appendStreamLength:length];
+    statistics_.bytesRead += length;
+    if (!parseStalled_) {
+        for (;;) {
+            VT100TokenBatch* batch;
+            BOOL parsed;
+            double start;
+            if (VT100TokenQueueIsFull(&tokenQueue_)) {
+                // The main thread will parse the rest when it catches up.
+                parseStalled_ = YES;
+                break;
+            }
+            batch = spareBatch_;
+            spareBatch_ = NULL;
+            if (!batch) {
+                batch = VT100TokenQueuePop(&freeBatches_);
             }
+            if (!batch) {
+                batch = calloc(1, sizeof(VT100TokenBatch));
+            }
+            start = PTYSessionStatisticsClock();
+            parsed = [TERMINAL getTokenBatch:batch] > 0;
+            statistics_.parseTime += PTYSessionStatisticsClock() - start;
+            if (!parsed) {
+                spareBatch_ = batch;
+                break;
+            }
+            VT100TokenQueuePush(&tokenQueue_, batch);
+            queued = YES;
         }
-    } // end token processing loop
+    }
+    [streamLock_ unlock];
+
+    if (queued && OSAtomicCompareAndSwap32Barrier(0, 1, &batchesPosted_)) {
+        [self performSelectorOnMainThread:@selector(_applyTokenBatches)
+                               withObject:nil
+                            waitUntilDone:NO];
+    }
+}
+
+- (BOOL)taskWantsRead
+{
+    // Called on the TaskNotifier thread. An unlocked read is fine: after
+    // clearing the flag, the main thread calls -[PTYTask resumeReading].
+    return !parseStalled_;
+}
+
+// Main thread. Hands tokens to the screen and counts them.
+- (void)_putTokens:(VT100TCC*)tokens count:(int)count
+{
+    double start = PTYSessionStatisticsClock();
+    int i;
+
+    for (i = 0; i < count; i++) {
+        ++statistics_.tokens[TokenTypeForStatistics(tokens[i].type)];
+    }
+    [SCREEN putTokens:tokens count:count];
+    statistics_.putTokensTime += PTYSessionStatisticsClock() - start;
+}
 
+// Applies and recycles every batch in tokenQueue_. Returns the number of
+// stream bytes they covered.
+- (int)_applyQueuedTokenBatches
+{
+    VT100TokenBatch* batch;
+    int length = 0;
+
+    while ((batch = VT100TokenQueuePop(&tokenQueue_))) {
+        if (!EXIT) {
+            [self _putTokens:batch->tokens count:batch->count];
+        }
+        length += batch->length;
+        VT100TokenBatchClear(batch);
+        if (!VT100TokenQueuePush(&freeBatches_, batch)) {
+            VT100TokenBatchFree(batch);
+        }
+    }
+    return length;
+}
+
+// Parses and applies everything in the terminal's stream. streamLock_ must
+// be held.
+- (void)_applyStream
+{
+    VT100TCC tokens[kMaxTokensPerBatch];
+    int count;
+
+    // Hand the screen batches of tokens until the stream runs dry.
+    while (!EXIT && TERMINAL) {
+        double start = PTYSessionStatisticsClock();
+        count = [TERMINAL getTokens:tokens max:kMaxTokensPerBatch];
+        statistics_.parseTime += PTYSessionStatisticsClock() - start;
+        if (count <= 0) {
+            break;
+        }
+        [self _putTokens:tokens count:count];
+    }
+}
+
+// Main thread. Applies what the TaskNotifier thread has parsed.
+- (void)_applyTokenBatches
+{
+    BOOL resume = NO;
+    int length;
+
+    // Clear the flag first so that batches queued from here on post again.
+    OSAtomicCompareAndSwap32Barrier(1, 0, &batchesPosted_);
+    length = [self _applyQueuedTokenBatches];
+
+    if (parseStalled_) {
+        [streamLock_ lock];
+        if (parseStalled_) {
+            // The TaskNotifier thread can't add to the queue now, and it may
+            // have filled it again since it was drained above. Batches come
+            // before whatever it left unparsed.
+            length += [self _applyQueuedTokenBatches];
+            [self _applyStream];
+            parseStalled_ = NO;
+            resume = YES;
+        }
+        [streamLock_ unlock];
+    }
+    if (resume) {
+        [SHELL resumeReading];
+    }
+    if (length > 0 && !EXIT) {
+        [self _didProcessLength:length];
+    }
+}
+
+// Adds |length| bytes to the current throughput window and turns firehose
+// mode on or off when the window ends.
+- (void)_measureThroughput:(int)length
+{
+    double now = PTYSessionStatisticsClock();
+    double elapsed;
+    double rate;
+    BOOL firehose;
+
+    firehoseWindowBytes_ += length;
+    elapsed = now - firehoseWindowStart_;
+    if (elapsed < kFirehoseWindowSec) {
+        return;
+    }
+    rate = firehoseWindowBytes_ / elapsed;
+    if (firehose_) {
+        // Stopping at a lower rate keeps the mode from flapping.
+        firehose = rate > kFirehoseBytesPerSecond / 2;
+    } else {
+        firehose = rate > kFirehoseBytesPerSecond;
+    }
+    if (firehose != firehose_) {
+        firehose_ = firehose;
+        [SCREEN setFirehose:firehose];
+    }
+    firehoseWindowStart_ = now;
+    firehoseWindowBytes_ = 0;
+}
+
+// Called after |length| bytes of output have been applied to the screen.
+- (void)_didProcessLength:(int)length
+{
     gettimeofday(&lastOutput, NULL);
     newOutput = YES;
+    [self _measureThroughput:length];
 
     // Make sure the screen gets redrawn soonish
     [updateDisplayUntil_ release];
     updateDisplayUntil_ = [[NSDate dateWithTimeIntervalSinceNow:10] retain];
     if ([[[self tab] parentWindow] currentTab] == [self tab]) {
-        if ([data length] < 1024) {
+        if (firehose_) {
+            [self scheduleUpdateIn:kFirehoseTimerIntervalSec];
+        } else if (length < 1024) {
             [self scheduleUpdateIn:kFastTimerIntervalSec];
         } else {
             [self scheduleUpdateIn:kSlowTimerIntervalSec];
@@ -1953,8 +2184,10 @@ static NSString* SESSION_ARRANGEMENT_WORKING_DIRECTORY = @"Working Directory";
 
 - (void)setTERMINAL:(VT100Terminal *)theTERMINAL
 {
+    [streamLock_ lock];
     [TERMINAL autorelease];
     TERMINAL = [theTERMINAL retain];
+    [streamLock_ unlock];
 }
 
 - (NSString *)TERM_VALUE
@@ -2041,7 +2274,9 @@ static NSString* SESSION_ARRANGEMENT_WORKING_DIRECTORY = @"Working Directory";
     NSLog(@"%s(%d):-[PTYSession setEncoding:%d]",
           __FILE__, __LINE__, encoding);
 #endif
+    [streamLock_ lock];
     [TERMINAL setEncoding:encoding];
+    [streamLock_ unlock];
 }
 
 
@@ -2055,6 +2290,59 @@ static NSString* SESSION_ARRANGEMENT_WORKING_DIRECTORY = @"Working Directory";
     return [TEXTVIEW content];
 }
 
+- (PTYSessionStatistics)statistics
+{
+    PTYSessionStatistics statistics;
+    [streamLock_ lock];
+    statistics = statistics_;
+    [streamLock_ unlock];
+    return statistics;
+}
+
+- (NSString *)statisticsReport
+{
+    PTYSessionStatistics s = [self statistics];
+    long long rawScrollback;
+    long long compressedScrollback;
+    [SCREEN getScrollbackCompressionRawBytes:&rawScrollback
+                             compressedBytes:&compressedScrollback];
+    return [NSString stringWithFormat:
+            @"bytes read: %lld\n"
+            @"text tokens: %lld\n"
+            @"control tokens: %lld\n"
+            @"csi tokens: %lld\n"
+            @"xterm tokens: %lld\n"
+            @"other tokens: %lld\n"
+            @"parse seconds: %.3f\n"
+            @"put tokens seconds: %.3f\n"
+            @"refresh seconds: %.3f\n"
+            @"draw seconds: %.3f\n"
+            @"frames drawn: %lld\n"
+            @"frames skipped: %lld\n"
+            @"compressed scrollback bytes: %lld of %lld (ratio %.2f)\n",
+            s.bytesRead,
+            s.tokens[kSessionTokenText],
+            s.tokens[kSessionTokenControl],
+            s.tokens[kSessionTokenCSI],
+            s.tokens[kSessionTokenXterm],
+            s.tokens[kSessionTokenOther],
+            s.parseTime,
+            s.putTokensTime,
+            s.refreshTime,
+            s.drawTime,
+            s.framesDrawn,
+            s.framesSkipped,
+            compressedScrollback,
+            rawScrollback,
+            compressedScrollback ? (double)rawScrollback / compressedScrollback : 1.0];
+}
+
+- (void)textViewDidDrawInSeconds:(double)seconds
+{
+    statistics_.drawTime += seconds;
+    ++statistics_.framesDrawn;
+}
+
 - (NSString *)backgroundImagePath
 {
     return backgroundImagePath;
@@ -2445,6 +2733,8 @@ static long long timeInTenthsOfSeconds(struct timeval t)
 - (void)updateDisplay
 {
     timerRunning_ = YES;
+    // Ends firehose mode once the output stops.
+    [self _measureThroughput:0];
     BOOL anotherUpdateNeeded = [NSApp isActive];
     if (!anotherUpdateNeeded &&
         updateDisplayUntil_ &&
@@ -2487,7 +2777,10 @@ static long long timeInTenthsOfSeconds(struct timeval t)
         }
     }
 
-    anotherUpdateNeeded |= [TEXTVIEW refresh];
+    // Finish rewrapping the scrollback after a resize before refreshing so
+    // that the view picks up any change in the number of lines.
+    anotherUpdateNeeded |= [SCREEN continueReflow];
+    anotherUpdateNeeded |= [self _refreshTextView];
     anotherUpdateNeeded |= [[[self tab] parentWindow] tempTitle];
 
     if (anotherUpdateNeeded) {
@@ -2503,9 +2796,22 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     timerRunning_ = NO;
 }
 
+// Refreshes the text view and counts the time it took. Returns the result of
+// -[PTYTextView refresh].
+- (BOOL)_refreshTextView
+{
+    double start = PTYSessionStatisticsClock();
+    BOOL result = [TEXTVIEW refresh];
+    statistics_.refreshTime += PTYSessionStatisticsClock() - start;
+    if (![TEXTVIEW needsDisplay]) {
+        ++statistics_.framesSkipped;
+    }
+    return result;
+}
+
 - (void)refreshAndStartTimerIfNeeded
 {
-    if ([TEXTVIEW refresh]) {
+    if ([self _refreshTextView]) {
         [self scheduleUpdateIn:kBlinkTimerIntervalSec];
     }
 }
@@ -409,6 +409,7 @@ setup_tty_param(
 
     writeBuffer = [[NSMutableData alloc] init];
     writeLock = [[NSLock alloc] init];
+    delegateLock = [[NSLock alloc] init];
 
     return self;
 }
@@ -430,6 +431,7 @@ setup_tty_param(
     }
 
     [writeLock release];
+    [delegateLock release];
     [writeBuffer release];
     [tty release];
     [path release];
@@ -534,7 +536,14 @@ static void reapchild(int n)
 
 - (BOOL)wantsRead
 {
-    return YES;
+    BOOL result = YES;
+
+    [delegateLock lock];
+    if ([delegate respondsToSelector:@selector(taskWantsRead)]) {
+        result = [delegate taskWantsRead];
+    }
+    [delegateLock unlock];
+    return result;
 }
 
 - (BOOL)wantsWrite
@@ -550,17 +559,34 @@ static void reapchild(int n)
 
     int iterations = 10;
     int bytesRead = 0;
-
-    NSMutableData* data = [NSMutableData dataWithLength:MAXRW * iterations];
+    BOOL broken = NO;
+    NSMutableData* data = nil;
+    unsigned char* buffer = NULL;
+
+    // If the delegate offers it, read straight into its input stream. This
+    // avoids allocating an NSData and copying every byte out of it again.
+    // delegateLock is held until readTaskLength:fromBuffer: is done with the
+    // delegate, so it can't be freed while its buffer is being filled.
+    [delegateLock lock];
+    if ([delegate respondsToSelector:@selector(taskReadBufferWithSpace:)]) {
+        buffer = [delegate taskReadBufferWithSpace:MAXRW * iterations];
+    }
+    if (!buffer) {
+        // readTask: waits for the main thread, which may be waiting for the
+        // lock in setDelegate:.
+        [delegateLock unlock];
+        data = [NSMutableData dataWithLength:MAXRW * iterations];
+        buffer = [data mutableBytes];
+    }
     for (int i = 0; i < iterations; ++i) {
         // Only read up to MAXRW*iterations bytes, then release control
-        ssize_t n = read(fd, [data mutableBytes] + bytesRead, MAXRW);
+        ssize_t n = read(fd, buffer + bytesRead, MAXRW);
         if (n < 0) {
             // There was a read error.
             if (errno != EAGAIN && errno != EINTR) {
-                // It was a serious error.
-                [self brokenPipe];
-                return;
+                // It was a serious error. Pass on what was read before it.
+                broken = YES;
+                break;
             } else {
                 // We could read again in the case of EINTR but it would
                 // complicate the code with little advantage. Just bail out.
@@ -577,11 +603,21 @@ static void reapchild(int n)
         }
     }
 
-    [data setLength:bytesRead];
-    hasOutput = YES;
+    if (!broken) {
+        hasOutput = YES;
+    }
 
     // Send data to the terminal
-    [self readTask:data];
+    if (data) {
+        [data setLength:bytesRead];
+        [self readTask:data];
+    } else {
+        [self readTaskLength:bytesRead fromBuffer:buffer];
+        [delegateLock unlock];
+    }
+    if (broken) {
+        [self brokenPipe];
+    }
 }
 
 - (void)processWrite
@@ -627,7 +663,9 @@ static void reapchild(int n)
 
 - (void)setDelegate:(id)object
 {
+    [delegateLock lock];
     delegate = object;
+    [delegateLock unlock];
 }
 
 - (id)delegate
@@ -652,6 +690,25 @@ static void reapchild(int n)
     }
 }
 
+// Like readTask: but for bytes that processRead put directly into the buffer
+// returned by the delegate's taskReadBufferWithSpace:. This stays on the
+// TaskNotifier thread; the delegate hands the results to the main thread.
+- (void)readTaskLength:(int)length fromBuffer:(unsigned char*)buffer
+{
+    if (length > 0 && [self logging]) {
+        [logHandle writeData:[NSData dataWithBytesNoCopy:buffer
+                                                  length:length
+                                            freeWhenDone:NO]];
+    }
+
+    [delegate taskDidReadLength:length];
+}
+
+- (void)resumeReading
+{
+    [[TaskNotifier sharedInstance] unblock];
+}
+
 - (void)writeTask:(NSData*)data
 {
 #if DEBUG_METHOD_TRACE
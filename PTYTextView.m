@@ -1444,6 +1444,7 @@ static BOOL RectsEqual(NSRect* a, NSRect* b) {
 
 - (void)drawRect:(NSRect)rect
 {
+    double start = PTYSessionStatisticsClock();
     [self drawRect:rect to:nil];
 
     if (flashing_ > 0) {
@@ -1470,6 +1471,10 @@ static BOOL RectsEqual(NSRect* a, NSRect* b) {
                  operation:NSCompositeSourceOver
                   fraction:flashing_];
     }
+
+    if ([_delegate respondsToSelector:@selector(textViewDidDrawInSeconds:)]) {
+        [_delegate textViewDidDrawInSeconds:PTYSessionStatisticsClock() - start];
+    }
 }
 
 - (void)drawRect:(NSRect)rect to:(NSPoint*)toOrigin
@@ -6465,50 +6470,36 @@ static bool IsUrlChar(NSString* str)
     BOOL irEnabled = [[PreferencePanel sharedInstance] instantReplay];
     long long totalScrollbackOverflow = [dataSource totalScrollbackOverflow];
     for (int y = lineStart; y < lineEnd; y++) {
-        NSMutableData* matches = [resultMap_ objectForKey:[NSNumber numberWithLongLong:y + totalScrollbackOverflow]];
-        for (int x = 0; x < WIDTH; x++) {
-            int dirtyFlags = [dataSource dirtyAtX:x Y:y-lineStart];
-            if (dirtyFlags) {
-                if (irEnabled) {
-                    if (dirtyFlags & 1) {
-                        foundDirty = YES;
-                        if (matches) {
-                            // Remove highlighted search matches on this line.
-                            [resultMap_ removeObjectForKey:[NSNumber numberWithLongLong:y + totalScrollbackOverflow]];
-                            matches = nil;
-                        }
-                    } else {
-                        for (int j = x+1; j < WIDTH; ++j) {
-                            if ([dataSource dirtyAtX:j Y:y-lineStart] & 1) {
-                                foundDirty = YES;
-                            }
-                        }
-                    }
-                }
-                NSRect dirtyRect = [self visibleRect];
-                dirtyRect.origin.y = y*lineHeight;
-                dirtyRect.size.height = lineHeight;
-                if (gDebugLogging) {
-                    DebugLog([NSString stringWithFormat:@"%d is dirty", y]);
-                }
-                [self setNeedsDisplayInRect:dirtyRect];
+        // Clean lines are skipped without looking at their cells.
+        const screen_line_dirty_t *dirtyLine = [dataSource dirtyLineAtScreenIndex:y-lineStart];
+        if (dirtyLine->flags) {
+            if (irEnabled && (dirtyLine->flags & 1)) {
+                foundDirty = YES;
+                // Remove highlighted search matches on this line.
+                [resultMap_ removeObjectForKey:[NSNumber numberWithLongLong:y + totalScrollbackOverflow]];
+            }
+            NSRect dirtyRect = [self visibleRect];
+            dirtyRect.origin.y = y*lineHeight;
+            dirtyRect.size.height = lineHeight;
+            if (gDebugLogging) {
+                DebugLog([NSString stringWithFormat:@"%d is dirty", y]);
+            }
+            [self setNeedsDisplayInRect:dirtyRect];
 
 #ifdef DEBUG_DRAWING
-                char temp[100];
-                screen_char_t* p = [dataSource getLineAtScreenIndex:screenindex];
-                for (int i = 0; i < WIDTH; ++i) {
-                    temp[i] = p[i].complexChar ? '#' : p[i].code;
-                }
-                temp[WIDTH] = 0;
-                [dirtyDebug appendFormat:@"set rect %d,%d %dx%d (line %d=%s) dirty\n",
-                 (int)dirtyRect.origin.x,
-                 (int)dirtyRect.origin.y,
-                 (int)dirtyRect.size.width,
-                 (int)dirtyRect.size.height,
-                 y, temp];
-#endif
-                break;
+            char temp[100];
+            screen_char_t* p = [dataSource getLineAtScreenIndex:screenindex];
+            for (int i = 0; i < WIDTH; ++i) {
+                temp[i] = p[i].complexChar ? '#' : p[i].code;
             }
+            temp[WIDTH] = 0;
+            [dirtyDebug appendFormat:@"set rect %d,%d %dx%d (line %d=%s) dirty\n",
+             (int)dirtyRect.origin.x,
+             (int)dirtyRect.origin.y,
+             (int)dirtyRect.size.width,
+             (int)dirtyRect.size.height,
+             y, temp];
+#endif
         }
 #ifdef DEBUG_DRAWING
         ++screenindex;
@@ -6708,7 +6699,12 @@ static bool IsUrlChar(NSString* str)
     int cursorX = [dataSource cursorX] - 1;
     int cursorY = [dataSource cursorY] + [dataSource numberOfLines] - [dataSource height] - 1;
     for (int y = lineStart; y < lineEnd && startX > -1; y++) {
-        for (int x = 0; x < width; x++) {
+        const screen_line_dirty_t *dirtyLine = [dataSource dirtyLineAtScreenIndex:y-lineStart];
+        if (!dirtyLine->flags) {
+            continue;
+        }
+        // The span can cover clean cells between dirty ones.
+        for (int x = dirtyLine->start; x < dirtyLine->end && x < width; x++) {
             BOOL isSelected = [self _isCharSelectedInRow:y col:x checkOld:NO];
             BOOL isCursor = (x == cursorX && y == cursorY);
             if ([dataSource isDirtyAtX:x Y:y-lineStart] && isSelected && !isCursor) {
@@ -0,0 +1,54 @@
+// -*- mode:objc -*-
+/*
+ **  ReplayBenchmark.h
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Replays captured pty output (such as the .txt files in
+ **    tests/) through VT100Terminal, VT100Screen, and LineBuffer without any
+ **    windows, and reports throughput, allocations, and how much resident
+ **    memory each file's screen and scrollback added, as JSON. Run it with:
+ **      iTerm.app/Contents/MacOS/iTerm -ReplayBenchmark <file or directory>
+ **    or "make replay-bench", which also replays the output of the spam
+ **    generators in tests/. Input is fed in fixed-size chunks to a fixed
+ **    size screen so that runs are comparable across builds.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#import <Cocoa/Cocoa.h>
+
+@interface ReplayBenchmark : NSObject {
+    int width_;
+    int height_;
+    int chunkSize_;
+    int minimumBytes_;
+}
+
+// Default geometry is 80x25 with 1000 lines of scrollback, fed 1024 bytes (one
+// read() from the pty) at a time. Each file is replayed until at least 4MB
+// has gone through.
+- (id)init;
+
+// Replays the file at |path|, or every .txt file in it if it's a directory,
+// and writes one JSON object with an entry per file to stdout. Returns NO if
+// nothing could be read.
+- (BOOL)runWithPath:(NSString *)path;
+
+@end
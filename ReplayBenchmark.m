@@ -0,0 +1,292 @@
+// -*- mode:objc -*-
+/*
+ **  ReplayBenchmark.m
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Replays captured pty output headlessly and reports how fast
+ **    it was processed. See ReplayBenchmark.h.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#import "ReplayBenchmark.h"
+#import <iTerm/VT100Screen.h>
+#import <iTerm/VT100Terminal.h>
+#include <libkern/OSAtomic.h>
+#include <malloc/malloc.h>
+#include <mach/mach.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+// Same as PTYSession's batch size.
+static const int kReplayTokensPerBatch = 64;
+static const int kReplayScrollback = 1000;
+
+// Allocations are counted by wrapping the default malloc zone's entry points.
+// This counts allocations made by every thread while a file is replayed, but
+// nothing else runs during the benchmark.
+static volatile int64_t gAllocations;
+static void *(*gZoneMalloc)(malloc_zone_t *zone, size_t size);
+static void *(*gZoneCalloc)(malloc_zone_t *zone, size_t count, size_t size);
+static void *(*gZoneRealloc)(malloc_zone_t *zone, void *ptr, size_t size);
+
+static void *CountingMalloc(malloc_zone_t *zone, size_t size)
+{
+    OSAtomicIncrement64(&gAllocations);
+    return gZoneMalloc(zone, size);
+}
+
+static void *CountingCalloc(malloc_zone_t *zone, size_t count, size_t size)
+{
+    OSAtomicIncrement64(&gAllocations);
+    return gZoneCalloc(zone, count, size);
+}
+
+static void *CountingRealloc(malloc_zone_t *zone, void *ptr, size_t size)
+{
+    OSAtomicIncrement64(&gAllocations);
+    return gZoneRealloc(zone, ptr, size);
+}
+
+static void InstallAllocationCounter(void)
+{
+    malloc_zone_t *zone = malloc_default_zone();
+    vm_address_t page = trunc_page((vm_address_t)zone);
+
+    if (gZoneMalloc) {
+        return;
+    }
+    // Newer systems keep the zone structure read-only.
+    if (zone->version >= 8) {
+        mprotect((void *)page, vm_page_size, PROT_READ | PROT_WRITE);
+    }
+    gZoneMalloc = zone->malloc;
+    gZoneCalloc = zone->calloc;
+    gZoneRealloc = zone->realloc;
+    zone->malloc = CountingMalloc;
+    zone->calloc = CountingCalloc;
+    zone->realloc = CountingRealloc;
+    if (zone->version >= 8) {
+        mprotect((void *)page, vm_page_size, PROT_READ);
+    }
+}
+
+static double Now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Current resident size of the process, in bytes. Unlike getrusage()'s
+// ru_maxrss, this goes down as well as up, so it can be sampled around the
+// replay of each file.
+static long long ResidentBytes(void)
+{
+    struct task_basic_info info;
+    mach_msg_type_number_t count = TASK_BASIC_INFO_COUNT;
+
+    if (task_info(mach_task_self(),
+                  TASK_BASIC_INFO,
+                  (task_info_t)&info,
+                  &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return (long long)info.resident_size;
+}
+
+static NSString *JSONString(NSString *s)
+{
+    NSMutableString *result = [NSMutableString stringWithString:@"\""];
+    int i;
+    for (i = 0; i < [s length]; i++) {
+        unichar c = [s characterAtIndex:i];
+        if (c == '"' || c == '\\') {
+            [result appendFormat:@"\\%C", c];
+        } else if (c < 0x20) {
+            [result appendFormat:@"\\u%04x", (int)c];
+        } else {
+            [result appendFormat:@"%C", c];
+        }
+    }
+    [result appendString:@"\""];
+    return result;
+}
+
+@implementation ReplayBenchmark
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        width_ = 80;
+        height_ = 25;
+        chunkSize_ = 1024;
+        minimumBytes_ = 4 * 1024 * 1024;
+    }
+    return self;
+}
+
+// Runs |data| through a new terminal and screen once. Returns the number of
+// tokens applied and sets *lines to the number of lines in the screen and
+// scrollback at the end. *resident is set to the process's resident size
+// after the last byte, while the screen and scrollback are still allocated.
+- (long long)replayData:(NSData *)data
+                  lines:(int *)lines
+               resident:(long long *)resident
+{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    VT100Terminal *terminal = [[VT100Terminal alloc] init];
+    VT100Screen *screen = [[VT100Screen alloc] init];
+    const unsigned char *bytes = [data bytes];
+    int length = [data length];
+    int offset = 0;
+    long long tokenCount = 0;
+    VT100TCC tokens[kReplayTokensPerBatch];
+
+    [screen setTerminal:terminal];
+    [terminal setScreen:screen];
+    [screen initScreenWithWidth:width_ Height:height_];
+    [screen setScrollback:kReplayScrollback];
+
+    while (offset < length) {
+        int n = MIN(chunkSize_, length - offset);
+        int count;
+        memcpy([terminal streamBufferWithSpace:n], bytes + offset, n);
+        [terminal appendStreamLength:n];
+        offset += n;
+        while ((count = [terminal getTokens:tokens max:kReplayTokensPerBatch]) > 0) {
+            [screen putTokens:tokens count:count];
+            tokenCount += count;
+        }
+    }
+    *lines = [screen numberOfLines];
+    *resident = ResidentBytes();
+
+    [screen setTerminal:nil];
+    [terminal setScreen:nil];
+    [screen release];
+    [terminal release];
+    [pool release];
+    return tokenCount;
+}
+
+// Returns a JSON object describing the replay of one file.
+- (NSString *)benchmarkFile:(NSString *)path
+{
+    NSData *data = [NSData dataWithContentsOfFile:path];
+    int rounds;
+    int i;
+    int lines = 0;
+    long long tokens = 0;
+    int64_t allocationsBefore;
+    int64_t allocations;
+    long long residentBefore;
+    long long resident;
+    long long peakResident = 0;
+    double start;
+    double elapsed;
+    double bytes;
+
+    if (!data) {
+        return nil;
+    }
+    rounds = MAX(1, minimumBytes_ / MAX(1, (int)[data length]));
+
+    // Warm up caches and lazily initialized tables before timing. Memory is
+    // measured against the resident size after this, so a file is only
+    // charged for what its own screen and scrollback hold on to.
+    [self replayData:data lines:&lines resident:&resident];
+    residentBefore = ResidentBytes();
+
+    allocationsBefore = gAllocations;
+    start = Now();
+    for (i = 0; i < rounds; i++) {
+        tokens += [self replayData:data lines:&lines resident:&resident];
+        peakResident = MAX(peakResident, resident);
+    }
+    elapsed = MAX(Now() - start, 1e-9);
+    allocations = gAllocations - allocationsBefore;
+    bytes = (double)[data length] * rounds;
+
+    return [NSString stringWithFormat:
+            @"{\"file\": %@, \"bytes\": %d, \"rounds\": %d, \"seconds\": %.6f, "
+            @"\"bytes_per_second\": %.0f, \"tokens_per_second\": %.0f, "
+            @"\"tokens\": %lld, \"lines\": %d, \"allocations\": %lld, "
+            @"\"allocations_per_round\": %.1f, \"resident_growth\": %lld}",
+            JSONString([path lastPathComponent]),
+            (int)[data length],
+            rounds,
+            elapsed,
+            bytes / elapsed,
+            tokens / elapsed,
+            tokens / rounds,
+            lines,
+            (long long)allocations,
+            (double)allocations / rounds,
+            MAX(0, peakResident - residentBefore)];
+}
+
+- (BOOL)runWithPath:(NSString *)path
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMutableArray *files = [NSMutableArray array];
+    NSMutableArray *results = [NSMutableArray array];
+    BOOL isDirectory = NO;
+    int i;
+
+    if (![fileManager fileExistsAtPath:path isDirectory:&isDirectory]) {
+        fprintf(stderr, "ReplayBenchmark: %s not found\n", [path UTF8String]);
+        return NO;
+    }
+    if (isDirectory) {
+        NSArray *contents = [[fileManager directoryContentsAtPath:path]
+                                sortedArrayUsingSelector:@selector(compare:)];
+        for (i = 0; i < [contents count]; i++) {
+            NSString *name = [contents objectAtIndex:i];
+            if ([[name pathExtension] isEqualToString:@"txt"]) {
+                [files addObject:[path stringByAppendingPathComponent:name]];
+            }
+        }
+    } else {
+        [files addObject:path];
+    }
+
+    InstallAllocationCounter();
+    for (i = 0; i < [files count]; i++) {
+        NSString *result = [self benchmarkFile:[files objectAtIndex:i]];
+        if (result) {
+            [results addObject:result];
+        } else {
+            fprintf(stderr, "ReplayBenchmark: can't read %s\n",
+                    [[files objectAtIndex:i] UTF8String]);
+        }
+    }
+
+    printf("{\"width\": %d, \"height\": %d, \"chunk_size\": %d, \"results\": [\n  %s\n]}\n",
+           width_,
+           height_,
+           chunkSize_,
+           [[results componentsJoinedByString:@",\n  "] UTF8String]);
+    fflush(stdout);
+    return [results count] > 0;
+}
+
+@end
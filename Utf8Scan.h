@@ -0,0 +1,226 @@
+// -*- mode:objc -*-
+/*
+ **  Utf8Scan.h
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Validates and decodes runs of non-ASCII UTF-8 in the input
+ **    stream. A run is validated once by VT100Terminal and later decoded
+ **    straight to UTF-16 by VT100Screen without building an NSString. Blocks
+ **    of CJK ideographs, the bulk of most non-Latin output, are validated 15
+ **    bytes at a time with SSE2 or NEON where available. This header is plain
+ **    C so it can be shared with the benchmarks in tests/.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef UTF8_SCAN_H
+#define UTF8_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// True for code points that Unicode normalization leaves alone and that
+// never combine with their neighbors, so a run made only of them can skip
+// -[NSString precomposedStringWithCanonicalMapping]. This is deliberately
+// conservative: anything it doesn't know about takes the slow path.
+static inline int Utf8IsSimpleCodePoint(uint32_t c)
+{
+    if (c < 0x2010) {
+        // Latin-1 and Latin Extended; combining marks start at U+0300.
+        return c >= 0xa0 && c < 0x300;
+    }
+    if (c < 0x3000) {
+        // Punctuation, symbols, arrows, box drawing. Skip the combining marks
+        // for symbols and the few characters that NFC doesn't leave alone:
+        // singleton decompositions and U+2ADC, a composition exclusion.
+        return c < 0x2c00 &&
+               !(c >= 0x20d0 && c <= 0x20ff) &&
+               c != 0x2126 && c != 0x212a && c != 0x212b &&
+               c != 0x2329 && c != 0x232a && c != 0x2adc;
+    }
+    if (c < 0xa000) {
+        // CJK punctuation, kana, and ideographs, except the ideographic tone
+        // marks and the combining (semi-)voiced sound marks.
+        return !(c >= 0x302a && c <= 0x302f) && c != 0x3099 && c != 0x309a;
+    }
+    return (c >= 0xac00 && c <= 0xd7a3) ||    // Hangul syllables
+           (c >= 0xff00 && c <= 0xffef) ||    // Halfwidth and fullwidth forms
+           (c >= 0x1f000 && c <= 0x1faff);    // Emoji and pictographs
+}
+
+// Returns nonzero if the 15 bytes at datap are five 3-byte sequences for
+// U+4000 through U+9FFF: lead bytes 0xE4-0xE9 followed by two continuation
+// bytes each. Such sequences can be neither overlong nor surrogates, and are
+// all simple. Requires 16 readable bytes.
+static inline int Utf8IsIdeographBlock(const unsigned char *datap)
+{
+#if defined(__SSE2__)
+    __m128i bytes = _mm_loadu_si128((const __m128i *)datap);
+    // Signed compares: 0xE3 is -29 and 0xEA is -22.
+    __m128i lead = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0xe3)),
+                                 _mm_cmplt_epi8(bytes, _mm_set1_epi8(0xea)));
+    __m128i cont = _mm_cmpeq_epi8(_mm_and_si128(bytes, _mm_set1_epi8(0xc0)),
+                                  _mm_set1_epi8(0x80));
+    int leadMask = _mm_movemask_epi8(lead) & 0x7fff;
+    int contMask = _mm_movemask_epi8(cont) & 0x7fff;
+    return leadMask == 0x1249 && contMask == 0x6db6;
+#elif defined(__aarch64__)
+    static const uint8_t kBits[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    const uint8x16_t bits = vld1q_u8(kBits);
+    uint8x16_t bytes = vld1q_u8(datap);
+    uint8x16_t lead = vandq_u8(vcgeq_u8(bytes, vdupq_n_u8(0xe4)),
+                               vcleq_u8(bytes, vdupq_n_u8(0xe9)));
+    uint8x16_t cont = vceqq_u8(vandq_u8(bytes, vdupq_n_u8(0xc0)),
+                               vdupq_n_u8(0x80));
+    // Build 16-bit masks like SSE2's movemask.
+    uint8x16_t l = vandq_u8(lead, bits);
+    uint8x16_t c = vandq_u8(cont, bits);
+    int leadMask = (vaddv_u8(vget_low_u8(l)) |
+                    (vaddv_u8(vget_high_u8(l)) << 8)) & 0x7fff;
+    int contMask = (vaddv_u8(vget_low_u8(c)) |
+                    (vaddv_u8(vget_high_u8(c)) << 8)) & 0x7fff;
+    return leadMask == 0x1249 && contMask == 0x6db6;
+#else
+    return 0;
+#endif
+}
+
+// Returns the number of leading bytes of datap that form complete, valid,
+// non-ASCII code points: shortest form, not a surrogate, and no greater
+// than U+10FFFF. This accepts exactly what decode_utf8_char() followed by
+// VT100Terminal's surrogate and range checks accepts, so when it returns 0
+// the caller can fall back on that to tell an error from a short read.
+// *allSimple is set to 0 if any code point in the run is not simple (see
+// Utf8IsSimpleCodePoint) and to 1 otherwise.
+static inline size_t Utf8ValidRunLength(const unsigned char *datap,
+                                        size_t datalen,
+                                        int *allSimple)
+{
+    size_t i = 0;
+    size_t nextBlock = 0;
+    int simple = 1;
+
+    while (i < datalen) {
+        unsigned char c = datap[i];
+        uint32_t theChar;
+        size_t n;
+
+        // Test nextBlock first: in mixed text the lead byte is unpredictable,
+        // so don't branch on it for every code point.
+        if (i >= nextBlock && i + 16 <= datalen) {
+            if (c >= 0xe4 && c <= 0xe9 && Utf8IsIdeographBlock(datap + i)) {
+                i += 15;
+                continue;
+            }
+            // Not a run of ideographs. Back off before trying again.
+            nextBlock = i + 64;
+        }
+        if (c < 0xc2) {
+            // ASCII, a stray continuation byte, or an overlong 2-byte lead.
+            break;
+        } else if (c < 0xe0) {
+            if (i + 2 > datalen || (datap[i + 1] & 0xc0) != 0x80) {
+                break;
+            }
+            theChar = ((c & 0x1f) << 6) | (datap[i + 1] & 0x3f);
+            n = 2;
+        } else if (c < 0xf0) {
+            if (i + 3 > datalen ||
+                (datap[i + 1] & 0xc0) != 0x80 ||
+                (datap[i + 2] & 0xc0) != 0x80) {
+                break;
+            }
+            theChar = ((c & 0x0f) << 12) |
+                      ((datap[i + 1] & 0x3f) << 6) |
+                      (datap[i + 2] & 0x3f);
+            if (theChar < 0x800 || (theChar >= 0xd800 && theChar <= 0xdfff)) {
+                break;
+            }
+            n = 3;
+        } else if (c < 0xf5) {
+            if (i + 4 > datalen ||
+                (datap[i + 1] & 0xc0) != 0x80 ||
+                (datap[i + 2] & 0xc0) != 0x80 ||
+                (datap[i + 3] & 0xc0) != 0x80) {
+                break;
+            }
+            theChar = ((c & 0x07) << 18) |
+                      ((datap[i + 1] & 0x3f) << 12) |
+                      ((datap[i + 2] & 0x3f) << 6) |
+                      (datap[i + 3] & 0x3f);
+            if (theChar < 0x10000 || theChar > 0x10ffff) {
+                break;
+            }
+            n = 4;
+        } else {
+            break;
+        }
+        if (simple && !Utf8IsSimpleCodePoint(theChar)) {
+            simple = 0;
+        }
+        i += n;
+    }
+    *allSimple = simple;
+    return i;
+}
+
+// Decodes a run that Utf8ValidRunLength accepted into UTF-16 code units,
+// which must have room for datalen elements. Returns the number written.
+static inline size_t Utf8DecodeValidRun(const unsigned char *datap,
+                                        size_t datalen,
+                                        uint16_t *out)
+{
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < datalen) {
+        unsigned char c = datap[i];
+        uint32_t theChar;
+        if (c < 0xe0) {
+            out[o++] = ((c & 0x1f) << 6) | (datap[i + 1] & 0x3f);
+            i += 2;
+        } else if (c < 0xf0) {
+            out[o++] = ((c & 0x0f) << 12) |
+                       ((datap[i + 1] & 0x3f) << 6) |
+                       (datap[i + 2] & 0x3f);
+            i += 3;
+        } else {
+            theChar = ((c & 0x07) << 18) |
+                      ((datap[i + 1] & 0x3f) << 12) |
+                      ((datap[i + 2] & 0x3f) << 6) |
+                      (datap[i + 3] & 0x3f);
+            theChar -= 0x10000;
+            out[o++] = 0xd800 + (theChar >> 10);
+            out[o++] = 0xdc00 + (theChar & 0x3ff);
+            i += 4;
+        }
+    }
+    return o;
+}
+
+#endif  // UTF8_SCAN_H
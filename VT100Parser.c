@@ -0,0 +1,283 @@
+/*
+ **  VT100Parser.c
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Resumable parser for CSI and OSC escape sequences. See
+ **    VT100Parser.h.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "VT100Parser.h"
+#include <assert.h>
+
+// Classes of bytes that can appear in the body of a CSI sequence. The parser
+// looks each byte up in gCSIByteClass rather than testing ranges one by one.
+typedef enum {
+    CSI_CLASS_OTHER = 0,      // Unrecognized; ends the sequence unconsumed
+    CSI_CLASS_DIGIT,          // 0-9
+    CSI_CLASS_SEPARATOR,      // ;
+    CSI_CLASS_FINAL,          // A letter or @
+    CSI_CLASS_INTERMEDIATE,   // ' or &, which start locator sequences
+    CSI_CLASS_CONTROL         // C0 control in the middle of a sequence
+} CSIByteClass;
+
+static unsigned char gCSIByteClass[256];
+static int gCSIByteClassReady;
+
+static void initByteClasses(void)
+{
+    int i;
+
+    for (i = '0'; i <= '9'; i++) {
+        gCSIByteClass[i] = CSI_CLASS_DIGIT;
+    }
+    for (i = 'A'; i <= 'Z'; i++) {
+        gCSIByteClass[i] = CSI_CLASS_FINAL;
+        gCSIByteClass[i + 'a' - 'A'] = CSI_CLASS_FINAL;
+    }
+    gCSIByteClass['@'] = CSI_CLASS_FINAL;
+    gCSIByteClass[';'] = CSI_CLASS_SEPARATOR;
+    gCSIByteClass['\''] = CSI_CLASS_INTERMEDIATE;
+    gCSIByteClass['&'] = CSI_CLASS_INTERMEDIATE;
+    const unsigned char controls[] = {
+        VT100CC_ENQ, VT100CC_BEL, VT100CC_BS, VT100CC_HT, VT100CC_LF,
+        VT100CC_VT, VT100CC_FF, VT100CC_CR, VT100CC_SO, VT100CC_SI,
+        VT100CC_DC1, VT100CC_DC3, VT100CC_CAN, VT100CC_SUB, VT100CC_DEL
+    };
+    for (i = 0; i < (int)sizeof(controls); i++) {
+        gCSIByteClass[controls[i]] = CSI_CLASS_CONTROL;
+    }
+    // Filling in the table twice is harmless, so no lock is needed.
+    gCSIByteClassReady = 1;
+}
+
+void VT100ParserReset(VT100Parser *parser)
+{
+    parser->state = VT100_PARSE_GROUND;
+    parser->consumed = 0;
+    parser->numControls = 0;
+    parser->nextControl = 0;
+    parser->complete = 0;
+}
+
+void VT100ParserBeginCSI(VT100Parser *parser)
+{
+    int i;
+
+    if (!gCSIByteClassReady) {
+        initByteClasses();
+    }
+    VT100ParserReset(parser);
+    parser->state = VT100_PARSE_CSI_ENTRY;
+    parser->consumed = 2;
+    parser->number = -1;
+    parser->readNumericParameter = 0;
+    parser->tooManyParameters = 0;
+    parser->csi.count = 0;
+    parser->csi.cmd = 0;
+    parser->csi.question = 0;
+    parser->csi.modifier = 0;
+    for (i = 0; i < VT100CSIPARAM_MAX; ++i) {
+        parser->csi.p[i] = -1;
+    }
+}
+
+void VT100ParserBeginOSC(VT100Parser *parser)
+{
+    VT100ParserReset(parser);
+    parser->state = VT100_PARSE_OSC_MODE;
+    parser->consumed = 2;
+    parser->oscMode = 0;
+}
+
+// Stores the numeric parameter that was being read, if any.
+static void endCSINumber(VT100Parser *parser)
+{
+    if (parser->number < 0) {
+        return;
+    }
+    if (parser->csi.count < VT100CSIPARAM_MAX) {
+        parser->csi.p[parser->csi.count] = parser->number;
+    }
+    // increment the parameter count
+    parser->csi.count++;
+    // set the numeric parameter flag
+    parser->readNumericParameter = 1;
+    parser->number = -1;
+}
+
+int VT100ParserAdvanceCSI(VT100Parser *parser,
+                          const unsigned char *datap,
+                          size_t datalen)
+{
+    CSIParam *param = &parser->csi;
+
+    assert(datap != NULL);
+    assert(datap[0] == VT100CC_ESC);
+    assert(datap[1] == '[');
+
+    if (parser->nextControl == parser->numControls) {
+        // The caller has returned every control found so far.
+        parser->numControls = 0;
+        parser->nextControl = 0;
+    }
+    while (parser->consumed < datalen) {
+        unsigned char c = datap[parser->consumed];
+
+        if (parser->state == VT100_PARSE_CSI_ENTRY) {
+            parser->state = VT100_PARSE_CSI_PARAM;
+            if (c == '?') {
+                param->question = 1;
+                parser->consumed++;
+            } else if (c == '>') {
+                // check for secondary device attribute modifier
+                param->modifier = '>';
+                parser->consumed++;
+            }
+            continue;
+        }
+        if (parser->state == VT100_PARSE_CSI_INTERMEDIATE) {
+            // Locator sequences such as ESC [ ' z are not supported.
+            parser->consumed++;
+            param->cmd = 0xff;
+            return 1;
+        }
+
+        if (gCSIByteClass[c] == CSI_CLASS_DIGIT) {
+            if (parser->number < 0) {
+                parser->number = 0;
+            }
+            parser->number = parser->number * 10 + c - '0';
+            parser->consumed++;
+            continue;
+        }
+        endCSINumber(parser);
+
+        switch (gCSIByteClass[c]) {
+            case CSI_CLASS_SEPARATOR:
+                parser->consumed++;
+                // If we got an implied (blank) parameter, increment the parameter count again
+                if (parser->readNumericParameter == 0) {
+                    param->count++;
+                }
+                // reset the parameter flag
+                parser->readNumericParameter = 0;
+                if (param->count >= VT100CSIPARAM_MAX) {
+                    // broken, but keep going to find the end of the sequence
+                    parser->tooManyParameters = 1;
+                }
+                break;
+
+            case CSI_CLASS_FINAL:
+                parser->consumed++;
+                param->cmd = parser->tooManyParameters ? 0xff : c;
+                return 1;
+
+            case CSI_CLASS_INTERMEDIATE:
+                parser->consumed++;
+                parser->state = VT100_PARSE_CSI_INTERMEDIATE;
+                break;
+
+            case CSI_CLASS_CONTROL:
+                // Controls that act on the screen are saved and returned as
+                // tokens before the CSI token itself. The rest are ignored.
+                switch (c) {
+                    case VT100CC_BEL:
+                    case VT100CC_BS:
+                    case VT100CC_HT:
+                    case VT100CC_LF:
+                    case VT100CC_VT:
+                    case VT100CC_FF:
+                    case VT100CC_CR:
+                    case VT100CC_DEL:
+                        if (parser->numControls == VT100CSI_CONTROLS_MAX) {
+                            // Stop here until the caller has returned the
+                            // controls saved so far.
+                            return 0;
+                        }
+                        parser->controls[parser->numControls++] = c;
+                        break;
+                }
+                parser->consumed++;
+                break;
+
+            default:
+                param->cmd = 0xff;
+                return 1;
+        }
+    }
+    return 0;
+}
+
+int VT100ParserAdvanceOSC(VT100Parser *parser,
+                          const unsigned char *datap,
+                          size_t datalen)
+{
+    assert(datap != NULL);
+    assert(datap[0] == VT100CC_ESC);
+    assert(datap[1] == ']');
+
+    while (parser->consumed < datalen) {
+        unsigned char c = datap[parser->consumed];
+
+        if (parser->state == VT100_PARSE_OSC_MODE) {
+            if ((c >= '0' && c <= '9')) {
+                // read an integer and store it in the mode.
+                parser->oscMode = parser->oscMode * 10 + c - '0';
+                parser->consumed++;
+            } else if (c == ';' || c == 'P') {
+                if (c == 'P') {
+                    parser->oscMode = -1;
+                }
+                parser->consumed++;
+                parser->oscStringStart = parser->consumed;
+                parser->state = VT100_PARSE_OSC_STRING;
+            } else {
+                parser->oscMode = -2;
+                parser->consumed = 2;
+                return 1;
+            }
+        } else if (c == 7) {
+            parser->oscStringEnd = parser->consumed;
+            parser->consumed++;
+            return 1;
+        } else if (c == VT100CC_ESC) {
+            // Technically, only ^G or esc + \ ought to terminate a string. But sometimes an application is buggy and it forgets to terminate it.
+            // xterm has a very complicated state machine that determines when a string is terminated. Effectively, it allows you to terminate
+            // an OSC with ESC + anything except ], 0x9d, and 0xdd. Other bogus values may do strange things in xterm.
+            if (parser->consumed + 1 >= datalen) {
+                // Need the next byte to decide.
+                return 0;
+            }
+            unsigned char next = datap[parser->consumed + 1];
+            if (next != ']' && next != 0x9d && next != 0xdd) {
+                // Esc+backslash (called ST in the spec), or equivalent
+                parser->oscStringEnd = parser->consumed;
+                parser->consumed += 2;
+                return 1;
+            }
+            parser->consumed++;
+        } else {
+            parser->consumed++;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+// -*- mode:objc -*-
+/*
+ **  VT100Parser.h
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Resumable parser for CSI and OSC escape sequences. This is
+ **    plain C with no Foundation or AppKit dependencies so that it can be
+ **    built into the headless core library (see "make core") and run on
+ **    machines other than Macs. VT100Terminal turns its results into tokens.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VT100_PARSER_H
+#define VT100_PARSER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// C0 control codes. These double as VT100TCC token types.
+#define VT100CC_NULL        0
+#define VT100CC_ENQ         5    // Transmit ANSWERBACK message
+#define VT100CC_BEL         7    // Sound bell
+#define VT100CC_BS          8    // Move cursor to the left
+#define VT100CC_HT          9    // Move cursor to the next tab stop
+#define VT100CC_LF         10    // line feed or new line operation
+#define VT100CC_VT         11    // Same as <LF>.
+#define VT100CC_FF         12    // Same as <LF>.
+#define VT100CC_CR         13    // Move the cursor to the left margin
+#define VT100CC_SO         14    // Invoke the G1 character set
+#define VT100CC_SI         15    // Invoke the G0 character set
+#define VT100CC_DC1        17    // Causes terminal to resume transmission (XON).
+#define VT100CC_DC3        19    // Causes terminal to stop transmitting all codes except XOFF and XON (XOFF).
+#define VT100CC_CAN        24    // Cancel a control sequence
+#define VT100CC_SUB        26    // Same as <CAN>.
+#define VT100CC_ESC        27    // Introduces a control sequence.
+#define VT100CC_DEL       255    // Ignored on input; not stored in buffer.
+
+#define VT100CSIPARAM_MAX    16
+// C0 controls inside a CSI sequence that are saved before the caller must
+// return them as tokens.
+#define VT100CSI_CONTROLS_MAX    16
+
+typedef struct {
+    int p[VT100CSIPARAM_MAX];
+    int count;
+    int cmd;
+    int question;
+    int modifier;
+} CSIParam;
+
+// States of the resumable CSI/OSC parser. Anything other than
+// VT100_PARSE_GROUND means a sequence that began at the current stream offset
+// is partially parsed.
+typedef enum {
+    VT100_PARSE_GROUND = 0,
+    VT100_PARSE_CSI_ENTRY,          // Read ESC [
+    VT100_PARSE_CSI_PARAM,          // Reading parameters
+    VT100_PARSE_CSI_INTERMEDIATE,   // Read ' or &; next byte ends it
+    VT100_PARSE_OSC_MODE,           // Read ESC ], reading numeric mode
+    VT100_PARSE_OSC_STRING          // Reading string up to BEL or ST
+} VT100ParseState;
+
+// Progress through a partially received escape sequence, so that bytes
+// already examined are not rescanned when more input arrives.
+typedef struct {
+    VT100ParseState state;
+    size_t consumed;              // Bytes of the sequence examined so far
+    CSIParam csi;
+    int number;                   // Numeric parameter being read, or -1
+    int readNumericParameter;
+    int tooManyParameters;
+    int oscMode;                  // -1 for OSC P, -2 if unsupported
+    size_t oscStringStart;        // Offset of the OSC string within the sequence
+    size_t oscStringEnd;
+    // C0 controls found inside a CSI sequence. They are returned as tokens of
+    // their own ahead of the CSI token so they are applied in stream order.
+    // controls[nextControl] through controls[numControls - 1] have not been
+    // returned yet.
+    unsigned char controls[VT100CSI_CONTROLS_MAX];
+    int numControls;
+    int nextControl;
+    int complete;                 // Sequence ended; returning its controls
+} VT100Parser;
+
+// Return to the ground state, discarding any partial sequence.
+void VT100ParserReset(VT100Parser *parser);
+
+// Start parsing a sequence whose first two bytes are ESC [ or ESC ].
+void VT100ParserBeginCSI(VT100Parser *parser);
+void VT100ParserBeginOSC(VT100Parser *parser);
+
+// Feed the bytes of a CSI sequence that have not yet been examined to the
+// parser. datap points at the ESC that began the sequence, and datalen is
+// the number of bytes available from there. Returns nonzero once the
+// sequence is complete, in which case parser->csi.cmd is its final byte (or
+// 0xff if it was not understood) and parser->consumed is its length.
+// Returns 0 if more input is needed. It also returns 0 once
+// VT100CSI_CONTROLS_MAX controls are saved; the caller then returns the
+// controls through numControls as tokens and calls again.
+int VT100ParserAdvanceCSI(VT100Parser *parser,
+                          const unsigned char *datap,
+                          size_t datalen);
+
+// Like VT100ParserAdvanceCSI, for an OSC sequence (ESC ] ...). On
+// completion the string is [oscStringStart, oscStringEnd) of the sequence,
+// or oscMode is -2 if the sequence isn't supported.
+int VT100ParserAdvanceOSC(VT100Parser *parser,
+                          const unsigned char *datap,
+                          size_t datalen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // VT100_PARSER_H
@@ -46,14 +46,16 @@
 #import "iTermApplicationDelegate.h"
 #import <iTerm/iTermGrowlDelegate.h>
 #import <iTerm/ITAddressBookMgr.h>
+#include <libkern/OSAtomic.h>
 #include <string.h>
 #include <unistd.h>
 #include <LineBuffer.h>
+#import "Utf8Scan.h"
+#import "DoubleByteTable.h"
 #import "DVRBuffer.h"
 #import "PTYTab.h"
 
 #define MAX_SCROLLBACK_LINES 1000000
-#define DIRTY_MAGIC 0x76  // Used to ensure we don't go off end of dirty array
 
 // we add a character at the end of line to indicate wrapping
 #define REAL_WIDTH (WIDTH+1)
@@ -61,6 +63,92 @@
 @implementation SearchResult
 @end
 
+struct screen_snapshot_line {
+    volatile int32_t refCount;
+    screen_char_t chars[];
+};
+
+static void RetainSnapshotLine(screen_snapshot_line_t *line)
+{
+    OSAtomicIncrement32Barrier(&line->refCount);
+}
+
+// Releases *line if it isn't NULL and sets it to NULL.
+static void ReleaseSnapshotLine(screen_snapshot_line_t **line)
+{
+    if (*line) {
+        if (OSAtomicDecrement32Barrier(&(*line)->refCount) == 0) {
+            free(*line);
+        }
+        *line = NULL;
+    }
+}
+
+@interface VT100ScreenSnapshot (Private)
+- (id)initWithWidth:(int)width
+             height:(int)height
+            cursorX:(int)cursorX
+            cursorY:(int)cursorY
+              lines:(screen_snapshot_line_t **)lines;
+@end
+
+@implementation VT100ScreenSnapshot
+
+// Takes ownership of lines, a malloced array of height retained lines.
+- (id)initWithWidth:(int)width
+             height:(int)height
+            cursorX:(int)cursorX
+            cursorY:(int)cursorY
+              lines:(screen_snapshot_line_t **)lines
+{
+    self = [super init];
+    if (self) {
+        width_ = width;
+        height_ = height;
+        cursorX_ = cursorX;
+        cursorY_ = cursorY;
+        lines_ = lines;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (int i = 0; i < height_; i++) {
+        ReleaseSnapshotLine(&lines_[i]);
+    }
+    free(lines_);
+    [super dealloc];
+}
+
+- (int)width
+{
+    return width_;
+}
+
+- (int)height
+{
+    return height_;
+}
+
+- (int)cursorX
+{
+    return cursorX_;
+}
+
+- (int)cursorY
+{
+    return cursorY_;
+}
+
+- (const screen_char_t *)lineAtIndex:(int)y
+{
+    assert(y >= 0 && y < height_);
+    return lines_[y]->chars;
+}
+
+@end
+
 /* translates normal char into graphics char */
 static void translate(screen_char_t *s, int len)
 {
@@ -72,31 +160,20 @@ static void translate(screen_char_t *s, int len)
     }
 }
 
-// Convert a string into an array of screen characters, dealing with surrogate
-// pairs, combining marks, nonspacing marks, and double-width characters.
-void StringToScreenChars(NSString *s,
-                         screen_char_t *buf,
-                         screen_char_t fg,
-                         screen_char_t bg,
-                         int *len,
-                         NSStringEncoding encoding,
-                         BOOL ambiguousIsDoubleWidth,
-                         int* cursorIndex) {
-    unichar *sc;
-    int l = [s length];
+// Convert UTF-16 code units into an array of screen characters. See
+// StringToScreenChars.
+static void UnicharsToScreenChars(const unichar *sc,
+                                  int l,
+                                  screen_char_t *buf,
+                                  screen_char_t fg,
+                                  screen_char_t bg,
+                                  int *len,
+                                  NSStringEncoding encoding,
+                                  BOOL ambiguousIsDoubleWidth,
+                                  int* cursorIndex) {
     int i;
     int j;
 
-    const int kBufferElements = 1024;
-    unichar staticBuffer[kBufferElements];
-    unichar* dynamicBuffer = 0;
-    if ([s length] > kBufferElements) {
-        sc = dynamicBuffer = (unichar *) calloc(l, sizeof(unichar));
-    } else {
-        sc = staticBuffer;
-    }
-
-    [s getCharacters:sc];
     int lastInitializedChar = -1;
     BOOL foundCursor = NO;
     for (i = j = 0; i < l; i++, j++) {
@@ -193,40 +270,124 @@ void StringToScreenChars(NSString *s,
         // of the last character.
         *cursorIndex = j;
     }
+}
+
+// Convert a string into an array of screen characters, dealing with surrogate
+// pairs, combining marks, nonspacing marks, and double-width characters.
+void StringToScreenChars(NSString *s,
+                         screen_char_t *buf,
+                         screen_char_t fg,
+                         screen_char_t bg,
+                         int *len,
+                         NSStringEncoding encoding,
+                         BOOL ambiguousIsDoubleWidth,
+                         int* cursorIndex) {
+    unichar *sc;
+    int l = [s length];
+
+    const int kBufferElements = 1024;
+    unichar staticBuffer[kBufferElements];
+    unichar* dynamicBuffer = 0;
+    if ([s length] > kBufferElements) {
+        sc = dynamicBuffer = (unichar *) calloc(l, sizeof(unichar));
+    } else {
+        sc = staticBuffer;
+    }
+
+    [s getCharacters:sc];
+    UnicharsToScreenChars(sc,
+                          l,
+                          buf,
+                          fg,
+                          bg,
+                          len,
+                          encoding,
+                          ambiguousIsDoubleWidth,
+                          cursorIndex);
     if (dynamicBuffer) {
         free(dynamicBuffer);
     }
 }
 
-// increments line pointer accounting for buffer wrap-around
-static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start, screen_char_t *current_line,
-                                  int max_lines, int line_width, BOOL *wrap)
+// With unlimited scrollback, compressed scrollback beyond this many bytes is
+// spilled to disk. The "ScrollbackMemoryBudget" default overrides it, in MB.
+static long long ScrollbackSpillBudget(void)
 {
-    screen_char_t *next_line;
+    NSNumber *pref = [[NSUserDefaults standardUserDefaults] objectForKey:@"ScrollbackMemoryBudget"];
+    return (pref ? [pref longLongValue] : 4) * 1024 * 1024;
+}
 
-    //include the wrapping indicator
-    line_width++;
+// Returns the first tab stop at or after column x and before column limit, or
+// -1 if there is none. Tab stops are one bit per column in words of 64.
+static int NextTabStop(const uint64_t *tabStops, int numWords, int x, int limit)
+{
+    limit = MIN(limit, numWords * 64);
+    if (x < 0) {
+        x = 0;
+    }
+    if (x >= limit) {
+        return -1;
+    }
+    int word = x >> 6;
+    uint64_t bits = tabStops[word] & (~0ULL << (x & 63));
+    while (!bits) {
+        if (++word * 64 >= limit) {
+            return -1;
+        }
+        bits = tabStops[word];
+    }
+    x = word * 64 + __builtin_ctzll(bits);
+    return x < limit ? x : -1;
+}
 
-    next_line = current_line + line_width;
-    if(next_line >= (buf_start + line_width*max_lines))
-    {
-        next_line = buf_start;
-        if(wrap)
-            *wrap = YES;
+// Returns the last tab stop at or before column x, or -1 if there is none.
+static int PreviousTabStop(const uint64_t *tabStops, int numWords, int x)
+{
+    if (x < 0) {
+        return -1;
+    }
+    if (x >= numWords * 64) {
+        x = numWords * 64 - 1;
+    }
+    int word = x >> 6;
+    uint64_t bits = tabStops[word] & (~0ULL >> (63 - (x & 63)));
+    while (!bits) {
+        if (--word < 0) {
+            return -1;
+        }
+        bits = tabStops[word];
     }
-    else if(wrap)
-        *wrap = NO;
+    return word * 64 + 63 - __builtin_clzll(bits);
+}
 
-    return (next_line);
+// Reverses the order of screen lines first...last (inclusive) in lineRows.
+static void ReverseLineRows(int *lineRows, int topRow, int height, int first, int last)
+{
+    while (first < last) {
+        int *a = lineRows + (topRow + first) % height;
+        int *b = lineRows + (topRow + last) % height;
+        int temp = *a;
+        *a = *b;
+        *b = temp;
+        ++first;
+        --last;
+    }
 }
 
 
 @interface VT100Screen (Private)
 
-- (screen_char_t *)_getLineAtIndex:(int)anIndex fromLine:(screen_char_t *)aLine;
+- (int)_rowOfScreenLine:(int)y;
+- (void)_rotateLinesFrom:(int)top to:(int)bottom by:(int)n;
 - (screen_char_t*)_getDefaultLineWithWidth:(int)width;
 - (int)_addLineToScrollbackImpl;
 - (void)_setInitialTabStops;
+- (void)_allocateOtherScreen;
+- (void)_clearOtherScreen;
+- (void)_freeOtherScreen;
+- (void)_swapScreens;
+- (void)_forgetSnapshotRows;
+- (void)_setEOL:(int)code ofScreenLine:(int)y;
 
 @end
 
@@ -264,19 +425,25 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
     SHELL = nil;
 
     buffer_lines = NULL;
-    dirty = NULL;
-    dirtySize = 0;
+    dirtyLines = NULL;
+    dirtyCells = NULL;
+    snapshotRows = NULL;
     // Temporary storage for returning lines from the screen or scrollback
     // buffer to hide the details of the encoding of each.
     result_line = NULL;
-    screen_top = NULL;
+    lineRows = NULL;
+    topRow = 0;
 
-    temp_buffer = NULL;
+    other_buffer_lines = NULL;
+    other_lineRows = NULL;
+    other_topRow = 0;
+    showingAltScreen = NO;
     findContext.substring = nil;
 
     max_scrollback_lines = DEFAULT_SCROLLBACK;
     scrollback_overflow = 0;
-    tabStops = [[NSMutableSet alloc] init];
+    tabStops = NULL;
+    tabStopWords = 0;
     [self _setInitialTabStops];
     linebuffer = [[LineBuffer alloc] init];
 
@@ -300,11 +467,20 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
     // free our character buffer
     if (buffer_lines)
         free(buffer_lines);
+    if (lineRows) {
+        free(lineRows);
+    }
 
     // free our "dirty flags" buffer
-    if (dirty) {
-        assert(dirty[dirtySize] == DIRTY_MAGIC);
-        free(dirty);
+    if (dirtyLines) {
+        free(dirtyLines);
+    }
+    if (dirtyCells) {
+        free(dirtyCells);
+    }
+    if (snapshotRows) {
+        [self _forgetSnapshotRows];
+        free(snapshotRows);
     }
     if (result_line) {
         free(result_line);
@@ -315,16 +491,20 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
         free(default_line);
     }
 
-    if (temp_buffer) {
-        free(temp_buffer);
+    if (other_buffer_lines) {
+        free(other_buffer_lines);
+    }
+    if (other_lineRows) {
+        free(other_lineRows);
     }
 
-    [tabStops release];
+    if (tabStops) {
+        free(tabStops);
+    }
     [printToAnsiString release];
     [linebuffer release];
     [dvr release];
-    dirty = 0;
-    dirtySize = 0;
+    dirtyLines = NULL;
     [super dealloc];
 #if DEBUG_ALLOC
     NSLog(@"%s: 0x%x, done", __PRETTY_FUNCTION__, self);
@@ -377,7 +557,11 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
     }
 
     // set up our pointers
-    screen_top = buffer_lines;
+    lineRows = (int *)malloc(HEIGHT * sizeof(int));
+    for (i = 0; i < HEIGHT; i++) {
+        lineRows[i] = i;
+    }
+    topRow = 0;
 
     // set all lines in buffer to default
     default_fg_code = [TERMINAL foregroundColorCodeReal];
@@ -391,10 +575,9 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
     }
 
     // set up our dirty flags buffer
-    dirtySize = WIDTH * HEIGHT;
-    // allocate one extra byte to check for overruns.
-    dirty = (char*)calloc(dirtySize + 1, sizeof(char));
-    dirty[dirtySize] = DIRTY_MAGIC;
+    dirtyLines = (screen_line_dirty_t *)calloc(HEIGHT, sizeof(screen_line_dirty_t));
+    dirtyCells = (char *)calloc(HEIGHT * WIDTH, sizeof(char));
+    snapshotRows = (screen_snapshot_line_t **)calloc(HEIGHT, sizeof(screen_snapshot_line_t *));
     result_line = (screen_char_t*) calloc(REAL_WIDTH, sizeof(screen_char_t));
 
     // force a redraw
@@ -413,15 +596,14 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
 {
     if (theIndex >= [linebuffer numLinesWithWidth: WIDTH]) {
         // Get a line from the circular screen buffer
-        return [self _getLineAtIndex:(theIndex - [linebuffer numLinesWithWidth: WIDTH])
-                            fromLine:screen_top];
+        return [self getLineAtScreenIndex:(theIndex - [linebuffer numLinesWithWidth: WIDTH])];
     } else {
         // Get a line from the scrollback buffer.
         memcpy(buffer, default_line, sizeof(screen_char_t) * WIDTH);
         int cont = [linebuffer copyLineToBuffer:buffer width:WIDTH lineNum:theIndex];
         if (cont == EOL_SOFT &&
             theIndex == [linebuffer numLinesWithWidth: WIDTH] - 1 &&
-            screen_top[1].code == DWC_RIGHT &&
+            [self getLineAtScreenIndex:0][1].code == DWC_RIGHT &&
             buffer[WIDTH - 1].code == 0) {
             // The last line in the scrollback buffer is actually a split DWC
             // if the first line in the screen is double-width.
@@ -437,10 +619,10 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
     }
 }
 
-// gets line at specified index starting from screen_top
+// gets line at specified index starting from the top of the screen
 - (screen_char_t *)getLineAtScreenIndex: (int) theIndex
 {
-    return ([self _getLineAtIndex:theIndex fromLine:screen_top]);
+    return buffer_lines + [self _rowOfScreenLine:theIndex] * REAL_WIDTH;
 }
 
 // returns NSString representation of line
@@ -459,45 +641,47 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
     return result;
 }
 
-- (BOOL)isAnyCharDirty
+// Extends a line's dirty span to cover [start, end) and ORs value into the
+// dirty value of those cells.
+static void MarkLineDirty(screen_line_dirty_t *line, char *cells, int start, int end, int value)
 {
-    assert(WIDTH * HEIGHT == dirtySize);
-    for (int i = 0; i < WIDTH*HEIGHT; i++) {
-      if (dirty[i]) {
-        return YES;
-      }
+    for (int x = start; x < end; x++) {
+        cells[x] |= value;
     }
-    return NO;
+    if (!line->flags) {
+        line->start = start;
+        line->end = end;
+    } else {
+        if (start < line->start) {
+            line->start = start;
+        }
+        if (end > line->end) {
+            line->end = end;
+        }
+    }
+    line->flags |= value;
 }
 
-- (void)moveDirtyRangeFromOffset:(int)i toOffset:(int)o size:(int)s
+- (screen_line_dirty_t *)_dirtyLineAtScreenIndex:(int)y
 {
-    assert(i >= 0);
-    assert(i < dirtySize);
-    assert(i + s <= dirtySize);
-    assert(o >= 0);
-    assert(o < dirtySize);
-    assert(o + s <= dirtySize);
-    memmove(dirty+o, dirty+i, s*sizeof(char));
+    return dirtyLines + [self _rowOfScreenLine:y];
 }
 
-// moves a block of size 's' from (fromX, fromY) to (toX, toY)
-- (void)moveDirtyRangeFromX:(int)fromX Y:(int)fromY toX:(int)toX Y:(int)toY size:(int)s
+- (const screen_line_dirty_t *)dirtyLineAtScreenIndex:(int)y
 {
-    assert(fromX >= 0);
-    assert(fromX <= WIDTH);
-    assert(toX >= 0);
-    assert(toX < WIDTH);
-    assert(fromY >= 0);
-    if (fromY >= HEIGHT) {
-        // Can happen with 1-line tall session
-        return;
+    assert(y >= 0);
+    assert(y < HEIGHT);
+    return [self _dirtyLineAtScreenIndex:y];
+}
+
+- (BOOL)isAnyCharDirty
+{
+    for (int i = 0; i < HEIGHT; i++) {
+        if (dirtyLines[i].flags) {
+            return YES;
+        }
     }
-    assert(toY >= 0);
-    assert(toY < HEIGHT);
-    [self moveDirtyRangeFromOffset:(fromX + fromY * WIDTH)
-                          toOffset:(toX + toY * WIDTH)
-                              size:s];
+    return NO;
 }
 
 // not inclusive of toX. Is inclusive of toY.
@@ -523,36 +707,39 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
 {
     i = MIN(i, WIDTH*HEIGHT-1);
     assert(i >= 0);
-    assert(i < dirtySize);
 
-    dirty[i] |= v;
+    int y = i / WIDTH;
+    int x = i - y * WIDTH;
+    int row = [self _rowOfScreenLine:y];
+    MarkLineDirty(&dirtyLines[row], dirtyCells + row * WIDTH, x, x + 1, v);
+    ReleaseSnapshotLine(&snapshotRows[row]);
 }
 
+// The range is in cells counting from the top left of the screen and may span
+// several lines.
 - (void)setRangeDirty:(NSRange)range
 {
+    const int size = WIDTH * HEIGHT;
     assert(range.location >= 0);
-    if (range.location >= dirtySize) {
+    if (range.location >= size) {
         return;
     }
     assert(range.length >= 0);
-    if (range.location + range.length > dirtySize) {
-        range.length = dirtySize - range.location;
+    if (range.location + range.length > size) {
+        range.length = size - range.location;
     }
-    assert(range.location + range.length <= dirtySize);
-
-    memset(dirty + range.location,
-           1,
-           range.length);
-}
 
-- (int)dirtyAtOffset:(int)i
-{
-    if (i >= WIDTH*HEIGHT) {
-        i = WIDTH*HEIGHT - 1;
+    int i = range.location;
+    const int end = range.location + range.length;
+    while (i < end) {
+        int y = i / WIDTH;
+        int x = i - y * WIDTH;
+        int n = MIN(WIDTH - x, end - i);
+        int row = [self _rowOfScreenLine:y];
+        MarkLineDirty(&dirtyLines[row], dirtyCells + row * WIDTH, x, x + n, 1);
+        ReleaseSnapshotLine(&snapshotRows[row]);
+        i += n;
     }
-    assert(i >= 0);
-    assert(i < dirtySize);
-    return dirty[i];
 }
 
 - (BOOL)isDirtyAtX:(int)x Y:(int)y
@@ -566,8 +753,7 @@ static __inline__ screen_char_t *incrementLinePointer(screen_char_t *buf_start,
     assert(x < WIDTH);
     assert(y >= 0);
     assert(y < HEIGHT);
-    int i = x + y * WIDTH;
-    return [self dirtyAtOffset:i];
+    return dirtyCells[[self _rowOfScreenLine:y] * WIDTH + x];
 }
 
 - (void)setCharDirtyAtX:(int)x Y:(int)y value:(int)v
@@ -652,7 +838,7 @@ static char* FormatCont(int c)
             [result appendString:@"--- top of buffer ---\n"];
         }
         for (x = 0; x < WIDTH; ++x, ++ox) {
-            if (dirty[y * WIDTH + x]) {
+            if ([self isDirtyAtX:x Y:y]) {
                 dirtyline[ox] = '-';
             } else {
                 dirtyline[ox] = '.';
@@ -726,7 +912,7 @@ static char* FormatCont(int c)
             } else {
                 line[ox] = '.';
             }
-            if (dirty[y*WIDTH+x]) {
+            if ([self isDirtyAtX:x Y:y]) {
                 dirtyline[x] = '*';
             } else {
                 dirtyline[x] = ' ';
@@ -840,6 +1026,7 @@ static char* FormatCont(int c)
     }
     new_width = MAX(new_width, 1);
     new_height = MAX(new_height, 1);
+    [self _forgetSnapshotRows];
 
     // create a new buffer and fill it with the default line.
     new_buffer_lines = (screen_char_t*)calloc(new_height * (new_width+1),
@@ -910,22 +1097,40 @@ static char* FormatCont(int c)
         free(buffer_lines);
     }
     buffer_lines = new_buffer_lines;
-    screen_top = new_buffer_lines;
-    if (dirty) {
-        assert(dirty[dirtySize] == DIRTY_MAGIC);
-        free(dirty);
+    if (lineRows) {
+        free(lineRows);
+    }
+    lineRows = (int *)malloc(new_height * sizeof(int));
+    for (i = 0; i < new_height; i++) {
+        lineRows[i] = i;
+    }
+    topRow = 0;
+    if (dirtyLines) {
+        free(dirtyLines);
+    }
+    if (dirtyCells) {
+        free(dirtyCells);
     }
     if (result_line) {
         free(result_line);
     }
-    dirtySize = new_height * new_width;
-    // Allocate one extra byte to check for buffer overruns.
-    dirty = (char*)malloc(1 + dirtySize * sizeof(char));
-    dirty[dirtySize] = DIRTY_MAGIC;
-    memset(dirty, 1, dirtySize * sizeof(char));
+    dirtyLines = (screen_line_dirty_t *)malloc(new_height * sizeof(screen_line_dirty_t));
+    dirtyCells = (char *)malloc(new_height * new_width * sizeof(char));
+    memset(dirtyCells, 1, new_height * new_width * sizeof(char));
+    free(snapshotRows);
+    snapshotRows = (screen_snapshot_line_t **)calloc(new_height, sizeof(screen_snapshot_line_t *));
+    for (i = 0; i < new_height; i++) {
+        dirtyLines[i].flags = 1;
+        dirtyLines[i].start = 0;
+        dirtyLines[i].end = new_width;
+    }
     result_line = (screen_char_t*)calloc((new_width + 1), sizeof(screen_char_t));
 
-    // Move scrollback lines into screen
+    // Move scrollback lines into screen. Only the end of the scrollback buffer
+    // is rewrapped now: enough to fill the screen (including the cursor line)
+    // and one more screenful above it. The rest is rewrapped a little at a
+    // time by continueReflow.
+    [linebuffer reflowLastLines:new_height * 2 withWidth:new_width];
     int num_lines_in_scrollback = [linebuffer numLinesWithWidth: new_width];
     int dest_y;
     if (num_lines_in_scrollback >= new_height) {
@@ -1004,14 +1209,12 @@ static char* FormatCont(int c)
         ALT_SAVE_CURSOR_Y = new_height-1;
     }
 
-    // if we did the resize in SAVE_BUFFER mode, too bad, get rid of it
-    if (temp_buffer) {
-        screen_char_t* aDefaultLine = [self _getDefaultLineWithWidth:WIDTH];
-        free(temp_buffer);
-        temp_buffer = (screen_char_t*)calloc(REAL_WIDTH * HEIGHT, (sizeof(screen_char_t)));
-        for(i = 0; i < HEIGHT; i++) {
-            memcpy(temp_buffer+i*REAL_WIDTH, aDefaultLine, REAL_WIDTH*sizeof(screen_char_t));
-        }
+    // Only the showing screen was reflowed. If the main screen is hidden
+    // behind the alternate screen, too bad, it comes back blank. A hidden
+    // alternate screen is just dropped and reallocated when next used.
+    [self _freeOtherScreen];
+    if (showingAltScreen) {
+        [self _allocateOtherScreen];
     }
 
     // The linebuffer may have grown. Ensure it doesn't have too many lines.
@@ -1096,6 +1299,12 @@ static char* FormatCont(int c)
 - (void)setUnlimitedScrollback:(BOOL)enable
 {
     unlimitedScrollback_ = enable;
+    [linebuffer setSpillBudget:enable ? ScrollbackSpillBudget() : -1];
+}
+
+- (void)setFirehose:(BOOL)firehose
+{
+    firehose_ = firehose;
 }
 
 - (PTYSession *)session
@@ -1172,6 +1381,54 @@ static char* FormatCont(int c)
     return [[[SESSION addressBookEntry] objectForKey:KEY_SYNC_TITLE] boolValue];
 }
 
+static BOOL isCursorPositionToken(VT100TCC token)
+{
+    return token.type == VT100CSI_CUP || token.type == VT100CSI_HVP;
+}
+
+- (void)putTokens:(VT100TCC *)tokens count:(int)count
+{
+    int i;
+
+    deferScrollbackTrim_ = firehose_;
+    for (i = 0; i < count; ++i) {
+        VT100TCC token = tokens[i];
+        switch (token.type) {
+            case VT100_SKIP:
+            case VT100_NOTSUPPORT:
+                break;
+
+            case VT100CSI_CUP:
+            case VT100CSI_HVP:
+                // Only the last of a run of absolute moves matters.
+                while (i + 1 < count && isCursorPositionToken(tokens[i + 1])) {
+                    ++i;
+                }
+                [self putToken:tokens[i]];
+                break;
+
+            case VT100CC_CR:
+                while (i + 1 < count && tokens[i + 1].type == VT100CC_CR) {
+                    ++i;
+                }
+                [self putToken:token];
+                break;
+
+            default:
+                [self putToken:token];
+                break;
+        }
+    }
+    if (deferScrollbackTrim_) {
+        deferScrollbackTrim_ = NO;
+        if (!unlimitedScrollback_) {
+            int dropped = [linebuffer dropExcessLinesWithWidth:WIDTH];
+            scrollback_overflow += dropped;
+            cumulative_scrollback_overflow += dropped;
+        }
+    }
+}
+
 - (void)putToken:(VT100TCC)token
 {
     NSString *newTitle;
@@ -1182,16 +1439,42 @@ static char* FormatCont(int c)
     int i,j,k;
     screen_char_t *aLine;
 
+    [TERMINAL updateStateForToken:token];
+
     switch (token.type) {
     // our special code
     case VT100_STRING:
-    case VT100_ASCIISTRING:
         // check if we are in print mode
         if ([self printToAnsi] == YES) {
             [self printStringToAnsi:token.u.string];
         } else {
             // else display string on screen
-            [self setString:token.u.string ascii:(token.type == VT100_ASCIISTRING)];
+            [self setString:token.u.string ascii:NO];
+        }
+        break;
+
+    // Strings still in the stream.
+    case VT100_ASCIISTRING:
+    case VT100_UTF8STRING:
+    case VT100_DOUBLEBYTESTRING:
+        if ([self printToAnsi] == YES) {
+            NSStringEncoding encoding = NSUTF8StringEncoding;
+            if (token.type == VT100_ASCIISTRING) {
+                encoding = NSASCIIStringEncoding;
+            } else if (token.type == VT100_DOUBLEBYTESTRING) {
+                encoding = [TERMINAL encoding];
+            }
+            [self printStringToAnsi:[[[NSString alloc] initWithBytes:token.position
+                                                              length:token.length
+                                                            encoding:encoding] autorelease]];
+        } else if (token.type == VT100_ASCIISTRING) {
+            [self setASCIIBytes:token.position length:token.length];
+        } else if (token.type == VT100_DOUBLEBYTESTRING) {
+            [self setDoubleByteString:token.position
+                               length:token.length
+                                table:token.u.table];
+        } else {
+            [self setUTF8String:token.position length:token.length];
         }
         break;
 
@@ -1583,6 +1866,9 @@ static char* FormatCont(int c)
     [linebuffer release];
     linebuffer = [[LineBuffer alloc] init];
     [linebuffer setMaxLines:max_scrollback_lines];
+    if (unlimitedScrollback_) {
+        [linebuffer setSpillBudget:ScrollbackSpillBudget()];
+    }
     [display clearMatches];
 
     scrollback_overflow = 0;
@@ -1592,42 +1878,86 @@ static char* FormatCont(int c)
     [self setDirty];
 }
 
-- (void)saveBuffer
+- (void)_allocateOtherScreen
+{
+    other_buffer_lines = (screen_char_t *)malloc(HEIGHT * REAL_WIDTH * sizeof(screen_char_t));
+    other_lineRows = (int *)malloc(HEIGHT * sizeof(int));
+    [self _clearOtherScreen];
+}
+
+// Fills the hidden screen with default lines in their natural order.
+- (void)_clearOtherScreen
 {
-    if (temp_buffer) {
-        free(temp_buffer);
+    screen_char_t *aDefaultLine = [self _getDefaultLineWithWidth:WIDTH];
+
+    for (int i = 0; i < HEIGHT; i++) {
+        memcpy(other_buffer_lines + i * REAL_WIDTH,
+               aDefaultLine,
+               REAL_WIDTH * sizeof(screen_char_t));
+        other_lineRows[i] = i;
     }
+    other_topRow = 0;
+}
 
-    int size = REAL_WIDTH * HEIGHT;
-    int n = (screen_top - buffer_lines) / REAL_WIDTH;
-    temp_buffer = (screen_char_t*)calloc(size, (sizeof(screen_char_t)));
-    if (n <= 0) {
-        memcpy(temp_buffer, screen_top, size*sizeof(screen_char_t));
-    } else {
-        memcpy(temp_buffer, screen_top, (HEIGHT-n)*REAL_WIDTH*sizeof(screen_char_t));
-        memcpy(temp_buffer + (HEIGHT - n) * REAL_WIDTH, buffer_lines, n * REAL_WIDTH * sizeof(screen_char_t));
+- (void)_freeOtherScreen
+{
+    if (other_buffer_lines) {
+        free(other_buffer_lines);
+        other_buffer_lines = NULL;
     }
+    if (other_lineRows) {
+        free(other_lineRows);
+        other_lineRows = NULL;
+    }
+    other_topRow = 0;
 }
 
-- (void)restoreBuffer
+// Exchanges the showing screen with the hidden one. The cursor, scroll region,
+// dirtyLines and dirtyCells belong to the terminal rather than to either
+// screen, so they stay put; every line is marked dirty because its contents
+// have changed, but nothing outside the screen (such as the scrollback) needs
+// to be redrawn.
+- (void)_swapScreens
+{
+    screen_char_t *lines = buffer_lines;
+    buffer_lines = other_buffer_lines;
+    other_buffer_lines = lines;
+
+    int *rows = lineRows;
+    lineRows = other_lineRows;
+    other_lineRows = rows;
+
+    int top = topRow;
+    topRow = other_topRow;
+    other_topRow = top;
+
+    showingAltScreen = !showingAltScreen;
+    [self setDirtyFromX:0 Y:0 toX:WIDTH Y:HEIGHT - 1];
+}
+
+- (void)saveBuffer
 {
-    if (!temp_buffer) {
+    if (showingAltScreen) {
         return;
     }
-
-    int n = (screen_top - buffer_lines) / REAL_WIDTH;
-    if (n <= 0) {
-        memcpy(screen_top, temp_buffer, REAL_WIDTH * HEIGHT * sizeof(screen_char_t));
+    // Whatever the last program left on the alternate screen is stale, and
+    // the clearScreen that follows 1049 would carry its rows above the cursor
+    // to the top, so each visit starts from a blank screen as in xterm.
+    if (!other_buffer_lines) {
+        [self _allocateOtherScreen];
     } else {
-        memcpy(screen_top, temp_buffer, (HEIGHT - n) * REAL_WIDTH * sizeof(screen_char_t));
-        memcpy(buffer_lines, temp_buffer + (HEIGHT - n) * REAL_WIDTH, n * REAL_WIDTH * sizeof(screen_char_t));
+        [self _clearOtherScreen];
     }
+    [self _swapScreens];
+}
 
-    DebugLog(@"restoreBuffer setDirty");
-    [self setDirty];
-
-    free(temp_buffer);
-    temp_buffer = NULL;
+- (void)restoreBuffer
+{
+    if (!showingAltScreen) {
+        return;
+    }
+    [self _swapScreens];
+    [display deselect];
 }
 
 - (BOOL) printToAnsi
@@ -1685,164 +2015,34 @@ void DumpBuf(screen_char_t* p, int n) {
     return YES;
 }
 
-// ascii: True if string contains only ascii characters.
-- (void)setString:(NSString *)string ascii:(BOOL)ascii
+// Copy screen characters to the screen at the cursor, wrapping and
+// scrolling as needed, and leave the cursor after them.
+- (void)appendScreenChars:(screen_char_t *)buffer length:(int)len
 {
-    assert(self);
-    assert(string);
     int idx, screenIdx;
     int charsToInsert;
-    int len;
     int newx;
-    screen_char_t *buffer;
     screen_char_t *aLine;
 
-    if (gDebugLogging) {
-        DebugLog([NSString stringWithFormat:@"setString: %d chars starting with %c at x=%d, y=%d, line=%d",
-                  [string length], [string characterAtIndex:0],
-                  cursorX, cursorY, cursorY + [linebuffer numLinesWithWidth: WIDTH]]);
-    }
-
-#if DEBUG_METHOD_TRACE
-    NSLog(@"%s(%d):-[VT100Screen setString:%@ at %d]",
-          __FILE__, __LINE__, string, cursorX);
-#endif
-
-    if ((len=[string length]) < 1 || !string) {
-        //NSLog(@"%s: invalid string '%@'", __PRETTY_FUNCTION__, string);
+    if (len < 1) {
+        // The string is empty so do nothing.
         return;
     }
 
-    // Allocate a buffer of screen_char_t and place the new string in it.
-    const int kStaticBufferElements = 1024;
-    screen_char_t staticBuffer[kStaticBufferElements];
-    screen_char_t* dynamicBuffer = 0;
+    // Iterate over each character in the buffer and copy/insert into screen.
+    // Grab a block of consecutive characters up to the remaining length in the
+    // line and append them at once.
+    for (idx = 0; idx < len; )  {
+        int startIdx = idx;
+#ifdef VERBOSE_STRING
+        NSLog(@"Begin inserting line. cursorX=%d, WIDTH=%d", cursorX, WIDTH);
+#endif
+        NSAssert(buffer[idx].code != DWC_RIGHT, @"DWC cut off");
 
-    if (ascii) {
-        // Only Unicode code points 0 through 127 occur in the string.
-        const int kStaticTempElements = 1024;
-        unichar staticTemp[kStaticTempElements];
-        unichar* dynamicTemp = 0;
-        unichar *sc;
-        if ([string length] > kStaticTempElements) {
-            dynamicTemp = sc = (unichar *) calloc(len, sizeof(unichar));
-            assert(dynamicTemp);
-        } else {
-            sc = staticTemp;
-        }
-        assert(TERMINAL);
-        screen_char_t fg = [TERMINAL foregroundColorCode];
-        screen_char_t bg = [TERMINAL backgroundColorCode];
-
-        if ([string length] > kStaticBufferElements) {
-            buffer = dynamicBuffer = (screen_char_t *) calloc([string length],
-                                                              sizeof(screen_char_t));
-            assert(dynamicBuffer);
-            if (!buffer) {
-                NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
-                return;
-            }
-        } else {
-            buffer = staticBuffer;
-        }
-
-        [string getCharacters:sc];
-        for (int i = 0; i < len; i++) {
-            buffer[i].code = sc[i];
-            buffer[i].complexChar = NO;
-            CopyForegroundColor(&buffer[i], fg);
-            CopyBackgroundColor(&buffer[i], bg);
-            buffer[i].unused = 0;
-        }
-
-        // If a graphics character set was selected then translate buffer
-        // characters into graphics charaters.
-        if (charset[[TERMINAL charset]]) {
-            translate(buffer, len);
-        }
-        if (dynamicTemp) {
-            free(dynamicTemp);
-        }
-    } else {
-        string = [string precomposedStringWithCanonicalMapping];
-        len = [string length];
-        if (2 * len > kStaticBufferElements) {
-            buffer = dynamicBuffer = (screen_char_t *) calloc(2 * len,
-                                                              sizeof(screen_char_t));
-            assert(buffer);
-            if (!buffer) {
-                NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
-                return;
-            }
-        } else {
-            buffer = staticBuffer;
-        }
-
-        // Pick off leading combining marks and low surrogates and modify the
-        // character at the cursor position with them.
-        unichar firstChar = [string characterAtIndex:0];
-        while ([string length] > 0 &&
-               (IsCombiningMark(firstChar) || IsLowSurrogate(firstChar))) {
-            if (![self addCombiningCharAtCursor:firstChar]) {
-                // Combining mark will need to stand alone rather than combine
-                // because nothing precedes it.
-                if (IsCombiningMark(firstChar)) {
-                    // Prepend a space to it so the combining mark has something
-                    // to combine with.
-                    string = [NSString stringWithFormat:@" %@", string];
-                } else {
-                    // Got a low surrogate but can't find the matching high
-                    // surrogate. Turn the low surrogate into a replacement
-                    // char. This should never happen because decode_string
-                    // ought to detect the broken unicode and substitute a
-                    // replacement char.
-                    string = [NSString stringWithFormat:@"%@%@",
-                              ReplacementString(),
-                              [string substringFromIndex:1]];
-                }
-                len = [string length];
-                break;
-            }
-            string = [string substringFromIndex:1];
-            if ([string length] > 0) {
-                firstChar = [string characterAtIndex:0];
-            }
-        }
-
-        // Add DWC_RIGHT after each double-byte character.
-        assert(TERMINAL);
-        StringToScreenChars(string,
-                            buffer,
-                            [TERMINAL foregroundColorCode],
-                            [TERMINAL backgroundColorCode],
-                            &len,
-                            [TERMINAL encoding],
-                            [SESSION doubleWidth],
-                            NULL);
-    }
-
-    if (len < 1) {
-        // The string is empty so do nothing.
-        if (dynamicBuffer) {
-            free(dynamicBuffer);
-        }
-        return;
-    }
-
-    // Iterate over each character in the buffer and copy/insert into screen.
-    // Grab a block of consecutive characters up to the remaining length in the
-    // line and append them at once.
-    for (idx = 0; idx < len; )  {
-        int startIdx = idx;
-#ifdef VERBOSE_STRING
-        NSLog(@"Begin inserting line. cursorX=%d, WIDTH=%d", cursorX, WIDTH);
-#endif
-        NSAssert(buffer[idx].code != DWC_RIGHT, @"DWC cut off");
-
-        if (buffer[idx].code == DWC_SKIP) {
-            // This is an invalid unicode character that iTerm2 has appropriated
-            // for internal use. Change it to something invalid but safe.
-            buffer[idx].code = BOGUS_CHAR;
+        if (buffer[idx].code == DWC_SKIP) {
+            // This is an invalid unicode character that iTerm2 has appropriated
+            // for internal use. Change it to something invalid but safe.
+            buffer[idx].code = BOGUS_CHAR;
         }
         int widthOffset;
         if (idx + 1 < len && buffer[idx + 1].code == DWC_RIGHT) {
@@ -1861,9 +2061,8 @@ void DumpBuf(screen_char_t* p, int n) {
                 // Set the continuation marker
                 screen_char_t* prevLine = [self getLineAtScreenIndex:cursorY];
                 BOOL splitDwc = (cursorX == WIDTH - 1);
-                prevLine[WIDTH].code = (splitDwc ? EOL_DWC : EOL_SOFT);
+                [self _setEOL:(splitDwc ? EOL_DWC : EOL_SOFT) ofScreenLine:cursorY];
                 if (splitDwc) {
-                    prevLine[WIDTH].code = EOL_DWC;
                     prevLine[WIDTH-1].code = DWC_SKIP;
                 }
                 [self setCursorX:0 Y:cursorY];
@@ -1879,7 +2078,7 @@ void DumpBuf(screen_char_t* p, int n) {
                 // and insert the last character there.
 
                 // Clear the continuation marker
-                [self getLineAtScreenIndex:cursorY][WIDTH].code = EOL_HARD;
+                [self _setEOL:EOL_HARD ofScreenLine:cursorY];
                 // Cause the loop to end after this character.
                 int ncx = WIDTH - 1;
 
@@ -1992,9 +2191,8 @@ void DumpBuf(screen_char_t* p, int n) {
                     aLine[WIDTH].code = EOL_SOFT;
                 }
                 memmove(dst, src, elements * sizeof(screen_char_t));
-                memset(dirty + screenIdx + cursorX,
-                       1,
-                       WIDTH - cursorX);
+                [self setRangeDirty:NSMakeRange(screenIdx + cursorX,
+                                                WIDTH - cursorX)];
             }
         }
 
@@ -2057,12 +2255,371 @@ void DumpBuf(screen_char_t* p, int n) {
             }
         }
     }
+}
+
+// ascii: True if string contains only ascii characters.
+- (void)setString:(NSString *)string ascii:(BOOL)ascii
+{
+    assert(self);
+    assert(string);
+    int len;
+    screen_char_t *buffer;
+
+    if (gDebugLogging) {
+        DebugLog([NSString stringWithFormat:@"setString: %d chars starting with %c at x=%d, y=%d, line=%d",
+                  [string length], [string characterAtIndex:0],
+                  cursorX, cursorY, cursorY + [linebuffer numLinesWithWidth: WIDTH]]);
+    }
+
+#if DEBUG_METHOD_TRACE
+    NSLog(@"%s(%d):-[VT100Screen setString:%@ at %d]",
+          __FILE__, __LINE__, string, cursorX);
+#endif
+
+    if ((len=[string length]) < 1 || !string) {
+        //NSLog(@"%s: invalid string '%@'", __PRETTY_FUNCTION__, string);
+        return;
+    }
+
+    // Allocate a buffer of screen_char_t and place the new string in it.
+    const int kStaticBufferElements = 1024;
+    screen_char_t staticBuffer[kStaticBufferElements];
+    screen_char_t* dynamicBuffer = 0;
+
+    if (ascii) {
+        // Only Unicode code points 0 through 127 occur in the string.
+        const int kStaticTempElements = 1024;
+        unichar staticTemp[kStaticTempElements];
+        unichar* dynamicTemp = 0;
+        unichar *sc;
+        if ([string length] > kStaticTempElements) {
+            dynamicTemp = sc = (unichar *) calloc(len, sizeof(unichar));
+            assert(dynamicTemp);
+        } else {
+            sc = staticTemp;
+        }
+        assert(TERMINAL);
+        screen_char_t fg = [TERMINAL foregroundColorCode];
+        screen_char_t bg = [TERMINAL backgroundColorCode];
+
+        if ([string length] > kStaticBufferElements) {
+            buffer = dynamicBuffer = (screen_char_t *) calloc([string length],
+                                                              sizeof(screen_char_t));
+            assert(dynamicBuffer);
+            if (!buffer) {
+                NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
+                return;
+            }
+        } else {
+            buffer = staticBuffer;
+        }
+
+        [string getCharacters:sc];
+        for (int i = 0; i < len; i++) {
+            buffer[i].code = sc[i];
+            buffer[i].complexChar = NO;
+            CopyForegroundColor(&buffer[i], fg);
+            CopyBackgroundColor(&buffer[i], bg);
+            buffer[i].unused = 0;
+        }
+
+        // If a graphics character set was selected then translate buffer
+        // characters into graphics charaters.
+        if (charset[[TERMINAL charset]]) {
+            translate(buffer, len);
+        }
+        if (dynamicTemp) {
+            free(dynamicTemp);
+        }
+    } else {
+        string = [string precomposedStringWithCanonicalMapping];
+        len = [string length];
+        if (2 * len > kStaticBufferElements) {
+            buffer = dynamicBuffer = (screen_char_t *) calloc(2 * len,
+                                                              sizeof(screen_char_t));
+            assert(buffer);
+            if (!buffer) {
+                NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
+                return;
+            }
+        } else {
+            buffer = staticBuffer;
+        }
+
+        // Pick off leading combining marks and low surrogates and modify the
+        // character at the cursor position with them.
+        unichar firstChar = [string characterAtIndex:0];
+        while ([string length] > 0 &&
+               (IsCombiningMark(firstChar) || IsLowSurrogate(firstChar))) {
+            if (![self addCombiningCharAtCursor:firstChar]) {
+                // Combining mark will need to stand alone rather than combine
+                // because nothing precedes it.
+                if (IsCombiningMark(firstChar)) {
+                    // Prepend a space to it so the combining mark has something
+                    // to combine with.
+                    string = [NSString stringWithFormat:@" %@", string];
+                } else {
+                    // Got a low surrogate but can't find the matching high
+                    // surrogate. Turn the low surrogate into a replacement
+                    // char. This should never happen because decode_string
+                    // ought to detect the broken unicode and substitute a
+                    // replacement char.
+                    string = [NSString stringWithFormat:@"%@%@",
+                              ReplacementString(),
+                              [string substringFromIndex:1]];
+                }
+                len = [string length];
+                break;
+            }
+            string = [string substringFromIndex:1];
+            if ([string length] > 0) {
+                firstChar = [string characterAtIndex:0];
+            }
+        }
+
+        // Add DWC_RIGHT after each double-byte character.
+        assert(TERMINAL);
+        StringToScreenChars(string,
+                            buffer,
+                            [TERMINAL foregroundColorCode],
+                            [TERMINAL backgroundColorCode],
+                            &len,
+                            [TERMINAL encoding],
+                            [SESSION doubleWidth],
+                            NULL);
+    }
+
+    [self appendScreenChars:buffer length:len];
+
+    if (dynamicBuffer) {
+        free(dynamicBuffer);
+    }
+}
+
+// The common case of setASCIIBytes:length:, with wraparound on and insert
+// mode off. ASCII has no double-width characters, so this does what
+// appendScreenChars:length: would but writes each byte straight into its
+// line, with the attributes copied from a single prototype cell.
+- (void)blitASCIIBytes:(const unsigned char *)bytes length:(int)length
+{
+    screen_char_t prototype;
+    const unichar *map = charset[[TERMINAL charset]] ? charmap : NULL;
+    BOOL isAnsi = [TERMINAL isAnsi];
+    int i = 0;
+
+    memset(&prototype, 0, sizeof(prototype));
+    CopyForegroundColor(&prototype, [TERMINAL foregroundColorCode]);
+    CopyBackgroundColor(&prototype, [TERMINAL backgroundColorCode]);
+
+    while (i < length) {
+        if (cursorX >= WIDTH) {
+            // A previous write left the cursor past the right margin.
+            [self _setEOL:EOL_SOFT ofScreenLine:cursorY];
+            [self setCursorX:0 Y:cursorY];
+            [self setNewLine];
+        }
+
+        int n = MIN(WIDTH - cursorX, length - i);
+        int screenIdx = cursorY * WIDTH;
+        screen_char_t *aLine = [self getLineAtScreenIndex:cursorY];
+        screen_char_t *dest = aLine + cursorX;
+        int j;
+
+        if (dest[0].code == DWC_RIGHT) {
+            // Overwriting the second half of a double-width character, so turn
+            // the DWC into a space.
+            NSAssert(cursorX > 0, @"DWC split");
+            dest[0].code = ' ';
+            dest[0].complexChar = NO;
+            dest[-1].code = ' ';
+            dest[-1].complexChar = NO;
+            [self setDirtyAtOffset:screenIdx + cursorX - 1 value:1];
+        }
+        if (map) {
+            for (j = 0; j < n; j++) {
+                dest[j] = prototype;
+                dest[j].code = map[bytes[i + j]];
+            }
+        } else {
+            for (j = 0; j < n; j++) {
+                dest[j] = prototype;
+                dest[j].code = bytes[i + j];
+            }
+        }
+        [self setRangeDirty:NSMakeRange(screenIdx + cursorX, n)];
+        [self setCursorX:cursorX + n Y:cursorY];
+        i += n;
+
+        // Overwrote the first half of a DWC, leaving behind its second half.
+        if (cursorX < WIDTH - 1 && aLine[cursorX].code == DWC_RIGHT) {
+            aLine[cursorX].code = ' ';
+            aLine[cursorX].complexChar = NO;
+        }
+
+        // ANSI terminals go to a new line after displaying a character at
+        // the rightmost column.
+        if (cursorX >= WIDTH && isAnsi) {
+            aLine[WIDTH].code = EOL_SOFT;
+            [self setCursorX:0 Y:cursorY];
+            [self setNewLine];
+        }
+    }
+}
+
+- (void)setASCIIBytes:(const unsigned char *)bytes length:(int)length
+{
+    if (gDebugLogging) {
+        DebugLog([NSString stringWithFormat:@"setASCIIBytes: %d chars starting with %c at x=%d, y=%d, line=%d",
+                  length, length > 0 ? bytes[0] : ' ',
+                  cursorX, cursorY, cursorY + [linebuffer numLinesWithWidth: WIDTH]]);
+    }
+    if (length < 1) {
+        return;
+    }
+    assert(TERMINAL);
+    if (![TERMINAL insertMode] && [TERMINAL wraparoundMode]) {
+        [self blitASCIIBytes:bytes length:length];
+        return;
+    }
+
+    const int kStaticBufferElements = 1024;
+    screen_char_t staticBuffer[kStaticBufferElements];
+    screen_char_t *buffer = staticBuffer;
+    screen_char_t *dynamicBuffer = 0;
+    if (length > kStaticBufferElements) {
+        buffer = dynamicBuffer = (screen_char_t *) calloc(length,
+                                                          sizeof(screen_char_t));
+        assert(dynamicBuffer);
+        if (!buffer) {
+            NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
+            return;
+        }
+    }
+
+    screen_char_t fg = [TERMINAL foregroundColorCode];
+    screen_char_t bg = [TERMINAL backgroundColorCode];
+    for (int i = 0; i < length; i++) {
+        buffer[i].code = bytes[i];
+        buffer[i].complexChar = NO;
+        CopyForegroundColor(&buffer[i], fg);
+        CopyBackgroundColor(&buffer[i], bg);
+        buffer[i].unused = 0;
+    }
+
+    // If a graphics character set was selected then translate buffer
+    // characters into graphics charaters.
+    if (charset[[TERMINAL charset]]) {
+        translate(buffer, length);
+    }
+    [self appendScreenChars:buffer length:length];
+
+    if (dynamicBuffer) {
+        free(dynamicBuffer);
+    }
+}
+
+// Converts decoded UTF-16 (which needs no normalization) to screen
+// characters with the current attributes and appends them.
+- (void)appendUnichars:(const unichar *)chars length:(int)numChars
+{
+    // Each code unit needs at most two screen characters.
+    const int kStaticBufferElements = 1024;
+    screen_char_t staticBuffer[kStaticBufferElements * 2];
+    screen_char_t *buffer = staticBuffer;
+    screen_char_t *dynamicBuffer = 0;
+    if (numChars > kStaticBufferElements) {
+        buffer = dynamicBuffer = (screen_char_t *) calloc(2 * numChars,
+                                                          sizeof(screen_char_t));
+        assert(dynamicBuffer);
+        if (!dynamicBuffer) {
+            NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
+            return;
+        }
+    }
+
+    int len;
+    assert(TERMINAL);
+    UnicharsToScreenChars(chars,
+                          numChars,
+                          buffer,
+                          [TERMINAL foregroundColorCode],
+                          [TERMINAL backgroundColorCode],
+                          &len,
+                          [TERMINAL encoding],
+                          [SESSION doubleWidth],
+                          NULL);
+    [self appendScreenChars:buffer length:len];
 
     if (dynamicBuffer) {
         free(dynamicBuffer);
     }
 }
 
+- (void)setUTF8String:(const unsigned char *)bytes length:(int)length
+{
+    if (gDebugLogging) {
+        DebugLog([NSString stringWithFormat:@"setUTF8String: %d bytes at x=%d, y=%d, line=%d",
+                  length, cursorX, cursorY, cursorY + [linebuffer numLinesWithWidth: WIDTH]]);
+    }
+    if (length < 1) {
+        return;
+    }
+
+    // A run of n bytes decodes to at most n UTF-16 code units.
+    const int kStaticBufferElements = 1024;
+    unichar staticChars[kStaticBufferElements];
+    unichar *chars = staticChars;
+    unichar *dynamicChars = 0;
+    if (length > kStaticBufferElements) {
+        chars = dynamicChars = (unichar *) malloc(length * sizeof(unichar));
+        assert(dynamicChars);
+        if (!dynamicChars) {
+            NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
+            return;
+        }
+    }
+
+    [self appendUnichars:chars length:Utf8DecodeValidRun(bytes, length, chars)];
+
+    if (dynamicChars) {
+        free(dynamicChars);
+    }
+}
+
+- (void)setDoubleByteString:(const unsigned char *)bytes
+                     length:(int)length
+                      table:(const uint16_t *)table
+{
+    if (gDebugLogging) {
+        DebugLog([NSString stringWithFormat:@"setDoubleByteString: %d bytes at x=%d, y=%d, line=%d",
+                  length, cursorX, cursorY, cursorY + [linebuffer numLinesWithWidth: WIDTH]]);
+    }
+    if (length < 1) {
+        return;
+    }
+
+    // Every character is at least one byte and decodes to one code unit.
+    const int kStaticBufferElements = 1024;
+    unichar staticChars[kStaticBufferElements];
+    unichar *chars = staticChars;
+    unichar *dynamicChars = 0;
+    if (length > kStaticBufferElements) {
+        chars = dynamicChars = (unichar *) malloc(length * sizeof(unichar));
+        assert(dynamicChars);
+        if (!dynamicChars) {
+            NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
+            return;
+        }
+    }
+
+    [self appendUnichars:chars
+                  length:DoubleByteDecodeRun(table, bytes, length, chars)];
+
+    if (dynamicChars) {
+        free(dynamicChars);
+    }
+}
+
 - (void)setStringToX:(int)x
                    Y:(int)y
               string:(NSString *)string
@@ -2094,7 +2651,6 @@ void DumpBuf(screen_char_t* p, int n) {
 - (void)setNewLine
 {
     screen_char_t *aLine;
-    BOOL wrap = NO;
 
 #if DEBUG_METHOD_TRACE
     NSLog(@"%s(%d):-[VT100Screen setNewLine](%d,%d)-[%d,%d]", __FILE__, __LINE__, cursorX, cursorY, SCROLL_TOP, SCROLL_BOTTOM);
@@ -2118,14 +2674,23 @@ void DumpBuf(screen_char_t* p, int n) {
                             Y:MAX(0, cursorY-1)
                         value:1];
 
-        // Top line can move into scroll area; we need to draw only bottom line.
-        [self moveDirtyRangeFromX:0 Y:1 toX:0 Y:0 size:WIDTH*(HEIGHT - 1)];
-        [self setRangeDirty:NSMakeRange(WIDTH * (HEIGHT - 1), WIDTH)];
-
         [self addLineToScrollback];
 
-        // Increment screen_top pointer
-        screen_top = incrementLinePointer(buffer_lines, screen_top, HEIGHT, WIDTH, &wrap);
+        // The old top line's row becomes the bottom line. The dirty flags
+        // of the other lines rotate along with it.
+        if (++topRow == HEIGHT) {
+            topRow = 0;
+        }
+
+        // Top line can move into scroll area; we need to draw only bottom line,
+        // which reuses the old top line's storage.
+        int bottomRow = [self _rowOfScreenLine:HEIGHT - 1];
+        screen_line_dirty_t *bottom = &dirtyLines[bottomRow];
+        bottom->flags = 1;
+        bottom->start = 0;
+        bottom->end = WIDTH;
+        memset(dirtyCells + bottomRow * WIDTH, 1, WIDTH * sizeof(char));
+        ReleaseSnapshotLine(&snapshotRows[bottomRow]);
 
         // set last screen line default
         aLine = [self getLineAtScreenIndex: (HEIGHT - 1)];
@@ -2133,11 +2698,6 @@ void DumpBuf(screen_char_t* p, int n) {
                [self _getDefaultLineWithWidth:WIDTH],
                REAL_WIDTH*sizeof(screen_char_t));
 
-        // Mark everything dirty if we're not using the scrollback buffer
-        if (temp_buffer) {
-            [self setDirty];
-        }
-
         DebugLog(@"setNewline scroll screen");
     } else {
         // We are scrolling within a strict subset of the screen.
@@ -2151,6 +2711,11 @@ void DumpBuf(screen_char_t* p, int n) {
     return cumulative_scrollback_overflow;
 }
 
+- (void)getScrollbackCompressionRawBytes:(long long *)rawBytes compressedBytes:(long long *)compressedBytes
+{
+    [linebuffer getCompressionRawBytes:rawBytes compressedBytes:compressedBytes];
+}
+
 - (void)deleteCharacters:(int) n
 {
     screen_char_t *aLine;
@@ -2208,16 +2773,9 @@ void DumpBuf(screen_char_t* p, int n) {
     NSLog(@"%s(%d):-[VT100Screen backTab]", __FILE__, __LINE__);
 #endif
 
-    [self setCursorX:cursorX - 1 Y:cursorY];
-    for (;
-         ![self haveTabStopAt:cursorX] && cursorX > 0;
-         [self setCursorX:cursorX - 1 Y:cursorY]) {
-        ;
-    }
-
-    if (cursorX < 0) {
-        [self setCursorX:0 Y:cursorY];
-    }
+    // Move to the previous tab stop, or the left margin if there isn't one.
+    int x = PreviousTabStop(tabStops, tabStopWords, cursorX - 1);
+    [self setCursorX:MAX(0, x) Y:cursorY];
 }
 
 - (void)advanceCursor:(BOOL)canOccupyLastSpace
@@ -2227,8 +2785,7 @@ void DumpBuf(screen_char_t* p, int n) {
     if (canOccupyLastSpace) {
         if (cursorX > WIDTH) {
             cursorX = WIDTH;
-            screen_char_t* aLine = [self getLineAtScreenIndex:cursorY];
-            aLine[WIDTH].code = EOL_SOFT;
+            [self _setEOL:EOL_SOFT ofScreenLine:cursorY];
             [self setNewLine];
             [self setCursorX:0 Y:cursorY];
         }
@@ -2245,34 +2802,54 @@ void DumpBuf(screen_char_t* p, int n) {
     screen_char_t* aLine = [self getLineAtScreenIndex:cursorY];
     int positions = 0;
     BOOL allNulls = YES;
+    int col = cursorX;
 
     // Advance cursor to next tab stop. Count the number of positions advanced
     // and record whether they were all nulls.
-    if (aLine[cursorX].code != 0) {
+    if (aLine[col].code != 0) {
         allNulls = NO;
     }
 
     ++positions;
     // ensure we go to the next tab in case we are already on one
-    [self advanceCursor:YES];
-    aLine = [self getLineAtScreenIndex:cursorY];
-    for (; ; [self advanceCursor:YES], ++positions) {
-        if (cursorX == WIDTH) {
+    ++col;
+    for (;;) {
+        if (col >= WIDTH) {
             // Wrap around to the next line.
-            if (aLine[cursorX].code == EOL_HARD) {
-                aLine[cursorX].code = EOL_SOFT;
+            if (col > WIDTH || aLine[WIDTH].code == EOL_HARD) {
+                [self _setEOL:EOL_SOFT ofScreenLine:cursorY];
             }
+            [self setCursorX:WIDTH Y:cursorY];
             [self setNewLine];
-            [self setCursorX:0 Y:cursorY];
+            col = 0;
             aLine = [self getLineAtScreenIndex:cursorY];
         }
-        if ([self haveTabStopAt:cursorX]) {
-            break;
+        int stop = NextTabStop(tabStops, tabStopWords, col, WIDTH);
+        BOOL wraps = NO;
+        if (stop < 0) {
+            if (NextTabStop(tabStops, tabStopWords, 0, WIDTH) < 0) {
+                // There are no tab stops at all. Stop at the right margin
+                // instead of wrapping forever.
+                stop = WIDTH - 1;
+            } else {
+                stop = WIDTH;
+                wraps = YES;
+            }
+        }
+        for (int i = col; allNulls && i < stop; i++) {
+            if (aLine[i].code != 0) {
+                allNulls = NO;
+            }
         }
-        if (aLine[cursorX].code != 0) {
-            allNulls = NO;
+        if (stop > col) {
+            positions += stop - col;
+        }
+        col = stop;
+        if (!wraps) {
+            break;
         }
     }
+    [self setCursorX:col Y:cursorY];
     [self setCharAtCursorDirty:1];
     if (allNulls) {
         // If only nulls were advanced over, convert them to tab fillers
@@ -2420,15 +2997,17 @@ void DumpBuf(screen_char_t* p, int n) {
     idx1=yStart*REAL_WIDTH+x1;
     idx2=y2*REAL_WIDTH+x2;
 
-    // clear the contents between idx1 and idx2
-    for(i = idx1, aScreenChar = screen_top + idx1; i < idx2; i++, aScreenChar++) {
-        if (aScreenChar >= (buffer_lines + HEIGHT*REAL_WIDTH)) {
-            aScreenChar -= HEIGHT * REAL_WIDTH; // wrap around to top of buffer
-            assert(aScreenChar < (buffer_lines + HEIGHT*REAL_WIDTH));  // Tried to go way past the end of the screen
+    // clear the contents between idx1 and idx2. Lines aren't contiguous in
+    // buffer_lines, so look each one up.
+    for (i = idx1; i < idx2; i++) {
+        int y = i / REAL_WIDTH;
+        if (i == idx1 || i % REAL_WIDTH == 0) {
+            aScreenChar = [self getLineAtScreenIndex:y] + (i - y * REAL_WIDTH);
         }
         aScreenChar->code = 0;
         CopyForegroundColor(aScreenChar, [TERMINAL foregroundColorCodeReal]);
         CopyBackgroundColor(aScreenChar, [TERMINAL backgroundColorCodeReal]);
+        aScreenChar++;
     }
 
     [self setRangeDirty:NSMakeRange(yStart * WIDTH + x1,
@@ -2637,7 +3216,7 @@ void DumpBuf(screen_char_t* p, int n) {
     }
     [self setCursorX:nx Y:ny];
 
-    if (temp_buffer) {
+    if (showingAltScreen) {
         ALT_SAVE_CURSOR_X = cursorX;
         ALT_SAVE_CURSOR_Y = cursorY;
     } else {
@@ -2656,7 +3235,7 @@ void DumpBuf(screen_char_t* p, int n) {
     NSLog(@"%s(%d):-[VT100Screen restoreCursorPosition]", __FILE__, __LINE__);
 #endif
 
-    if(temp_buffer) {
+    if (showingAltScreen) {
         [self setCursorX:ALT_SAVE_CURSOR_X Y:ALT_SAVE_CURSOR_Y];
     } else {
         [self setCursorX:SAVE_CURSOR_X Y:SAVE_CURSOR_Y];
@@ -2699,8 +3278,7 @@ void DumpBuf(screen_char_t* p, int n) {
 
 - (void)scrollUp
 {
-    int i;
-    screen_char_t *sourceLine, *targetLine;
+    screen_char_t *targetLine;
 
 #if DEBUG_METHOD_TRACE
     NSLog(@"%s(%d):-[VT100Screen scrollUp]", __FILE__, __LINE__);
@@ -2720,25 +3298,10 @@ void DumpBuf(screen_char_t* p, int n) {
             // the scrollback buffer.
             [self addLineToScrollback];
         }
-        // Move all lines between SCROLL_TOP and SCROLL_BOTTOM one line up
-        // check if the screen area is wrapped
-        sourceLine = [self getLineAtScreenIndex:SCROLL_TOP];
-        targetLine = [self getLineAtScreenIndex:SCROLL_BOTTOM];
-        if (sourceLine < targetLine) {
-            // screen area is not wrapped; direct memmove
-            memmove(sourceLine,
-                    sourceLine + REAL_WIDTH,
-                    (SCROLL_BOTTOM - SCROLL_TOP) * REAL_WIDTH * sizeof(screen_char_t));
-        } else {
-            // screen area is wrapped; copy line by line
-            for(i = SCROLL_TOP; i < SCROLL_BOTTOM; i++) {
-                sourceLine = [self getLineAtScreenIndex:i+1];
-                targetLine = [self getLineAtScreenIndex: i];
-                memmove(targetLine,
-                        sourceLine,
-                        REAL_WIDTH * sizeof(screen_char_t));
-            }
-        }
+        // Move all lines between SCROLL_TOP and SCROLL_BOTTOM one line up.
+        // The line at SCROLL_TOP wraps around to SCROLL_BOTTOM.
+        [self _rotateLinesFrom:SCROLL_TOP to:SCROLL_BOTTOM by:1];
+
         // new line at SCROLL_BOTTOM with default settings
         targetLine = [self getLineAtScreenIndex:SCROLL_BOTTOM];
         memcpy(targetLine,
@@ -2756,8 +3319,7 @@ void DumpBuf(screen_char_t* p, int n) {
 
 - (void)scrollDown
 {
-    int i;
-    screen_char_t *sourceLine, *targetLine;
+    screen_char_t *targetLine;
 
 #if DEBUG_METHOD_TRACE
     NSLog(@"%s(%d):-[VT100Screen scrollDown]", __FILE__, __LINE__);
@@ -2769,25 +3331,9 @@ void DumpBuf(screen_char_t* p, int n) {
 
     if (SCROLL_TOP<SCROLL_BOTTOM)
     {
-        // move all lines between SCROLL_TOP and SCROLL_BOTTOM one line down
-        // check if screen is wrapped
-        sourceLine = [self getLineAtScreenIndex:SCROLL_TOP];
-        targetLine = [self getLineAtScreenIndex:SCROLL_BOTTOM];
-        if(sourceLine < targetLine)
-        {
-            // screen area is not wrapped; direct memmove
-            memmove(sourceLine+REAL_WIDTH, sourceLine, (SCROLL_BOTTOM-SCROLL_TOP)*REAL_WIDTH*sizeof(screen_char_t));
-        }
-        else
-        {
-            // screen area is wrapped; move line by line
-            for(i = SCROLL_BOTTOM - 1; i >= SCROLL_TOP; i--)
-            {
-                sourceLine = [self getLineAtScreenIndex:i];
-                targetLine = [self getLineAtScreenIndex:i+1];
-                memmove(targetLine, sourceLine, REAL_WIDTH*sizeof(screen_char_t));
-            }
-        }
+        // move all lines between SCROLL_TOP and SCROLL_BOTTOM one line down.
+        // The line at SCROLL_BOTTOM wraps around to SCROLL_TOP.
+        [self _rotateLinesFrom:SCROLL_TOP to:SCROLL_BOTTOM by:-1];
     }
     // new line at SCROLL_TOP with default settings
     targetLine = [self getLineAtScreenIndex:SCROLL_TOP];
@@ -2847,8 +3393,8 @@ void DumpBuf(screen_char_t* p, int n) {
 
 - (void) insertLines: (int)n
 {
-    int i, num_lines_moved;
-    screen_char_t *sourceLine, *targetLine, *aDefaultLine;
+    int i;
+    screen_char_t *sourceLine, *aDefaultLine;
 
 #if DEBUG_METHOD_TRACE
     NSLog(@"%s(%d):-[VT100Screen insertLines; %d]", __FILE__, __LINE__, n);
@@ -2857,15 +3403,9 @@ void DumpBuf(screen_char_t* p, int n) {
 
 //    NSLog(@"insertLines %d[%d,%d]",n, cursorX,cursorY);
     if (n + cursorY <= SCROLL_BOTTOM) {
-        // number of lines we can move down by n before we hit SCROLL_BOTTOM
-        num_lines_moved = SCROLL_BOTTOM - (cursorY + n);
-        // start from lower end
-        for (i = num_lines_moved ; i >= 0; i--) {
-            sourceLine = [self getLineAtScreenIndex:cursorY + i];
-            targetLine = [self getLineAtScreenIndex:cursorY + i + n];
-            memcpy(targetLine, sourceLine, REAL_WIDTH * sizeof(screen_char_t));
-        }
-
+        // Move the lines from cursorY down by n. The n lines pushed past
+        // SCROLL_BOTTOM wrap around to cursorY and are cleared below.
+        [self _rotateLinesFrom:cursorY to:SCROLL_BOTTOM by:-n];
     }
     if (n + cursorY > SCROLL_BOTTOM) {
         n  = SCROLL_BOTTOM - cursorY + 1;
@@ -2885,23 +3425,17 @@ void DumpBuf(screen_char_t* p, int n) {
 
 - (void)deleteLines:(int)n
 {
-    int i, num_lines_moved;
-    screen_char_t *sourceLine, *targetLine, *aDefaultLine;
+    int i;
+    screen_char_t *sourceLine, *aDefaultLine;
 
 #if DEBUG_METHOD_TRACE
     NSLog(@"%s(%d):-[VT100Screen deleteLines; %d]", __FILE__, __LINE__, n);
 #endif
 
     if (n + cursorY <= SCROLL_BOTTOM) {
-        // number of lines we can move down by n before we hit SCROLL_BOTTOM
-        num_lines_moved = SCROLL_BOTTOM - (cursorY + n);
-
-        for (i = 0; i <= num_lines_moved; i++) {
-            sourceLine = [self getLineAtScreenIndex:cursorY + i + n];
-            targetLine = [self getLineAtScreenIndex:cursorY + i];
-            memcpy(targetLine, sourceLine, REAL_WIDTH*sizeof(screen_char_t));
-        }
-
+        // Move the lines below the deleted ones up by n. The deleted lines
+        // wrap around to SCROLL_BOTTOM and are cleared below.
+        [self _rotateLinesFrom:cursorY to:SCROLL_BOTTOM by:n];
     }
     if (n + cursorY > SCROLL_BOTTOM) {
         n = SCROLL_BOTTOM - cursorY + 1;
@@ -3072,22 +3606,38 @@ void DumpBuf(screen_char_t* p, int n) {
 
 - (void)clearTabStop
 {
-    [tabStops removeAllObjects];
+    if (tabStops) {
+        memset(tabStops, 0, tabStopWords * sizeof(uint64_t));
+    }
 }
 
 - (BOOL)haveTabStopAt:(int)x
 {
-    return [tabStops containsObject:[NSNumber numberWithInt:x]];
+    if (x < 0 || x >= tabStopWords * 64) {
+        return NO;
+    }
+    return (tabStops[x >> 6] >> (x & 63)) & 1;
 }
 
 - (void)setTabStopAt:(int)x
 {
-    [tabStops addObject:[NSNumber numberWithInt:x]];
+    if (x < 0) {
+        return;
+    }
+    if (x >= tabStopWords * 64) {
+        int words = (x >> 6) + 1;
+        tabStops = (uint64_t *)realloc(tabStops, words * sizeof(uint64_t));
+        memset(tabStops + tabStopWords, 0, (words - tabStopWords) * sizeof(uint64_t));
+        tabStopWords = words;
+    }
+    tabStops[x >> 6] |= 1ULL << (x & 63);
 }
 
 - (void)removeTabStopAt:(int)x
 {
-    [tabStops removeObject:[NSNumber numberWithInt:x]];
+    if (x >= 0 && x < tabStopWords * 64) {
+        tabStops[x >> 6] &= ~(1ULL << (x & 63));
+    }
 }
 
 - (int)numberOfScrollbackLines
@@ -3095,6 +3645,14 @@ void DumpBuf(screen_char_t* p, int n) {
     return [linebuffer numLinesWithWidth: WIDTH];
 }
 
+- (BOOL)continueReflow
+{
+    // Blocks hold a couple hundred lines each, so this is a few thousand lines
+    // per call.
+    const int kReflowBlocksPerStep = 16;
+    return [linebuffer reflowBlocks:kReflowBlocksPerStep withWidth:WIDTH];
+}
+
 - (int)numberOfLines
 {
     return [linebuffer numLinesWithWidth: WIDTH] + HEIGHT;
@@ -3113,15 +3671,21 @@ void DumpBuf(screen_char_t* p, int n) {
 - (void)resetDirty
 {
     DebugLog(@"resetDirty");
-    assert(dirtySize == WIDTH*HEIGHT);
-    assert(dirty[dirtySize] == DIRTY_MAGIC);
-    memset(dirty, 0, dirtySize*sizeof(char));
-    assert(dirty[dirtySize] == DIRTY_MAGIC);
+    // Only cells inside a dirty span can be set.
+    for (int i = 0; i < HEIGHT; i++) {
+        if (dirtyLines[i].flags) {
+            memset(dirtyCells + i * WIDTH + dirtyLines[i].start, 0,
+                   (dirtyLines[i].end - dirtyLines[i].start) * sizeof(char));
+        }
+    }
+    memset(dirtyLines, 0, HEIGHT * sizeof(screen_line_dirty_t));
     DebugLog(@"resetDirty");
 }
 
 - (void)setDirty
 {
+    // Callers change lines without marking them, so none can be reused.
+    [self _forgetSnapshotRows];
     [self resetScrollbackOverflow];
     [display deselect];
     [display setNeedsDisplay:YES];
@@ -3401,11 +3965,22 @@ void DumpBuf(screen_char_t* p, int n) {
     info.cursorY = cursorY;
     info.height = HEIGHT;
     info.width = WIDTH;
-    info.topOffset = screen_top - buffer_lines;
-
-    [dvr appendFrame:(char*)buffer_lines
-              length:sizeof(screen_char_t) * REAL_WIDTH * HEIGHT
+    info.topOffset = 0;
+
+    // Frames store the lines in screen order. They're read from a snapshot so
+    // that a DEBUG_SNAPSHOT build checks every frame for stale rows.
+    VT100ScreenSnapshot *snapshot = [self snapshot];
+    const int length = sizeof(screen_char_t) * REAL_WIDTH * HEIGHT;
+    screen_char_t *frame = (screen_char_t *)malloc(length);
+    for (int y = 0; y < HEIGHT; y++) {
+        memcpy(frame + y * REAL_WIDTH,
+               [snapshot lineAtIndex:y],
+               REAL_WIDTH * sizeof(screen_char_t));
+    }
+    [dvr appendFrame:(char*)frame
+              length:length
                 info:&info];
+    free(frame);
 }
 
 - (void)disableDvr
@@ -3419,7 +3994,10 @@ void DumpBuf(screen_char_t* p, int n) {
     int yo = 0;
     if (info.width == WIDTH && info.height == HEIGHT) {
         memcpy(buffer_lines, s, len);
-        screen_top = buffer_lines + info.topOffset;
+        for (int y = 0; y < HEIGHT; y++) {
+            lineRows[y] = (info.topOffset / REAL_WIDTH + y) % HEIGHT;
+        }
+        topRow = 0;
         [self setDirty];
     } else {
         yo = info.height - HEIGHT;
@@ -3441,7 +4019,10 @@ void DumpBuf(screen_char_t* p, int n) {
             truncateHistoryLines = info.height - HEIGHT;
         }
 
-        screen_top = buffer_lines;
+        for (int y = 0; y < HEIGHT; ++y) {
+            lineRows[y] = y;
+        }
+        topRow = 0;
         for (int y = 0; y < HEIGHT && y < info.height; ++y) {
             lineOut = buffer_lines + y * REAL_WIDTH;
             lineIn = s + ((info.topOffset + (truncateHistoryLines + y) * (info.width + 1)) % (len / sizeof(screen_char_t)));
@@ -3490,29 +4071,95 @@ void DumpBuf(screen_char_t* p, int n) {
     return dvr;
 }
 
+- (VT100ScreenSnapshot *)snapshot
+{
+    screen_snapshot_line_t **lines =
+        (screen_snapshot_line_t **)malloc(HEIGHT * sizeof(screen_snapshot_line_t *));
+    for (int y = 0; y < HEIGHT; y++) {
+        int row = [self _rowOfScreenLine:y];
+        if (!snapshotRows[row]) {
+            screen_snapshot_line_t *line =
+                (screen_snapshot_line_t *)malloc(sizeof(screen_snapshot_line_t) +
+                                                 REAL_WIDTH * sizeof(screen_char_t));
+            line->refCount = 1;
+            memcpy(line->chars,
+                   buffer_lines + row * REAL_WIDTH,
+                   REAL_WIDTH * sizeof(screen_char_t));
+            snapshotRows[row] = line;
+        }
+#ifdef DEBUG_SNAPSHOT
+        // A kept line that differs from the screen means some change didn't
+        // mark its row dirty.
+        NSAssert(!memcmp(snapshotRows[row]->chars,
+                         buffer_lines + row * REAL_WIDTH,
+                         REAL_WIDTH * sizeof(screen_char_t)),
+                 @"Stale snapshot of line %d", y);
+#endif
+        RetainSnapshotLine(snapshotRows[row]);
+        lines[y] = snapshotRows[row];
+    }
+    return [[[VT100ScreenSnapshot alloc] initWithWidth:WIDTH
+                                                height:HEIGHT
+                                               cursorX:cursorX
+                                               cursorY:cursorY
+                                                 lines:lines] autorelease];
+}
 
 @end
 
 @implementation VT100Screen (Private)
 
-// gets line offset by specified index from specified line poiner; accounts for buffer wrap
-- (screen_char_t *)_getLineAtIndex:(int)anIndex fromLine:(screen_char_t *)aLine
+// Releases every line kept for the next snapshot.
+- (void)_forgetSnapshotRows
 {
-    screen_char_t *the_line = NULL;
+    if (!snapshotRows) {
+        return;
+    }
+    for (int i = 0; i < HEIGHT; i++) {
+        ReleaseSnapshotLine(&snapshotRows[i]);
+    }
+}
 
-    NSParameterAssert(anIndex >= 0);
+// EOL codes aren't drawn, so setting one doesn't make the line dirty for the
+// display, but the next snapshot must still copy it.
+- (void)_setEOL:(int)code ofScreenLine:(int)y
+{
+    [self getLineAtScreenIndex:y][WIDTH].code = code;
+    ReleaseSnapshotLine(&snapshotRows[[self _rowOfScreenLine:y]]);
+}
 
-    // get the line offset from the specified line
-    the_line = aLine + anIndex*REAL_WIDTH;
+// Returns the row in buffer_lines that holds screen line y.
+- (int)_rowOfScreenLine:(int)y
+{
+    NSParameterAssert(y >= 0);
+    NSAssert(y < HEIGHT, @"out of range.");
 
-    // check if we have gone beyond our buffer; if so, we need to wrap around to the top of buffer
-    if( the_line >= buffer_lines + REAL_WIDTH*HEIGHT)
-    {
-        the_line -= REAL_WIDTH * HEIGHT;
-        NSAssert(the_line >= buffer_lines && the_line < buffer_lines + REAL_WIDTH*HEIGHT, @"out of range.");
+    int slot = topRow + y;
+    if (slot >= HEIGHT) {
+        slot -= HEIGHT;
     }
+    return lineRows[slot];
+}
 
-    return (the_line);
+// Rotates screen lines top...bottom (inclusive) up by n lines, or down if n is
+// negative. Lines pushed out of one end come back in at the other. Only the
+// entries in lineRows move; the caller clears whichever lines it needs to.
+- (void)_rotateLinesFrom:(int)top to:(int)bottom by:(int)n
+{
+    const int count = bottom - top + 1;
+    if (count < 2) {
+        return;
+    }
+    n %= count;
+    if (n < 0) {
+        n += count;
+    }
+    if (n == 0) {
+        return;
+    }
+    ReverseLineRows(lineRows, topRow, HEIGHT, top, top + n - 1);
+    ReverseLineRows(lineRows, topRow, HEIGHT, top + n, bottom);
+    ReverseLineRows(lineRows, topRow, HEIGHT, top, bottom);
 }
 
 // returns a line set to default character and attributes
@@ -3555,20 +4202,21 @@ void DumpBuf(screen_char_t* p, int n) {
 {
     // There was an experiment to try not saving lines to scrollback when in alternate screen mode.
     // It failed because it broke screen (see bug 1034).
+    screen_char_t *topLine = [self getLineAtScreenIndex:0];
     int len = WIDTH;
-    if (screen_top[WIDTH].code == EOL_HARD) {
+    if (topLine[WIDTH].code == EOL_HARD) {
         // The line is not continued. Figure out its length by finding the last nonnull char.
-        while (len > 0 && (screen_top[len - 1].code == 0)) {
-            assert(screen_top[len - 1].code != DWC_SKIP); // Impossible to have a dwc skip here.
+        while (len > 0 && (topLine[len - 1].code == 0)) {
+            assert(topLine[len - 1].code != DWC_SKIP); // Impossible to have a dwc skip here.
             --len;
         }
     }
-    if (screen_top[WIDTH].code == EOL_DWC && len == WIDTH) {
+    if (topLine[WIDTH].code == EOL_DWC && len == WIDTH) {
         --len;
     }
-    [linebuffer appendLine:screen_top length:len partial:(screen_top[WIDTH].code != EOL_HARD) width:WIDTH];
+    [linebuffer appendLine:topLine length:len partial:(topLine[WIDTH].code != EOL_HARD) width:WIDTH];
     int dropped;
-    if (!unlimitedScrollback_) {
+    if (!unlimitedScrollback_ && !deferScrollbackTrim_) {
         dropped = [linebuffer dropExcessLinesWithWidth: WIDTH];
     } else {
         dropped = 0;
@@ -3584,7 +4232,7 @@ void DumpBuf(screen_char_t* p, int n) {
     [self clearTabStop];
     const int kInitialTabWindow = 1000;
     for (int i = 0; i < kInitialTabWindow; i += TABSIZE) {
-        [tabStops addObject:[NSNumber numberWithInt:i]];
+        [self setTabStopAt:i];
     }
 }
 
@@ -36,6 +36,9 @@
 #import "PTYTab.h"
 #import "PseudoTerminal.h"
 #import "WindowControllerInterface.h"
+#import "AsciiScan.h"
+#import "Utf8Scan.h"
+#import "DoubleByteTable.h"
 #include <term.h>
 #include <wchar.h>
 
@@ -133,30 +136,20 @@
 
 #define conststr_sizeof(n)   ((sizeof(n)) - 1)
 
-
-typedef struct {
-    int p[VT100CSIPARAM_MAX];
-    int count;
-    int cmd;
-    BOOL question;
-    int modifier;
-} CSIParam;
-
 // functions
 static BOOL isCSI(unsigned char *, size_t);
 static BOOL isXTERM(unsigned char *, size_t);
 static BOOL isString(unsigned char *, NSStringEncoding);
-static size_t getCSIParam(unsigned char *, size_t, CSIParam *, VT100Screen *);
-static VT100TCC decode_csi(unsigned char *, size_t, size_t *,VT100Screen *);
-static VT100TCC decode_xterm(unsigned char *, size_t, size_t *,NSStringEncoding);
+static VT100TCC decode_csi(CSIParam *);
+static VT100TCC decode_xterm(VT100Parser *, unsigned char *, NSStringEncoding);
 static VT100TCC decode_other(unsigned char *, size_t, size_t *);
-static VT100TCC decode_control(unsigned char *, size_t, size_t *,NSStringEncoding,VT100Screen *);
+static VT100TCC decode_control(unsigned char *, size_t, size_t *,NSStringEncoding,VT100Parser *);
 static int decode_utf8_char(unsigned char *, size_t, unsigned int *);
 static VT100TCC decode_utf8(unsigned char *, size_t, size_t *);
 static VT100TCC decode_euccn(unsigned char *, size_t, size_t *);
 static VT100TCC decode_big5(unsigned char *,size_t, size_t *);
 static VT100TCC decode_string(unsigned char *, size_t, size_t *,
-                              NSStringEncoding);
+                              NSStringEncoding, const uint16_t *);
 
 static BOOL isCSI(unsigned char *code, size_t len)
 {
@@ -211,192 +204,26 @@ static BOOL isString(unsigned char *code,
     return result;
 }
 
-static size_t getCSIParam(unsigned char *datap,
-                          size_t datalen,
-                          CSIParam *param, VT100Screen *SCREEN)
-{
-    int i;
-    BOOL unrecognized=NO;
-    unsigned char *orgp = datap;
-    BOOL readNumericParameter = NO;
-
-    NSCParameterAssert(datap != NULL);
-    NSCParameterAssert(datalen >= 2);
-    NSCParameterAssert(param != NULL);
-
-    param->count = 0;
-    param->cmd = 0;
-    for (i = 0; i < VT100CSIPARAM_MAX; ++i )
-        param->p[i] = -1;
-
-    NSCParameterAssert(datap[0] == ESC);
-    NSCParameterAssert(datap[1] == '[');
-    datap += 2;
-    datalen -= 2;
-
-    if (datalen > 0 && *datap == '?') {
-        param->question = YES;
-        datap ++;
-        datalen --;
-    }
-    // check for secondsry device attribute modifier
-    else if (datalen > 0 && *datap == '>')
-    {
-        param->modifier = '>';
-        param->question = NO;
-        datap++;
-        datalen--;
-    }
-    else
-        param->question = NO;
-
-
-    while (datalen > 0) {
-
-        if (isdigit(*datap)) {
-            int n = *datap - '0';
-            datap++;
-            datalen--;
-
-            while (datalen > 0 && isdigit(*datap)) {
-                n = n * 10 + *datap - '0';
-
-                datap++;
-                datalen--;
-            }
-            //if (param->count == 0 )
-            //param->count = 1;
-            //param->p[param->count - 1] = n;
-            if(param->count < VT100CSIPARAM_MAX)
-                param->p[param->count] = n;
-            // increment the parameter count
-            param->count++;
-
-            // set the numeric parameter flag
-            readNumericParameter = YES;
-
-        }
-        else if (*datap == ';') {
-            datap++;
-            datalen--;
-
-            // If we got an implied (blank) parameter, increment the parameter count again
-            if(readNumericParameter == NO)
-                param->count++;
-            // reset the parameter flag
-            readNumericParameter = NO;
-
-            if (param->count >= VT100CSIPARAM_MAX) {
-                // broken
-                //param->cmd = 0xff;
-                unrecognized=YES;
-                //break;
-            }
-        }
-        else if (isalpha(*datap)||*datap=='@') {
-            datalen--;
-            param->cmd = unrecognized?0xff:*datap;
-            datap++;
-            break;
-        }
-        else if (*datap=='\'') {
-            datap++;
-            datalen--;
-            switch (*datap) {
-                case 'z':
-                case '|':
-                case 'w':
-                    //NSLog(@"Unsupported locator sequence");
-                    param->cmd=0xff;
-                    datap++;
-                    datalen--;
-                    break;
-                default:
-                    //NSLog(@"Unrecognized locator sequence");
-                    datap++;
-                    datalen--;
-                    param->cmd=0xff;
-                    break;
-            }
-            break;
-        }
-        else if (*datap=='&') {
-            datap++;
-            datalen--;
-            switch (*datap) {
-                case 'w':
-                    //NSLog(@"Unsupported locator sequence");
-                    param->cmd=0xff;
-                    datap++;
-                    datalen--;
-                    break;
-                default:
-                    //NSLog(@"Unrecognized locator sequence");
-                    datap++;
-                    datalen--;
-                    param->cmd=0xff;
-                    break;
-            }
-            break;
-        }
-        else {
-            switch (*datap) {
-                case VT100CC_ENQ: break;
-                case VT100CC_BEL: [SCREEN activateBell]; break;
-                case VT100CC_BS:  [SCREEN backSpace]; break;
-                case VT100CC_HT:  [SCREEN setTab]; break;
-                case VT100CC_LF:
-                case VT100CC_VT:
-                case VT100CC_FF:  [SCREEN setNewLine]; break;
-                case VT100CC_CR:  [SCREEN cursorToX:1 Y:[SCREEN cursorY]]; break;
-                case VT100CC_SO:  break;
-                case VT100CC_SI:  break;
-                case VT100CC_DC1: break;
-                case VT100CC_DC3: break;
-                case VT100CC_CAN:
-                case VT100CC_SUB: break;
-                case VT100CC_DEL: [SCREEN deleteCharacters:1];break;
-                default:
-                    //NSLog(@"Unrecognized escape sequence: %c (0x%x)", *datap, *datap);
-                    param->cmd=0xff;
-                    unrecognized=YES;
-                    break;
-            }
-            if(unrecognized == NO)
-            {
-                datalen--;
-                datap++;
-            }
-        }
-        if (unrecognized) break;
-    }
-    return datap - orgp;
-}
-
 #define SET_PARAM_DEFAULT(pm,n,d) \
 (((pm).p[(n)] = (pm).p[(n)] < 0 ? (d):(pm).p[(n)]), \
  ((pm).count  = (pm).count > (n) + 1 ? (pm).count : (n) + 1 ))
 
-static VT100TCC decode_csi(unsigned char *datap,
-                           size_t datalen,
-                           size_t *rmlen,VT100Screen *SCREEN)
+// Builds the token for a CSI sequence that the parser has finished.
+static VT100TCC decode_csi(CSIParam *csi)
 {
     VT100TCC result;
-    CSIParam param={{0},0};
-    size_t paramlen;
+    CSIParam param = *csi;
     int i;
 
-    paramlen = getCSIParam(datap, datalen, &param, SCREEN);
     result.type = VT100_WAIT;
 
     // Check for unkown
     if(param.cmd == 0xff)
     {
         result.type = VT100_UNKNOWNCHAR;
-        *rmlen = paramlen;
     }
     // process
-    else if (paramlen > 0 && param.cmd > 0) {
+    else if (param.cmd > 0) {
         if (!param.question) {
             switch (param.cmd) {
                 case 'D':       // Cursor Backward
@@ -445,7 +272,10 @@ static VT100TCC decode_csi(unsigned char *datap,
                 case 'r':
                     result.type = VT100CSI_DECSTBM;
                     SET_PARAM_DEFAULT(param, 0, 1);
-                    SET_PARAM_DEFAULT(param, 1, [SCREEN height]);
+                    // 0 means the bottom of the screen. It's resolved when the
+                    // token is applied, since the screen may be resized
+                    // between parsing and then.
+                    SET_PARAM_DEFAULT(param, 1, 0);
                     break;
 
                 case 'y':
@@ -624,7 +454,7 @@ static VT100TCC decode_csi(unsigned char *datap,
                     break;
                 default:
 #if LOG_UNKNOWN
-                    NSLog(@"2: Unknown token (%c); %s", param.cmd, datap);
+                    NSLog(@"2: Unknown token (%c)", param.cmd);
 #endif
                     result.type = VT100_NOTSUPPORT;
                     break;
@@ -656,152 +486,67 @@ static VT100TCC decode_csi(unsigned char *datap,
         result.u.csi.count = param.count;
         result.u.csi.question = param.question;
         result.u.csi.modifier = param.modifier;
-
-        *rmlen = paramlen;
     }
 
     return result;
 }
 
 
-static VT100TCC decode_xterm(unsigned char *datap,
-                             size_t datalen,
-                             size_t *rmlen,
+// Builds the token for an OSC sequence that the parser has finished.
+static VT100TCC decode_xterm(VT100Parser *parser,
+                             unsigned char *datap,
                              NSStringEncoding enc)
 {
 #define MAX_BUFFER_LENGTH 1024
-    int mode=0;
     VT100TCC result;
-    NSData *data;
-    BOOL unrecognized=NO;
-    char s[MAX_BUFFER_LENGTH]={0}, *c=nil;
 
-    NSCParameterAssert(datap != NULL);
-    NSCParameterAssert(datalen >= 2);
-    NSCParameterAssert(datap[0] == ESC);
-    NSCParameterAssert(datap[1] == ']');
-    datap += 2;
-    datalen -= 2;
-    *rmlen=2;
-
-    if (datalen > 0 && isdigit(*datap)) {
-        // read an integer from datap and store it in mode.
-        int n = *datap++ - '0';
-        datalen--;
-        (*rmlen)++;
-        while (datalen > 0 && isdigit(*datap)) {
-            n = n * 10 + *datap - '0';
-
-            (*rmlen)++;
-            datap++;
-            datalen--;
-        }
-        mode = n;
-    }
-    if (datalen > 0) {
-        if (*datap != ';' && *datap != 'P') {
-            unrecognized=YES;
-        } else {
-            if (*datap == 'P') {
-                mode = -1;
-            }
-            BOOL str_end = NO;
-            c=s;
-            datalen--;
-            datap++;
-            (*rmlen)++;
-            // Search for the end of a ^G/ST terminated string (but see the note below about other ways to terminate it).
-            while (*datap != 7 && datalen > 0) {
-                // Technically, only ^G or esc + \ ought to terminate a string. But sometimes an application is buggy and it forgets to terminate it.
-                // xterm has a very complicated state machine that determines when a string is terminated. Effectively, it allows you to terminate
-                // an OSC with ESC + anything except ], 0x9d, and 0xdd. Other bogus values may do strange things in xterm.
-                if (*datap == 0x1b &&  // 0x1b == ESC
-                    datalen > 2 &&
-                    (*(datap+1) != ']' &&
-                     *(datap+1) != 0x9d &&
-                     *(datap+1) != 0xdd)) {
-                    // Esc+backslash (called ST in the spec), or equivalent
-                    datap++;
-                    datalen--;
-                    (*rmlen)++;
-                    str_end=YES;
-                    break;
-                }
-                if (c - s < MAX_BUFFER_LENGTH) {
-                    *c=*datap;
-                    c++;
-                }
-                datalen--;
-                datap++;
-                (*rmlen)++;
-            }
-            if ((*datap != 0x007 && !str_end) || datalen==0) {
-                if (datalen>0) unrecognized=YES;
-                else {
-                    *rmlen=0;
-                }
-            }
-            else {
-                *datap++;
-                datalen--;
-                (*rmlen)++;
-            }
-        }
-    }
-    else {
-        *rmlen=0;
-    }
-
-    if (unrecognized) {
+    if (parser->oscMode == -2) {
         //NSLog(@"invalid: %d",*rmlen);
         result.type = VT100_NOTSUPPORT;
-        *rmlen = 2;
-    }
-    else if (!(*rmlen)) {
-        result.type = VT100_WAIT;
-    }
-    else {
-        data = [NSData dataWithBytes:s length:c-s];
-        result.u.string = [[[NSString alloc] initWithData:data
-                                                 encoding:enc] autorelease];
-        switch (mode) {
-            case -1:
-                // Nonstandard Linux OSC P nrrggbb ST to change color palette
-                // entry.
-                result.type = XTERMCC_SET_PALETTE;
-                break;
-            case 0:
-                result.type = XTERMCC_WINICON_TITLE;
-                break;
-            case 1:
-                result.type = XTERMCC_ICON_TITLE;
-                break;
-            case 2:
-                result.type = XTERMCC_WIN_TITLE;
-                break;
-            case 4:
-                result.type = XTERMCC_SET_RGB;
-                break;
-            case 6:
-                // This is not a real xterm code. It is from eTerm, which extended the xterm
-                // protocol for its own purposes. We don't follow the eTerm protocol,
-                // but we follow the template it set.
-                // http://www.eterm.org/docs/view.php?doc=ref#escape
-                result.type = XTERMCC_PROPRIETARY_ETERM_EXT;
-                break;
-            case 9:
-                result.type = ITERM_GROWL;
-                break;
-            case 50:
-                // Nonstandard escape code implemented by Konsole.
-                // <Esc>]50;key=value^G
-                result.type = XTERMCC_SET_KVP;
-                break;
-            default:
-                result.type = VT100_NOTSUPPORT;
-                break;
-        }
-        //        NSLog(@"result: %d[%@],%d",result.type,result.u.string,*rmlen);
+        return result;
+    }
+
+    size_t length = MIN(parser->oscStringEnd - parser->oscStringStart,
+                        MAX_BUFFER_LENGTH);
+    result.u.string = [[[NSString alloc] initWithBytes:datap + parser->oscStringStart
+                                                length:length
+                                              encoding:enc] autorelease];
+    switch (parser->oscMode) {
+        case -1:
+            // Nonstandard Linux OSC P nrrggbb ST to change color palette
+            // entry.
+            result.type = XTERMCC_SET_PALETTE;
+            break;
+        case 0:
+            result.type = XTERMCC_WINICON_TITLE;
+            break;
+        case 1:
+            result.type = XTERMCC_ICON_TITLE;
+            break;
+        case 2:
+            result.type = XTERMCC_WIN_TITLE;
+            break;
+        case 4:
+            result.type = XTERMCC_SET_RGB;
+            break;
+        case 6:
+            // This is not a real xterm code. It is from eTerm, which extended the xterm
+            // protocol for its own purposes. We don't follow the eTerm protocol,
+            // but we follow the template it set.
+            // http://www.eterm.org/docs/view.php?doc=ref#escape
+            result.type = XTERMCC_PROPRIETARY_ETERM_EXT;
+            break;
+        case 9:
+            result.type = ITERM_GROWL;
+            break;
+        case 50:
+            // Nonstandard escape code implemented by Konsole.
+            // <Esc>]50;key=value^G
+            result.type = XTERMCC_SET_KVP;
+            break;
+        default:
+            result.type = VT100_NOTSUPPORT;
+            break;
     }
 
     return result;
@@ -965,15 +710,41 @@ static VT100TCC decode_other(unsigned char *datap,
 static VT100TCC decode_control(unsigned char *datap,
                                size_t datalen,
                                size_t *rmlen,
-                               NSStringEncoding enc, VT100Screen *SCREEN)
+                               NSStringEncoding enc,
+                               VT100Parser *parser)
 {
     VT100TCC result;
 
-    if (isCSI(datap, datalen)) {
-        result = decode_csi(datap, datalen, rmlen, SCREEN);
+    if (parser->state == VT100_PARSE_GROUND) {
+        if (isCSI(datap, datalen)) {
+            VT100ParserBeginCSI(parser);
+        } else if (isXTERM(datap, datalen)) {
+            VT100ParserBeginOSC(parser);
+        }
     }
-    else if (isXTERM(datap,datalen)) {
-        result = decode_xterm(datap,datalen,rmlen,enc);
+
+    if (parser->state != VT100_PARSE_GROUND) {
+        // Resume a CSI or OSC sequence where the last call left off.
+        BOOL isOSC = (parser->state == VT100_PARSE_OSC_MODE ||
+                      parser->state == VT100_PARSE_OSC_STRING);
+        BOOL done = parser->complete ||
+                    (isOSC ? VT100ParserAdvanceOSC(parser, datap, datalen)
+                           : VT100ParserAdvanceCSI(parser, datap, datalen));
+        if (parser->nextControl < parser->numControls) {
+            // Return the controls found inside the sequence one at a time
+            // without consuming any input, then the sequence itself once it
+            // is complete.
+            parser->complete = done;
+            result.type = parser->controls[parser->nextControl++];
+            *rmlen = 0;
+        } else if (!done) {
+            result.type = VT100_WAIT;
+        } else {
+            result = isOSC ? decode_xterm(parser, datap, enc)
+                           : decode_csi(&parser->csi);
+            *rmlen = parser->consumed;
+            VT100ParserReset(parser);
+        }
     }
     else {
         NSCParameterAssert(datalen > 0);
@@ -1080,48 +851,34 @@ static VT100TCC decode_utf8(unsigned char *datap,
                             size_t *rmlen)
 {
     VT100TCC result;
-    unsigned char *p = datap;
-    size_t len = datalen;
     int utf8DecodeResult;
     unsigned int theChar = 0;
-
-    while (true) {
-        utf8DecodeResult = decode_utf8_char(p, len, &theChar);
-        // Stop on error or end of stream.
-        if (utf8DecodeResult <= 0) {
-            break;
-        }
-        // Intentionally break out at ASCII characters. They are
-        // processed separately, e.g. they might get converted into
-        // line drawing characters.
-        if (theChar < 0x80) {
-            break;
-        }
-        // Reject UTF-16 surrogates. They are invalid Unicode codepoints,
-        // and NSString initWithBytes fails on them.
-        // Reject characters above U+10FFFF. NSString uses UTF-16
-        // internally, so it cannot handle higher codepoints.
-        if ((theChar >= 0xD800 && theChar <= 0xDFFF) || theChar > 0x10FFFF) {
-            utf8DecodeResult = -utf8DecodeResult;
-            break;
-        }
-        p += utf8DecodeResult;
-        len -= utf8DecodeResult;
+    int simple;
+    size_t length;
+
+    // Intentionally stops at ASCII characters. They are processed
+    // separately, e.g. they might get converted into line drawing
+    // characters.
+    length = Utf8ValidRunLength(datap, datalen, &simple);
+    if (length > 0) {
+        // If some characters were successfully decoded, just return them
+        // and ignore the error or end of stream for now. A run that needs no
+        // normalization is left in the stream for VT100Screen to decode.
+        *rmlen = length;
+        result.type = simple ? VT100_UTF8STRING : VT100_STRING;
+        return result;
     }
 
-    if (p > datap) {
-        // If some characters were successfully decoded, just return them
-        // and ignore the error or end of stream for now.
-        *rmlen = p - datap;
-        result.type = VT100_STRING;
+    // Report error or waiting state.
+    utf8DecodeResult = decode_utf8_char(datap, datalen, &theChar);
+    if (utf8DecodeResult == 0) {
+        result.type = VT100_WAIT;
     } else {
-        // Report error or waiting state.
-        if (utf8DecodeResult == 0) {
-            result.type = VT100_WAIT;
-        } else {
-            *rmlen = -utf8DecodeResult;
-            result.type = VT100_INVALID_SEQUENCE;
-        }
+        // Either a malformed sequence, or a well-formed one for a UTF-16
+        // surrogate or a character above U+10FFFF. NSString uses UTF-16
+        // internally so it can't handle those.
+        *rmlen = abs(utf8DecodeResult);
+        result.type = VT100_INVALID_SEQUENCE;
     }
     return result;
 }
@@ -1330,17 +1087,8 @@ static VT100TCC decode_ascii_string(unsigned char *datap,
                                  size_t *rmlen)
 {
     VT100TCC result;
-    unsigned char *p = datap;
-    size_t len = datalen;
+    size_t len = datalen - AsciiRunLength(datap, datalen);
 
-    while (len > 0) {
-        if (*p >= 0x20 && *p <= 0x7f) {
-            p++;
-            len--;
-        } else {
-          break;
-        }
-    }
     if (len == datalen) {
         *rmlen = 0;
         result.type = VT100_WAIT;
@@ -1349,19 +1097,7 @@ static VT100TCC decode_ascii_string(unsigned char *datap,
         result.type = VT100_ASCIISTRING;
     }
 
-    result.u.string =[[[NSString alloc]
-                                   initWithBytes:datap
-                                          length:*rmlen
-                                        encoding:NSASCIIStringEncoding]
-        autorelease];
-
-    if (result.u.string==nil) {
-        *rmlen = 0;
-        result.type = VT100_UNKNOWNCHAR;
-        result.u.code = datap[0];
-    }
-
-
+    // The text is left in the stream for VT100Screen to copy from.
     return result;
 }
 
@@ -1387,7 +1123,8 @@ static NSString* SetReplacementCharInArray(unsigned char* datap, int* lenPtr, in
 static VT100TCC decode_string(unsigned char *datap,
                               size_t datalen,
                               size_t *rmlen,
-                              NSStringEncoding encoding)
+                              NSStringEncoding encoding,
+                              const uint16_t *table)
 {
     VT100TCC result;
 
@@ -1395,6 +1132,18 @@ static VT100TCC decode_string(unsigned char *datap,
     result.type = VT100_UNKNOWNCHAR;
     result.u.code = datap[0];
 
+    if (table) {
+        // A legacy CJK encoding. Whatever the table covers is decoded later
+        // by VT100Screen without an NSString.
+        size_t length = DoubleByteRunLength(table, datap, datalen);
+        if (length > 0) {
+            result.type = VT100_DOUBLEBYTESTRING;
+            result.u.table = table;
+            *rmlen = length;
+            return result;
+        }
+    }
+
     //    NSLog(@"data: %@",[NSData dataWithBytes:datap length:datalen]);
     if (encoding == NSUTF8StringEncoding) {
         result = decode_utf8(datap, datalen, rmlen);
@@ -1429,7 +1178,7 @@ static VT100TCC decode_string(unsigned char *datap,
         datap[0] = ONECHAR_UNKNOWN;
         result.u.string = ReplacementString();
         result.type = VT100_STRING;
-    } else if (result.type != VT100_WAIT) {
+    } else if (result.type != VT100_WAIT && result.type != VT100_UTF8STRING) {
         /*data = [NSData dataWithBytes:datap length:*rmlen];
         result.u.string = [[[NSString alloc]
                                    initWithData:data
@@ -1480,6 +1229,7 @@ static VT100TCC decode_string(unsigned char *datap,
     total_stream_length = STANDARD_STREAM_SIZE;
     STREAM = malloc(total_stream_length);
     current_stream_length = 0;
+    VT100ParserReset(&parser);
 
     termType = nil;
     for(i = 0; i < TERMINFO_KEYS; i ++) {
@@ -1701,26 +1451,54 @@ static VT100TCC decode_string(unsigned char *datap,
 - (void)setEncoding:(NSStringEncoding)encoding
 {
     ENCODING = encoding;
+    if (isGBEncoding(encoding) ||
+        isBig5Encoding(encoding) ||
+        isJPEncoding(encoding) ||
+        isSJISEncoding(encoding) ||
+        isKREncoding(encoding)) {
+        doubleByteTable = DoubleByteTableForEncoding(encoding);
+    } else {
+        doubleByteTable = NULL;
+    }
 }
 
 - (void)cleanStream
 {
     current_stream_length = 0;
+    VT100ParserReset(&parser);
 }
 
-- (void)putStreamData:(NSData*)data
+- (unsigned char *)streamBufferWithSpace:(int)length
 {
-    if (current_stream_length + [data length] > total_stream_length) {
-        int n = ([data length] + current_stream_length) / STANDARD_STREAM_SIZE;
+    if (streamOffset > 0) {
+        // Slide the unparsed tail (usually nothing, or part of one escape
+        // sequence) to the front so the buffer can be reused in place.
+        current_stream_length -= streamOffset;
+        memmove(STREAM, STREAM + streamOffset, current_stream_length);
+        streamOffset = 0;
+    }
+    if (current_stream_length + length > total_stream_length) {
+        // Only happens for a huge incomplete token, such as an unterminated
+        // OSC string.
+        int n = (length + current_stream_length) / STANDARD_STREAM_SIZE;
 
         total_stream_length += n*STANDARD_STREAM_SIZE;
         STREAM = reallocf(STREAM, total_stream_length);
     }
+    return STREAM + current_stream_length;
+}
 
-    memcpy(STREAM+current_stream_length, [data bytes], [data length]);
-    current_stream_length += [data length];
-    if(current_stream_length == 0)
-        streamOffset = 0;
+- (void)appendStreamLength:(int)length
+{
+    NSParameterAssert(current_stream_length + length <= total_stream_length);
+    current_stream_length += length;
+}
+
+- (void)putStreamData:(NSData*)data
+{
+    int length = [data length];
+    memcpy([self streamBufferWithSpace:length], [data bytes], length);
+    [self appendStreamLength:length];
 }
 
 - (VT100TCC)getNextToken
@@ -1758,16 +1536,14 @@ static VT100TCC decode_string(unsigned char *datap,
             result.length = rmlen;
             result.position = datap;
         } else if (iscontrol(datap[0])) {
-            result = decode_control(datap, datalen, &rmlen, ENCODING, SCREEN);
+            result = decode_control(datap, datalen, &rmlen, ENCODING, &parser);
             result.length = rmlen;
             result.position = datap;
-            [self _setMode:result];
-            [self _setCharAttr:result];
-            [self _setRGB:result];
         } else {
             if (isString(datap, ENCODING)) {
                 // If the encoding is UTF-8 then you get here only if *datap >= 0x80.
-                result = decode_string(datap, datalen, &rmlen, ENCODING);
+                result = decode_string(datap, datalen, &rmlen, ENCODING,
+                                       doubleByteTable);
                 if (result.type != VT100_WAIT && rmlen == 0) {
                     result.type = VT100_UNKNOWNCHAR;
                     result.u.code = datap[0];
@@ -1829,6 +1605,103 @@ static VT100TCC decode_string(unsigned char *datap,
     return result;
 }
 
+- (int)getTokens:(VT100TCC *)tokens max:(int)maxTokens
+{
+    int n = 0;
+
+    if (current_stream_length == streamOffset) {
+        // Let getNextToken reset the stream.
+        [self getNextToken];
+        return 0;
+    }
+    while (n < maxTokens && current_stream_length > streamOffset) {
+        VT100TCC token = [self getNextToken];
+        if (token.type == VT100_WAIT || token.type == VT100CC_NULL) {
+            break;
+        }
+        tokens[n++] = token;
+    }
+    return n;
+}
+
+// Tokens whose u.string is set.
+static BOOL tokenHasString(VT100TCC token)
+{
+    switch (token.type) {
+        case VT100_STRING:
+        case XTERMCC_SET_PALETTE:
+        case XTERMCC_WINICON_TITLE:
+        case XTERMCC_ICON_TITLE:
+        case XTERMCC_WIN_TITLE:
+        case XTERMCC_SET_RGB:
+        case XTERMCC_PROPRIETARY_ETERM_EXT:
+        case ITERM_GROWL:
+        case XTERMCC_SET_KVP:
+            return YES;
+        default:
+            return NO;
+    }
+}
+
+void VT100TokenBatchClear(VT100TokenBatch *batch)
+{
+    int i;
+    for (i = 0; i < batch->count; i++) {
+        if (tokenHasString(batch->tokens[i])) {
+            [batch->tokens[i].u.string release];
+        }
+    }
+    batch->count = 0;
+    batch->length = 0;
+}
+
+void VT100TokenBatchFree(VT100TokenBatch *batch)
+{
+    if (batch) {
+        VT100TokenBatchClear(batch);
+        free(batch->bytes);
+        free(batch);
+    }
+}
+
+- (int)getTokenBatch:(VT100TokenBatch *)batch
+{
+    unsigned char *start = STREAM + streamOffset;
+    int n;
+    int i;
+
+    NSParameterAssert(batch->count == 0);
+    n = [self getTokens:batch->tokens max:VT100_TOKEN_BATCH_SIZE];
+    if (n == 0) {
+        return 0;
+    }
+
+    // Copy the bytes the tokens came from, which the stream is about to
+    // reuse, and point the tokens at the copy.
+    batch->length = (STREAM + streamOffset) - start;
+    if (batch->length > batch->capacity) {
+        batch->capacity = MAX(batch->length, 2 * batch->capacity);
+        batch->bytes = reallocf(batch->bytes, batch->capacity);
+    }
+    memcpy(batch->bytes, start, batch->length);
+    for (i = 0; i < n; i++) {
+        batch->tokens[i].position = batch->bytes + (batch->tokens[i].position - start);
+        if (tokenHasString(batch->tokens[i])) {
+            // The autorelease pool they're in belongs to this thread.
+            [batch->tokens[i].u.string retain];
+        }
+    }
+    batch->count = n;
+    return n;
+}
+
+- (void)updateStateForToken:(VT100TCC)token
+{
+    [self _setMode:token];
+    [self _setCharAttr:token];
+    [self _setRGB:token];
+}
+
 - (NSData *)specialKey:(int)terminfo cursorMod:(char*)cursorMod cursorSet:(char*)cursorSet cursorReset:(char*)cursorReset modflag:(unsigned int)modflag
 {
     NSData* prefix = nil;
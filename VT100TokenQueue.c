@@ -0,0 +1,90 @@
+/*
+ **  VT100TokenQueue.c
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Bounded single-producer, single-consumer queue. See
+ **    VT100TokenQueue.h.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "VT100TokenQueue.h"
+#include <stdlib.h>
+
+// Full memory barrier. head and tail only ever increase (modulo 2^32), and
+// each is written by just one thread, so ordering the slot access against
+// the index update is all the synchronization needed.
+#define BARRIER() __sync_synchronize()
+
+int VT100TokenQueueInit(VT100TokenQueue *queue, unsigned int capacity)
+{
+    unsigned int size = 1;
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+    queue->slots = (void **)calloc(size, sizeof(void *));
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    return queue->slots != NULL;
+}
+
+void VT100TokenQueueFree(VT100TokenQueue *queue)
+{
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+int VT100TokenQueueIsFull(VT100TokenQueue *queue)
+{
+    return queue->tail - queue->head > queue->mask;
+}
+
+int VT100TokenQueuePush(VT100TokenQueue *queue, void *item)
+{
+    unsigned int tail = queue->tail;
+
+    if (tail - queue->head > queue->mask) {
+        return 0;
+    }
+    queue->slots[tail & queue->mask] = item;
+    // Publish the item before the consumer can see the new tail.
+    BARRIER();
+    queue->tail = tail + 1;
+    return 1;
+}
+
+void *VT100TokenQueuePop(VT100TokenQueue *queue)
+{
+    unsigned int head = queue->head;
+    void *item;
+
+    if (head == queue->tail) {
+        return NULL;
+    }
+    // Don't read the slot before seeing the tail that published it.
+    BARRIER();
+    item = queue->slots[head & queue->mask];
+    // Finish reading the slot before the producer may reuse it.
+    BARRIER();
+    queue->head = head + 1;
+    return item;
+}
@@ -0,0 +1,69 @@
+// -*- mode:objc -*-
+/*
+ **  VT100TokenQueue.h
+ **
+ **  Copyright (c) 2011
+ **
+ **  Author: George Nachman
+ **
+ **  Project: iTerm2
+ **
+ **  Description: Bounded lock-free queue with a single producer thread and a
+ **    single consumer thread. PTYSession uses it to hand batches of parsed
+ **    tokens from the TaskNotifier thread to the main thread, and to hand
+ **    the emptied batches back. Plain C so it's part of the headless core.
+ **
+ **  This program is free software; you can redistribute it and/or modify
+ **  it under the terms of the GNU General Public License as published by
+ **  the Free Software Foundation; either version 2 of the License, or
+ **  (at your option) any later version.
+ **
+ **  This program is distributed in the hope that it will be useful,
+ **  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ **  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ **  GNU General Public License for more details.
+ **
+ **  You should have received a copy of the GNU General Public License
+ **  along with this program; if not, write to the Free Software
+ **  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VT100_TOKEN_QUEUE_H
+#define VT100_TOKEN_QUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    void **slots;
+    unsigned int mask;              // Number of slots minus one
+    volatile unsigned int head;     // Next slot to pop; written by the consumer
+    volatile unsigned int tail;     // Next slot to push; written by the producer
+} VT100TokenQueue;
+
+// Allocates room for |capacity| items, which is rounded up to a power of
+// two. Returns 0 if memory couldn't be allocated.
+int VT100TokenQueueInit(VT100TokenQueue *queue, unsigned int capacity);
+
+// Frees the slots, but not any items still in the queue.
+void VT100TokenQueueFree(VT100TokenQueue *queue);
+
+// Producer only. Adds |item|, which must not be NULL. Returns 0 without
+// adding it if the queue is full.
+int VT100TokenQueuePush(VT100TokenQueue *queue, void *item);
+
+// Producer only. Nonzero if a push would fail right now. The consumer may
+// make room at any moment, so this can be stale but never wrongly says
+// there is room.
+int VT100TokenQueueIsFull(VT100TokenQueue *queue);
+
+// Consumer only. Removes and returns the oldest item, or NULL if the queue
+// is empty.
+void *VT100TokenQueuePop(VT100TokenQueue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // VT100_TOKEN_QUEUE_H
@@ -41,6 +41,7 @@
 #import <BookmarksWindow.h>
 #import "PTYTab.h"
 #import "iTermExpose.h"
+#import "ReplayBenchmark.h"
 #include <unistd.h>
 
 static NSString *SCRIPT_DIRECTORY = @"~/Library/Application Support/iTerm/Scripts";
@@ -88,6 +89,16 @@ int gDebugLogFile = -1;
     [PreferencePanel migratePreferences];
     [ITAddressBookMgr sharedInstance];
     [PreferencePanel sharedInstance];
+
+    // "iTerm -ReplayBenchmark <path>" replays captured output without opening
+    // any windows, prints the results, and quits.
+    NSString *replayPath = [[NSUserDefaults standardUserDefaults] stringForKey:@"ReplayBenchmark"];
+    if (replayPath) {
+        ReplayBenchmark *benchmark = [[ReplayBenchmark alloc] init];
+        BOOL ok = [benchmark runWithPath:replayPath];
+        [benchmark release];
+        exit(ok ? 0 : 1);
+    }
 }
 
 - (void)applicationDidFinishLaunching:(NSNotification *)aNotification
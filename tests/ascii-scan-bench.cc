@@ -0,0 +1,68 @@
+// Measures how fast printable-ASCII runs are found in spam.cc-style output.
+// Build and run from the tests directory:
+//   c++ -O2 -o ascii-scan-bench ascii-scan-bench.cc && ./ascii-scan-bench
+// "before" is the old byte-at-a-time loop; "after" is AsciiRunLength().
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "../AsciiScan.h"
+
+void setline(char* s, int n) {
+  int l = random() % n;
+  int j;
+  for (j = 0; j < l; ++j) {
+    s[j] = 'A' + (random() % 60);
+  }
+  s[j] = 0;
+}
+
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Walks the stream the way getNextToken does: one run, then one control byte.
+size_t scan(const unsigned char* data, size_t len, bool vectorized) {
+  size_t runs = 0;
+  size_t i = 0;
+  while (i < len) {
+    size_t n = vectorized ? AsciiRunLength(data + i, len - i)
+                          : AsciiRunLengthScalar(data + i, len - i);
+    i += n + 1;
+    runs++;
+  }
+  return runs;
+}
+
+int main(int argc, char*argv[]) {
+  int n;
+  if (argc == 1) {
+    n = 1000000;
+  } else {
+    n = atoi(argv[1]);
+  }
+  size_t capacity = (size_t)n * 100;
+  unsigned char* data = (unsigned char*)malloc(capacity);
+  size_t len = 0;
+  for (int i = 0; i < n; ++i) {
+    char buffer[100];
+    setline(buffer, sizeof(buffer)-1);
+    len += sprintf((char*)data + len, "%s\n", buffer);
+  }
+
+  const int kRounds = 10;
+  double mb = (double)len * kRounds / (1024 * 1024);
+  for (int vectorized = 0; vectorized < 2; ++vectorized) {
+    size_t runs = 0;
+    double start = now();
+    for (int r = 0; r < kRounds; ++r) {
+      runs += scan(data, len, vectorized);
+    }
+    double elapsed = now() - start;
+    printf("%-6s %8.1f MB/s (%zu runs)\n",
+           vectorized ? "after" : "before", mb / elapsed, runs);
+  }
+  free(data);
+  return 0;
+}
@@ -0,0 +1,144 @@
+// Measures decoding of legacy CJK text with a DoubleByteTable.
+// Build and run from the tests directory:
+//   c++ -O2 -o doublebyte-bench doublebyte-bench.cc && ./doublebyte-bench [BIG5|SHIFT_JIS|...]
+// The table is built here with iconv, the way DoubleByteTable.m builds it
+// with CoreFoundation. "before" converts each run with iconv, standing in for
+// -[NSString initWithBytes:length:encoding:]; "after" is DoubleByteRunLength()
+// plus DoubleByteDecodeRun(). The two must produce the same code units.
+#include <iconv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../Utf8Scan.h"
+#include "../DoubleByteTable.h"
+
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Converts bytes to UTF-16 with cd. Returns the number of code units, or -1.
+long convert(iconv_t cd, const unsigned char* bytes, size_t length,
+             uint16_t* out, size_t outElements) {
+  char* in = (char*)bytes;
+  char* o = (char*)out;
+  size_t inLeft = length;
+  size_t outLeft = outElements * 2;
+  iconv(cd, NULL, NULL, NULL, NULL);
+  if (iconv(cd, &in, &inLeft, &o, &outLeft) == (size_t)-1 || inLeft) {
+    return -1;
+  }
+  return (long)(outElements - outLeft / 2);
+}
+
+uint16_t convert_one(iconv_t cd, const unsigned char* bytes, size_t length) {
+  uint16_t units[4];
+  if (convert(cd, bytes, length, units, 4) != 1) {
+    return 0;
+  }
+  if (units[0] == 0xfffd || !Utf8IsSimpleCodePoint(units[0])) {
+    return 0;
+  }
+  return units[0];
+}
+
+uint16_t* build_table(iconv_t cd) {
+  uint16_t* table = (uint16_t*)calloc(DOUBLE_BYTE_TABLE_SIZE, sizeof(uint16_t));
+  unsigned char bytes[2];
+  for (int lead = 0x80; lead <= 0xff; ++lead) {
+    bytes[0] = lead;
+    table[lead] = convert_one(cd, bytes, 1);
+  }
+  for (int lead = 0x80; lead <= 0xff; ++lead) {
+    if (table[lead]) {
+      continue;
+    }
+    bytes[0] = lead;
+    for (int trail = 0x21; trail <= 0xfe; ++trail) {
+      bytes[1] = trail;
+      table[(lead << 8) | trail] = convert_one(cd, bytes, 2);
+    }
+  }
+  return table;
+}
+
+// Lines of random characters from the table separated by newlines.
+size_t make_text(const uint16_t* table, unsigned char* data, int lines) {
+  int codes[DOUBLE_BYTE_TABLE_SIZE];
+  int n = 0;
+  for (int i = 0; i < DOUBLE_BYTE_TABLE_SIZE; ++i) {
+    if (table[i]) {
+      codes[n++] = i;
+    }
+  }
+  size_t len = 0;
+  for (int i = 0; i < lines; ++i) {
+    int count = random() % 40;
+    for (int j = 0; j < count; ++j) {
+      int code = codes[random() % n];
+      if (code > 0xff) {
+        data[len++] = code >> 8;
+      }
+      data[len++] = code & 0xff;
+    }
+    data[len++] = '\n';
+  }
+  return len;
+}
+
+int main(int argc, char* argv[]) {
+  const char* encoding = argc > 1 ? argv[1] : "BIG5";
+  iconv_t cd = iconv_open("UTF-16LE", encoding);
+  if (cd == (iconv_t)-1) {
+    perror(encoding);
+    return 1;
+  }
+  double start = now();
+  uint16_t* table = build_table(cd);
+  printf("table  %8.1f ms\n", (now() - start) * 1000);
+
+  const int kLines = 100000;
+  unsigned char* data = (unsigned char*)malloc(kLines * 81);
+  size_t len = make_text(table, data, kLines);
+  static uint16_t before[4096];
+  static uint16_t after[4096];
+
+  const int kRounds = 10;
+  double mb = (double)len * kRounds / (1024 * 1024);
+  size_t units[2] = { 0, 0 };
+  int mismatches = 0;
+  for (int mode = 0; mode < 2; ++mode) {
+    start = now();
+    for (int r = 0; r < kRounds; ++r) {
+      size_t i = 0;
+      while (i < len) {
+        size_t n = DoubleByteRunLength(table, data + i, len - i);
+        if (mode == 0) {
+          units[0] += convert(cd, data + i, n, before, 4096);
+        } else {
+          units[1] += DoubleByteDecodeRun(table, data + i, n, after);
+        }
+        i += n + 1;
+      }
+    }
+    double elapsed = now() - start;
+    printf("%-6s %8.1f MB/s\n", mode ? "after" : "before", mb / elapsed);
+  }
+
+  // Check that every run decodes the same both ways.
+  size_t i = 0;
+  while (i < len) {
+    size_t n = DoubleByteRunLength(table, data + i, len - i);
+    long a = convert(cd, data + i, n, before, 4096);
+    size_t b = DoubleByteDecodeRun(table, data + i, n, after);
+    if (a != (long)b || memcmp(before, after, b * 2)) {
+      mismatches++;
+    }
+    i += n + 1;
+  }
+  printf("%d mismatched runs (%zu code units)\n", mismatches, units[1]);
+  iconv_close(cd);
+  return mismatches ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+// Measures how fast DWC_RIGHT cells are found in lines of screen_char_t, the
+// way LineBlock records them as lines are appended. Build and run from the
+// tests directory:
+//   c++ -O2 -o dwc-scan-bench dwc-scan-bench.cc && ./dwc-scan-bench
+// "before" is the old cell-at-a-time loop; "after" is FirstCellWithCode().
+// It runs once on plain ASCII and once with CJK in every tenth line.
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "../DWCScan.h"
+
+#define DWC_RIGHT 0xf003
+
+// Same layout as screen_char_t.
+struct Cell {
+  uint16_t code;
+  uint32_t attributes;
+};
+
+void setline(Cell* s, int n, bool cjk) {
+  for (int j = 0; j < n; ++j) {
+    s[j].code = 'A' + (random() % 60);
+    s[j].attributes = random() % 4;
+  }
+  if (cjk) {
+    for (int j = 0; j + 1 < n; j += 2 + random() % 8) {
+      s[j].code = 0x4e00 + (random() % 100);
+      s[j + 1].code = DWC_RIGHT;
+    }
+  }
+}
+
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Counts the DWC_RIGHT cells in each line.
+size_t scan(const Cell* cells, int lines, int width, bool vectorized) {
+  size_t found = 0;
+  for (int l = 0; l < lines; ++l) {
+    const uint16_t* codes = &cells[l * width].code;
+    int i = 0;
+    while (true) {
+      i += vectorized ? FirstCellWithCode(codes + i * DWC_SCAN_CELL_STRIDE, width - i, DWC_RIGHT)
+                      : FirstCellWithCodeScalar(codes + i * DWC_SCAN_CELL_STRIDE, width - i, DWC_RIGHT);
+      if (i == width) {
+        break;
+      }
+      ++found;
+      ++i;
+    }
+  }
+  return found;
+}
+
+int main(int argc, char*argv[]) {
+  int n;
+  if (argc == 1) {
+    n = 100000;
+  } else {
+    n = atoi(argv[1]);
+  }
+  const int kWidth = 80;
+  Cell* cells = (Cell*)malloc(sizeof(Cell) * n * kWidth);
+
+  const int kRounds = 10;
+  double mcells = (double)n * kWidth * kRounds / 1000000;
+  for (int cjk = 0; cjk < 2; ++cjk) {
+    for (int i = 0; i < n; ++i) {
+      setline(cells + i * kWidth, kWidth, cjk && i % 10 == 0);
+    }
+    printf("%s:\n", cjk ? "CJK every tenth line" : "ASCII");
+    for (int vectorized = 0; vectorized < 2; ++vectorized) {
+      size_t found = 0;
+      double start = now();
+      for (int r = 0; r < kRounds; ++r) {
+        found += scan(cells, n, kWidth, vectorized);
+      }
+      double elapsed = now() - start;
+      printf("%-6s %8.1f Mcells/s (%zu found)\n",
+             vectorized ? "after" : "before", mcells / elapsed, found);
+    }
+  }
+  free(cells);
+  return 0;
+}
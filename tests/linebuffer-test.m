@@ -0,0 +1,16 @@
+// Runs LineBufferTest, which checks scrollback wrapping, popping, finding,
+// compaction, compression, and spilling against a plain copy of what was
+// appended. Built and run by "make linebuffer-test". A failed check raises
+// an assertion, so the process exits nonzero.
+#import <Cocoa/Cocoa.h>
+#import "LineBufferTest.h"
+
+int main(int argc, char *argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  LineBufferTest *test = [[LineBufferTest alloc] init];
+  [test runTests];
+  [test release];
+  [pool release];
+  printf("0 failures\n");
+  return 0;
+}
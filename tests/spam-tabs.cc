@@ -13,6 +13,8 @@ void setline(char* s, int n) {
       for (int k = 0; k < r; k++) {
         s[j++] = '\t';
       }
+      // The loop increments j again.
+      j--;
     } else {
       s[j] = 'A' + (random() % 60);
     }
@@ -29,8 +31,10 @@ int main(int argc, char*argv[]) {
   }
   cm = argc==3;
   for (int i = 0; i < n; ++i) {
-    char buffer[100];
-    setline(buffer, sizeof(buffer)-1);
+    // Lines are up to 99 characters, or 297 with cm set, each of which
+    // takes up to 5 bytes.
+    char buffer[99 * 3 * 5 + 1];
+    setline(buffer, 99);
     printf("%s\n", buffer);
   }
   return 0;
@@ -30,8 +30,10 @@ int main(int argc, char*argv[]) {
   }
   cm = argc==3;
   for (int i = 0; n < 0 || i < n; ++i) {
-    char buffer[100];
-    setline(buffer, sizeof(buffer)-1);
+    // Lines are up to 99 characters, or 297 with cm set, each of which
+    // takes up to 5 bytes.
+    char buffer[99 * 3 * 5 + 1];
+    setline(buffer, 99);
     printf("%s\n", buffer);
   }
   return 0;
@@ -0,0 +1,223 @@
+// Measures how fast runs of non-ASCII UTF-8 are validated and decoded.
+// Build and run from the tests directory:
+//   c++ -O2 -o utf8-scan-bench utf8-scan-bench.cc && ./utf8-scan-bench
+// "before" is the old code point at a time loop from decode_utf8, which was
+// followed by -[NSString initWithBytes:length:encoding:] (not measured here);
+// "after" is Utf8ValidRunLength(), and "decode" adds Utf8DecodeValidRun(),
+// which replaces the NSString. Random garbage is also checked to make sure
+// the old and new validators accept the same runs, and code points that
+// normalization changes are checked to be excluded from the simple set.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../Utf8Scan.h"
+
+// Copied from VT100Terminal.m.
+static int decode_utf8_char(const unsigned char *datap,
+                            size_t datalen,
+                            unsigned int *result)
+{
+    unsigned int theChar;
+    int utf8Length;
+    unsigned char c;
+    unsigned int smallest[7] = { 0, 0, 0x80UL, 0x800UL, 0x10000UL, 0x200000UL, 0x4000000UL };
+
+    if (datalen == 0) {
+        return 0;
+    }
+
+    c = *datap;
+    if ((c & 0x80) == 0x00) {
+        *result = c;
+        return 1;
+    } else if ((c & 0xE0) == 0xC0) {
+        theChar = c & 0x1F;
+        utf8Length = 2;
+    } else if ((c & 0xF0) == 0xE0) {
+        theChar = c & 0x0F;
+        utf8Length = 3;
+    } else if ((c & 0xF8) == 0xF0) {
+        theChar = c & 0x07;
+        utf8Length = 4;
+    } else if ((c & 0xFC) == 0xF8) {
+        theChar = c & 0x03;
+        utf8Length = 5;
+    } else if ((c & 0xFE) == 0xFC) {
+        theChar = c & 0x01;
+        utf8Length = 6;
+    } else {
+        return -1;
+    }
+    for (int i = 1; i < utf8Length; i++) {
+        if (datalen <= (size_t)i) {
+            return 0;
+        }
+        c = datap[i];
+        if ((c & 0xc0) != 0x80) {
+            return -i;
+        }
+        theChar = (theChar << 6) | (c & 0x3F);
+    }
+
+    if (theChar < smallest[utf8Length]) {
+        return -utf8Length;
+    }
+
+    *result = theChar;
+    return utf8Length;
+}
+
+// The loop from the old decode_utf8.
+size_t old_run_length(const unsigned char *p, size_t len) {
+  size_t i = 0;
+  unsigned int theChar;
+  while (true) {
+    int n = decode_utf8_char(p + i, len - i, &theChar);
+    if (n <= 0 || theChar < 0x80 ||
+        (theChar >= 0xD800 && theChar <= 0xDFFF) || theChar > 0x10FFFF) {
+      break;
+    }
+    i += n;
+  }
+  return i;
+}
+
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Appends the UTF-8 encoding of c.
+size_t put(unsigned char* s, unsigned int c) {
+  if (c < 0x800) {
+    s[0] = 0xc0 | (c >> 6);
+    s[1] = 0x80 | (c & 0x3f);
+    return 2;
+  } else if (c < 0x10000) {
+    s[0] = 0xe0 | (c >> 12);
+    s[1] = 0x80 | ((c >> 6) & 0x3f);
+    s[2] = 0x80 | (c & 0x3f);
+    return 3;
+  }
+  s[0] = 0xf0 | (c >> 18);
+  s[1] = 0x80 | ((c >> 12) & 0x3f);
+  s[2] = 0x80 | ((c >> 6) & 0x3f);
+  s[3] = 0x80 | (c & 0x3f);
+  return 4;
+}
+
+// Lines of ideographs separated by newlines. If mixed is set, 30% of the
+// characters are kana and emoji instead.
+size_t make_cjk(unsigned char* data, int lines, bool mixed) {
+  size_t len = 0;
+  for (int i = 0; i < lines; ++i) {
+    int n = random() % 40;
+    for (int j = 0; j < n; ++j) {
+      int r = mixed ? random() % 10 : 0;
+      if (r < 7) {
+        len += put(data + len, 0x4e00 + random() % 0x5000);
+      } else if (r < 9) {
+        len += put(data + len, 0x3041 + random() % 0x50);
+      } else {
+        len += put(data + len, 0x1f600 + random() % 0x40);
+      }
+    }
+    data[len++] = '\n';
+  }
+  return len;
+}
+
+// mode 0 is before, 1 is after, 2 is after plus decoding.
+size_t scan(const unsigned char* data, size_t len, int mode) {
+  static uint16_t units[4096];
+  size_t decoded = 0;
+  size_t i = 0;
+  while (i < len) {
+    size_t n;
+    if (mode) {
+      int simple;
+      n = Utf8ValidRunLength(data + i, len - i, &simple);
+      if (mode == 2) {
+        Utf8DecodeValidRun(data + i, n, units);
+      }
+    } else {
+      n = old_run_length(data + i, len - i);
+    }
+    decoded += n;
+    i += n + 1;
+  }
+  return decoded;
+}
+
+int check_random() {
+  unsigned char buffer[64];
+  int failures = 0;
+  for (int i = 0; i < 2000000; ++i) {
+    size_t len = random() % sizeof(buffer);
+    for (size_t j = 0; j < len; ++j) {
+      // Bias towards bytes that are interesting for UTF-8.
+      buffer[j] = (random() % 4) ? (0x80 + random() % 0x80) : random();
+    }
+    int simple;
+    size_t a = Utf8ValidRunLength(buffer, len, &simple);
+    size_t b = old_run_length(buffer, len);
+    if (a != b) {
+      if (failures++ < 10) {
+        printf("Mismatch: new=%zu old=%zu\n", a, b);
+      }
+    }
+  }
+  return failures;
+}
+
+// Code points that NFC changes or that combine with what precedes them must
+// never be simple. Returns the number that are.
+int check_not_simple() {
+  // Singleton decompositions, composition exclusions, and combining marks.
+  static const unsigned int kCodePoints[] = {
+    0x0300, 0x0340, 0x0958, 0x2000, 0x20d0, 0x2126, 0x212a, 0x212b, 0x2329,
+    0x232a, 0x2adc, 0x302a, 0x3099, 0x309a, 0xf900, 0xfb1d, 0x1d15e, 0x2f800
+  };
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(kCodePoints) / sizeof(kCodePoints[0]); ++i) {
+    if (Utf8IsSimpleCodePoint(kCodePoints[i])) {
+      printf("U+%04X should not be simple\n", kCodePoints[i]);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char*argv[]) {
+  int n;
+  if (argc == 1) {
+    n = 100000;
+  } else {
+    n = atoi(argv[1]);
+  }
+  unsigned char* data = (unsigned char*)malloc((size_t)n * 200);
+  const int kRounds = 10;
+  const char* names[] = { "before", "after", "decode" };
+  for (int mixed = 0; mixed < 2; ++mixed) {
+    size_t len = make_cjk(data, n, mixed);
+    double mb = (double)len * kRounds / (1024 * 1024);
+    printf("%s:\n", mixed ? "ideographs, kana, and emoji" : "ideographs");
+    for (int mode = 0; mode < 3; ++mode) {
+      size_t decoded = 0;
+      double start = now();
+      for (int r = 0; r < kRounds; ++r) {
+        decoded += scan(data, len, mode);
+      }
+      double elapsed = now() - start;
+      printf("%-6s %8.1f MB/s (%zu bytes)\n", names[mode], mb / elapsed, decoded);
+    }
+  }
+  free(data);
+
+  int failures = check_random();
+  printf("%d mismatches on random input\n", failures);
+  failures += check_not_simple();
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+// Checks that the resumable escape sequence parser gives the same results no
+// matter how its input is split up. Built and run by "make core-test":
+//   vt100parser-test [file ...]
+// Each file (e.g., the .txt captures in this directory) is parsed all at
+// once and then with one more byte arriving at a time, followed by random
+// input. Exits nonzero on any difference.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../VT100Parser.h"
+
+// Summary of everything the parser reported, for comparison.
+typedef struct {
+  unsigned long hash;
+  int sequences;
+} Log;
+
+static void add(Log* log, long value) {
+  log->hash = log->hash * 31 + (unsigned long)value;
+}
+
+// Logs the controls the parser has saved but not yet returned, and marks
+// them returned the way VT100Terminal does.
+static void takeControls(Log* log, VT100Parser* parser) {
+  while (parser->nextControl < parser->numControls) {
+    add(log, parser->controls[parser->nextControl++]);
+  }
+}
+
+static void record(Log* log, const VT100Parser* parser, int isOSC) {
+  int i;
+  log->sequences++;
+  add(log, isOSC);
+  add(log, (long)parser->consumed);
+  if (isOSC) {
+    add(log, parser->oscMode);
+    if (parser->oscMode != -2) {
+      add(log, (long)parser->oscStringStart);
+      add(log, (long)parser->oscStringEnd);
+    }
+  } else {
+    add(log, parser->csi.cmd);
+    add(log, parser->csi.count);
+    add(log, parser->csi.question);
+    add(log, parser->csi.modifier);
+    for (i = 0; i < VT100CSIPARAM_MAX; i++) {
+      add(log, parser->csi.p[i]);
+    }
+  }
+}
+
+// Parses data as if "available" bytes had arrived so far, growing it by
+// "step" bytes each time the parser asks for more, the way VT100Terminal
+// does.
+static Log parse(const unsigned char* data, size_t len, size_t step) {
+  Log log = { 0, 0 };
+  VT100Parser parser;
+  size_t offset = 0;
+  size_t available = step < len ? step : len;
+
+  VT100ParserReset(&parser);
+  while (offset < len) {
+    const unsigned char* p = data + offset;
+    size_t n = available - offset;
+    int isOSC;
+    int done;
+
+    if (n == 0) {
+      available += step;
+      if (available > len) {
+        available = len;
+      }
+      continue;
+    }
+    if (parser.state == VT100_PARSE_GROUND) {
+      if (n >= 2 && p[0] == VT100CC_ESC && p[1] == '[') {
+        VT100ParserBeginCSI(&parser);
+      } else if (n >= 2 && p[0] == VT100CC_ESC && p[1] == ']') {
+        VT100ParserBeginOSC(&parser);
+      } else if (n < 2 && p[0] == VT100CC_ESC && available < len) {
+        available += step;
+        if (available > len) {
+          available = len;
+        }
+        continue;
+      } else {
+        offset++;
+        continue;
+      }
+    }
+    isOSC = (parser.state == VT100_PARSE_OSC_MODE ||
+             parser.state == VT100_PARSE_OSC_STRING);
+    done = isOSC ? VT100ParserAdvanceOSC(&parser, p, n)
+                 : VT100ParserAdvanceCSI(&parser, p, n);
+    if (!done && parser.numControls == VT100CSI_CONTROLS_MAX) {
+      // The parser stopped early so its controls can be returned.
+      takeControls(&log, &parser);
+      continue;
+    }
+    takeControls(&log, &parser);
+    if (done) {
+      record(&log, &parser, isOSC);
+      offset += parser.consumed;
+      VT100ParserReset(&parser);
+    } else if (available < len) {
+      available += step;
+      if (available > len) {
+        available = len;
+      }
+    } else {
+      // The input ends in the middle of a sequence.
+      add(&log, -1);
+      break;
+    }
+  }
+  return log;
+}
+
+static int check(const char* name, const unsigned char* data, size_t len) {
+  Log whole = parse(data, len, len);
+  size_t step;
+  for (step = 1; step <= 7; step++) {
+    Log pieces = parse(data, len, step);
+    if (pieces.hash != whole.hash || pieces.sequences != whole.sequences) {
+      printf("%s: %d sequences whole but %d in pieces of %d bytes\n",
+             name, whole.sequences, pieces.sequences, (int)step);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A CSI sequence with more controls in it than the parser saves at once
+// must still report every one of them, in order, before its final byte.
+static int checkManyControls(void) {
+  unsigned char data[3 + 3 * VT100CSI_CONTROLS_MAX + 1];
+  const unsigned char controls[] = { VT100CC_BS, VT100CC_CR, VT100CC_LF };
+  VT100Parser parser;
+  size_t len = 0;
+  int seen = 0;
+  int i;
+
+  data[len++] = VT100CC_ESC;
+  data[len++] = '[';
+  data[len++] = '2';
+  for (i = 0; i < 3 * VT100CSI_CONTROLS_MAX; i++) {
+    data[len++] = controls[i % 3];
+  }
+  data[len++] = 'A';
+
+  VT100ParserReset(&parser);
+  VT100ParserBeginCSI(&parser);
+  for (;;) {
+    int done = VT100ParserAdvanceCSI(&parser, data, len);
+    if (!done && parser.numControls != VT100CSI_CONTROLS_MAX) {
+      printf("many controls: parser stopped with %d controls\n",
+             parser.numControls);
+      return 1;
+    }
+    while (parser.nextControl < parser.numControls) {
+      if (parser.controls[parser.nextControl++] != controls[seen++ % 3]) {
+        printf("many controls: control %d out of order\n", seen - 1);
+        return 1;
+      }
+    }
+    if (done) {
+      break;
+    }
+  }
+  if (seen != 3 * VT100CSI_CONTROLS_MAX || parser.csi.cmd != 'A' ||
+      parser.csi.p[0] != 2 || parser.consumed != len) {
+    printf("many controls: got %d controls and cmd %c\n",
+           seen, parser.csi.cmd);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  int failures = 0;
+  int i;
+
+  failures += checkManyControls();
+
+  for (i = 1; i < argc; i++) {
+    FILE* f = fopen(argv[i], "rb");
+    if (!f) {
+      perror(argv[i]);
+      return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char* data = (unsigned char*)malloc(len > 0 ? len : 1);
+    if (fread(data, 1, len, f) != (size_t)len) {
+      perror(argv[i]);
+      return 1;
+    }
+    fclose(f);
+    failures += check(argv[i], data, len);
+    free(data);
+  }
+
+  // Random input heavy in the bytes that matter to the parser.
+  const char alphabet[] = "\033\033[[]];;;0123456789?>'&\007\010\r\nPmHz\\";
+  unsigned char buffer[256];
+  srand(1);
+  for (i = 0; i < 20000; i++) {
+    size_t len = rand() % sizeof(buffer);
+    size_t j;
+    char name[32];
+    for (j = 0; j < len; j++) {
+      buffer[j] = (rand() % 8) ? alphabet[rand() % (sizeof(alphabet) - 1)]
+                                 : rand();
+    }
+    sprintf(name, "random input %d", i);
+    failures += check(name, buffer, len);
+  }
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}